@@ -10,18 +10,45 @@
 # *   Contact: <mail@christoph-lampert.org>              *
 # ********************************************************
 
-from ctypes import Structure,c_int,c_double
+from ctypes import Structure,c_int,c_long,c_double,c_char_p,c_void_p,POINTER,byref
 from numpy.ctypeslib import load_library,ndpointer
 
 class Box_struct(Structure):
-        """Structure to hold left,top,right,bottom and score of a box instance.
+        """Structure to hold left,top,right,bottom, score and gap of a box instance.
            The fields have to coincide with the C-version in pyramid_search.h
         """
         _fields_ = [("left", c_int), 
                     ("top", c_int), 
                     ("right", c_int), 
                     ("bottom", c_int), 
-                    ("score", c_double) ]
+                    ("score", c_double),
+                    ("gap", c_double) ]
+
+
+class Stats_struct(Structure):
+        """Statistics of the last search, see ESSStats in ess.hh.
+           The fields have to coincide with the C-version.
+        """
+        _fields_ = [("iterations", c_long),
+                    ("bound_evaluations", c_long),
+                    ("peak_heap", c_long),
+                    ("final_heap", c_long),
+                    ("heap_growths", c_long),
+                    ("pruned_states", c_long),
+                    ("splits", c_long*4),
+                    ("setup_time", c_double),
+                    ("search_time", c_double),
+                    ("hit_iteration_limit", c_int),
+                    ("stopped_early", c_int) ]
+
+
+def last_search_stats():
+    """Statistics of the last subwindow_search_pyramid call."""
+    pyramidlib = load_library("libess.so",".")
+    pyramidlib.ess_get_stats.argtypes = [c_void_p, POINTER(Stats_struct)]
+    stats = Stats_struct()
+    pyramidlib.ess_get_stats(None, byref(stats))
+    return stats
 
 
 def subwindow_search_pyramid(numpoints, width, height, xpos, ypos, clstid, numbins, numlevels, weights):
@@ -42,6 +69,216 @@ def subwindow_search_pyramid(numpoints, width, height, xpos, ypos, clstid, numbi
     return box
 
 
+def subwindow_search_batch(points, widths, heights, numbins, numlevels, weights, numthreads=1):
+    """Subwindow search on many images with the same weights, spread over 
+       numthreads worker threads. points is a list of (xpos,ypos,clstid) 
+       arrays, one per image. Returns the list of best boxes."""
+    pyramidlib = load_library("libess.so",".")
+
+    DoublePtr = POINTER(c_double)
+    pyramidlib.pyramid_search_batch.restype = c_int
+    pyramidlib.pyramid_search_batch.argtypes = [c_int, 
+            POINTER(c_int), POINTER(c_int), POINTER(c_int), 
+            POINTER(DoublePtr), POINTER(DoublePtr), POINTER(DoublePtr),
+            c_int, c_int,
+            ndpointer(dtype=c_double, ndim=1, flags='C_CONTIGUOUS'),
+            c_int, POINTER(Box_struct)]
+
+    numimages = len(points)
+    numpoints = (c_int*numimages)(*[len(x) for (x,y,c) in points])
+    cwidths = (c_int*numimages)(*widths)
+    cheights = (c_int*numimages)(*heights)
+    xpos = (DoublePtr*numimages)(*[x.ctypes.data_as(DoublePtr) for (x,y,c) in points])
+    ypos = (DoublePtr*numimages)(*[y.ctypes.data_as(DoublePtr) for (x,y,c) in points])
+    clstid = (DoublePtr*numimages)(*[c.ctypes.data_as(DoublePtr) for (x,y,c) in points])
+    boxes = (Box_struct*numimages)()
+
+    pyramidlib.pyramid_search_batch(numimages, numpoints, cwidths, cheights, 
+                      xpos, ypos, clstid, numbins, numlevels, weights, numthreads, boxes)
+    return list(boxes)
+
+
+class SearchContext(object):
+    """Search context that keeps its buffers between searches. Searches
+       in different contexts can run at the same time. Options are passed
+       as keywords, e.g. SearchContext(numthreads=4, iterations=100000)
+    """
+    def __init__(self, **options):
+        self.lib = load_library("libess.so",".")
+        self.lib.ess_create.restype = c_void_p
+        self.lib.ess_destroy.argtypes = [c_void_p]
+        self.lib.ess_set_option.argtypes = [c_void_p, c_char_p, c_int]
+        self.lib.ess_search.restype = Box_struct
+        self.lib.ess_search.argtypes = [c_void_p,c_int,c_int,c_int,
+            ndpointer(dtype=c_double, ndim=1, flags='C_CONTIGUOUS'),
+            ndpointer(dtype=c_double, ndim=1, flags='C_CONTIGUOUS'),
+            ndpointer(dtype=c_double, ndim=1, flags='C_CONTIGUOUS'),
+            c_int, c_int,
+            ndpointer(dtype=c_double, ndim=1, flags='C_CONTIGUOUS')]
+        self.lib.ess_search_topk.restype = c_int
+        self.lib.ess_search_topk.argtypes = self.lib.ess_search.argtypes + [c_int, POINTER(Box_struct)]
+        self.lib.ess_search_model.restype = Box_struct
+        self.lib.ess_search_model.argtypes = [c_void_p,c_void_p,c_int,c_int,c_int,
+            ndpointer(dtype=c_double, ndim=1, flags='C_CONTIGUOUS'),
+            ndpointer(dtype=c_double, ndim=1, flags='C_CONTIGUOUS'),
+            ndpointer(dtype=c_double, ndim=1, flags='C_CONTIGUOUS')]
+        self.lib.ess_search_model_topk.restype = c_int
+        self.lib.ess_search_model_topk.argtypes = self.lib.ess_search_model.argtypes + [c_int, POINTER(Box_struct)]
+        self.lib.ess_search_multiclass.restype = c_int
+        self.lib.ess_search_multiclass.argtypes = [c_void_p,c_int,POINTER(c_void_p),
+            c_int,c_int,c_int,
+            ndpointer(dtype=c_double, ndim=1, flags='C_CONTIGUOUS'),
+            ndpointer(dtype=c_double, ndim=1, flags='C_CONTIGUOUS'),
+            ndpointer(dtype=c_double, ndim=1, flags='C_CONTIGUOUS'),
+            c_int, POINTER(Box_struct)]
+        self.lib.ess_search_sequence.restype = Box_struct
+        self.lib.ess_search_sequence.argtypes = self.lib.ess_search_model.argtypes
+        self.lib.ess_sequence_reset.argtypes = [c_void_p]
+        DoublePtr = POINTER(c_double)
+        self.lib.ess_search_subvolume.restype = Box_struct
+        self.lib.ess_search_subvolume.argtypes = [c_void_p,c_void_p,c_int,
+            POINTER(c_int),c_int,c_int,
+            POINTER(DoublePtr), POINTER(DoublePtr), POINTER(DoublePtr),
+            POINTER(c_int), POINTER(c_int)]
+        self.lib.ess_search_large.restype = c_int
+        self.lib.ess_search_large.argtypes = self.lib.ess_search_model.argtypes + [POINTER(Box_struct)]
+        self.lib.ess_get_stats.argtypes = [c_void_p, POINTER(Stats_struct)]
+        self.lib.ess_memory_usage.restype = c_long
+        self.lib.ess_memory_usage.argtypes = [c_void_p]
+        self.ctx = self.lib.ess_create()
+        for name,value in options.items():
+            if self.lib.ess_set_option(self.ctx, name, value) != 0:
+                raise ValueError("invalid option %s=%s" % (name,value))
+
+    def __del__(self):
+        if self.ctx:
+            self.lib.ess_destroy(self.ctx)
+            self.ctx = None
+
+    def search_pyramid(self, numpoints, width, height, xpos, ypos, clstid, numbins, numlevels, weights):
+        """Like subwindow_search_pyramid, but using this context."""
+        return self.lib.ess_search(self.ctx, numpoints, width, height, 
+                      xpos, ypos, clstid, numbins, numlevels, weights)
+
+    def search_topk(self, k, numpoints, width, height, xpos, ypos, clstid, numbins, numlevels, weights):
+        """Up to k best boxes that don't share any points, or with the 
+           option overlap set, that overlap each other at most that much."""
+        boxes = (Box_struct*k)()
+        numfound = self.lib.ess_search_topk(self.ctx, numpoints, width, height, 
+                      xpos, ypos, clstid, numbins, numlevels, weights, k, boxes)
+        return list(boxes[:numfound])
+
+    def search_model(self, model, numpoints, width, height, xpos, ypos, clstid):
+        """Search with a compiled Model instead of passing the weights."""
+        return self.lib.ess_search_model(self.ctx, model.model, numpoints, width, height, 
+                      xpos, ypos, clstid)
+
+    def search_model_topk(self, model, k, numpoints, width, height, xpos, ypos, clstid):
+        """search_topk with a compiled Model."""
+        boxes = (Box_struct*k)()
+        numfound = self.lib.ess_search_model_topk(self.ctx, model.model, numpoints, width, height, 
+                      xpos, ypos, clstid, k, boxes)
+        return list(boxes[:numfound])
+
+    def search_multiclass(self, models, numpoints, width, height, xpos, ypos, clstid, bestonly=False):
+        """Search the same points with a list of Models, e.g. one per object
+           class. Returns the list of best boxes, one per model, or with 
+           bestonly the pair (index of the best model, its box)."""
+        nummodels = len(models)
+        cmodels = (c_void_p*nummodels)(*[m.model for m in models])
+        boxes = (Box_struct*nummodels)()
+        best = self.lib.ess_search_multiclass(self.ctx, nummodels, cmodels, 
+                      numpoints, width, height, xpos, ypos, clstid, int(bestonly), boxes)
+        if bestonly:
+            return (best, boxes[0])
+        return list(boxes)
+
+    def search_sequence(self, model, numpoints, width, height, xpos, ypos, clstid):
+        """Search the next frame of a video, starting from where the search 
+           of the frame before ended. Same result as search_model."""
+        return self.lib.ess_search_sequence(self.ctx, model.model, numpoints, width, height, 
+                      xpos, ypos, clstid)
+
+    def reset_sequence(self):
+        """Start the next frame of search_sequence cold, e.g. after a cut."""
+        self.lib.ess_sequence_reset(self.ctx)
+
+    def search_subvolume(self, model, points, width, height):
+        """Best box and range of frames in a short window. points is a list 
+           of (xpos,ypos,clstid) arrays, one per frame. Returns the triple 
+           (box, first frame, last frame)."""
+        DoublePtr = POINTER(c_double)
+        numframes = len(points)
+        numpoints = (c_int*numframes)(*[len(x) for (x,y,c) in points])
+        xpos = (DoublePtr*numframes)(*[x.ctypes.data_as(DoublePtr) for (x,y,c) in points])
+        ypos = (DoublePtr*numframes)(*[y.ctypes.data_as(DoublePtr) for (x,y,c) in points])
+        clstid = (DoublePtr*numframes)(*[c.ctypes.data_as(DoublePtr) for (x,y,c) in points])
+        first, last = c_int(), c_int()
+        box = self.lib.ess_search_subvolume(self.ctx, model.model, numframes, numpoints, 
+                      width, height, xpos, ypos, clstid, byref(first), byref(last))
+        return (box, first.value, last.value)
+
+    def search_large(self, model, numpoints, width, height, xpos, ypos, clstid):
+        """Like search_model, for images of any size, searched in tiles. 
+           Only for models with a single level."""
+        box = Box_struct()
+        if self.lib.ess_search_large(self.ctx, model.model, numpoints, width, height, 
+                      xpos, ypos, clstid, byref(box)) != 0:
+            raise ValueError("search_large needs a model with one level")
+        return box
+
+    def memory_usage(self):
+        """Bytes used by the integral images of the last search."""
+        return self.lib.ess_memory_usage(self.ctx)
+
+    def stats(self):
+        """Statistics of the last search with this context, e.g. 
+           stats().iterations or stats().search_time"""
+        stats = Stats_struct()
+        self.lib.ess_get_stats(self.ctx, byref(stats))
+        return stats
+
+
+class Model(object):
+    """Pyramid weights compiled once for many searches, see 
+       SearchContext.search_model. The weights are copied."""
+    def __init__(self, numbins, numlevels, weights):
+        self.lib = load_library("libess.so",".")
+        self.lib.ess_model_create.restype = c_void_p
+        self.lib.ess_model_create.argtypes = [c_int, c_int,
+            ndpointer(dtype=c_double, ndim=1, flags='C_CONTIGUOUS')]
+        self.lib.ess_model_destroy.argtypes = [c_void_p]
+        self.model = self.lib.ess_model_create(numbins, numlevels, weights)
+        if not self.model:
+            raise ValueError("invalid model")
+
+    def __del__(self):
+        if self.model:
+            self.lib.ess_model_destroy(self.model)
+            self.model = None
+
+
+KERNEL_INTERSECTION = 1
+KERNEL_CHI2 = 2
+
+class KernelModel(Model):
+    """SVM with an additive kernel (KERNEL_INTERSECTION or KERNEL_CHI2) 
+       on the cluster counts of a box, used like Model. vectors holds 
+       numbins counts for each support vector, row after row, alpha their 
+       coefficients (label times dual weight). The data is copied."""
+    def __init__(self, kernel, numbins, vectors, alpha, bias=0.):
+        self.lib = load_library("libess.so",".")
+        self.lib.ess_kernel_model_create.restype = c_void_p
+        self.lib.ess_kernel_model_create.argtypes = [c_int, c_int, c_int,
+            ndpointer(dtype=c_double, ndim=1, flags='C_CONTIGUOUS'),
+            ndpointer(dtype=c_double, ndim=1, flags='C_CONTIGUOUS'), c_double]
+        self.lib.ess_model_destroy.argtypes = [c_void_p]
+        self.model = self.lib.ess_kernel_model_create(kernel, numbins, len(alpha),
+                                                      vectors, alpha, bias)
+        if not self.model:
+            raise ValueError("invalid model")
+
+
 def subwindow_search(numpoints, width, height, xpos, ypos, clstid, weights):
     """Subwindow search for best box with linear bag-of-words kernel."""
     return subwindow_search_pyramid(numpoints, width, height, xpos, ypos, \
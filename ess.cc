@@ -30,31 +30,431 @@
  ********************************************************/
 
 #include <cassert>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 #include <iomanip>
 #include <fstream>
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include "ess.hh"
 #include "quality_pyramid.hh"
+#include "quality_pyramid_simd.hh"
+#include "quality_tile.hh"
+#include "quality_kernel.hh"
+
+#ifdef __MAIN__
+#include "ess_data.hh"
+#include "ess_server.hh"
+#endif
 
 #define MAXDATAPOINTS 100000 // ad hoc limits
 #define MAXWIDTH 8192
 #define MAXHEIGHT 8192
 #define MAXCLUSTERS 100000
+#define MAXSPLITWAYS 16      // children of one state, see split_children()
+#define PRUNEMARGIN 1e-6     // relative, see can_prune()
+#define MAXTILES 2048        // tiles per row or column of a large image, see search_large()
+#define TOPTILES 64          // ... of its coarsest level of tiles
+#define TILEFACTOR 8         // finer tiles per side of a tile
 
-static int maxresults = 1;
-static int numlevels = 1;
-static int maxiterations = 10000000;
-static int verbose = 0;
+// compiled weights, see ess_model_create() and ess_kernel_model_create()
+struct ESSModel {
+    PyramidModel pyramid;
+    KernelModel kernel;     // kernel.kernel is 0 for pyramid models
+};
 
-// Here we chose the class to calculate quality bounds for us.
-// It has to have at least the interface of the QualityFunction class.
-//
-// We use 'PyramidQualityFunction', because it's flexible.
-// We use 'BoxQualityFunction' is a little easier to set up.
-static PyramidQualityFunction quality_bound;
+// one level of tiles, see search_large()
+struct TileLevel {
+    int tilesize;
+    int numtilesx, numtilesy;
+    TileQualityFunction quality;
+};
+
+
+// Everything a search needs lives in a context, so several searches can
+// run at the same time, each with its own context. Buffers are kept
+// between calls: repeated searches on images of the same size don't
+// allocate memory at all.
+struct ESSContext {
+    // Here we chose the class to calculate quality bounds for us.
+    // It has to have at least the interface of the QualityFunction class.
+    //
+    // We use 'PyramidQualityFunction', because it's flexible.
+    // We use 'BoxQualityFunction' is a little easier to set up.
+    // 'InterleavedPyramidQualityFunction' computes the same as the 
+    // pyramid, but with a memory layout for vectorized bounds.
+    PyramidQualityFunction pyramid_quality;
+    InterleavedPyramidQualityFunction interleaved_quality;
+    QualityFunction* pyramid_bound;   // one of the two, for pyramid models
+    KernelQualityFunction kernel_quality;   // for kernel models
+    QualityFunction* quality_bound;   // the one in use
+
+    // The heap stores the search states by value and keeps its memory
+    // between calls, so later searches hardly touch the allocator at all.
+    sstate_heap heap;
+    ESSModel model;     // for searches that pass the weights directly
+
+    // points of the current image, see start_points(). On the compressed
+    // grid if compressed, the grid size includes the padding.
+    int numpoints;
+    int gridwidth, gridheight;
+    double *xpos, *ypos, *clst;
+
+    // settings, see ess_set_option()
+    int maxiterations;
+    int verbose;
+    int numthreads;
+    int splitways;
+    int coarse;                 // splits are aligned to it, see split_state()
+
+    // wall clock time in seconds for the last search
+    double setup_time;
+    double search_time;
+
+    // counters for the last search, see ess_get_stats()
+    long numiterations;         // states split
+    long numbounds;             // calls of quality_bound->upper_bound()
+    long numsplits[4];          // how often each coordinate was split
+    unsigned long final_heap;   // heap size when the search ended
+    bool hit_iteration_limit;   // a search stopped at maxiterations
+    bool stopped_early;         // a result is not converged, see search_result()
+
+    // coordinate compression, see compress_coordinates()
+    bool compress;
+    bool compressed;            // current search runs on compressed grid
+    std::vector<int> xvalues, yvalues;
+    std::vector<double> xcompressed, ycompressed;
+
+    // incumbent pruning, see push_state()
+    bool prune;
+    bool keep_pruned;           // keep pruned states for later searches (top-k)
+    double incumbent;           // score of the best box seen so far
+    std::vector<sstate> pruned_states;
+    unsigned long purge_size;   // heap size at which to purge it again
+    long numpruned;
+    unsigned long peak_heap;
+    sstate incumbent_state;     // the box with score incumbent
+
+    // top-k in a single search, see suppressed()
+    double maxoverlap;          // intersection over union, 0 = remove the points instead
+    std::vector<sstate> accepted;   // results so far, as single box states
+
+    // early exit, see stop_early()
+    double maxgap;              // relative gap between bound and incumbent
+    double timelimit;           // seconds for one call, 0 = no limit
+    double deadline;            // wall time at which the current call stops
+    bool track_incumbent;       // score boxes during the search
+
+    // video, see search_sequence() and search_subvolume()
+    bool has_previous;          // previous is the best box of the frame before
+    sstate previous;
+    int previous_width, previous_height;
+    std::vector<sstate> warmstates;     // partition of the boxes to start the next frame with
+    std::vector<sstate> freshstates;
+    std::vector<double> windowx, windowy, windowclst;   // all frames of a window
+    std::vector<int> framestart;        // first point of each frame in the window
+
+    // large images, see search_large()
+    int tilesize;               // pixels per side of a tile of the finest level, at least
+    std::vector<TileLevel> tilelevels;  // coarsest first
+    std::vector<double> tilex, tiley;   // tile of every point
+    std::vector<int> tilestart;         // first point of each tile in tilepoints
+    std::vector<int> tilepoints;        // the points, tile by tile
+    std::vector<double> finex, finey, fineclst;     // points on the border of a range of tiles
+    std::vector<int> fineindex;
+
+    ESSContext() : pyramid_bound(&pyramid_quality), quality_bound(&pyramid_quality), 
+                   numpoints(0), gridwidth(0), gridheight(0), xpos(NULL), ypos(NULL), clst(NULL),
+                   maxiterations(10000000), verbose(0), numthreads(1), splitways(2), coarse(0),
+                   setup_time(0.), search_time(0.), numiterations(0), numbounds(0),
+                   final_heap(0), hit_iteration_limit(false), stopped_early(false),
+                   compress(false), compressed(false),
+                   prune(false), keep_pruned(false), incumbent(0.), purge_size(0), 
+                   numpruned(0), peak_heap(0), 
+                   maxoverlap(0.), maxgap(0.), timelimit(0.), deadline(0.), track_incumbent(false),
+                   has_previous(false), previous_width(0), previous_height(0), tilesize(64) { }
+};
+
+
+// current wall clock time in seconds
+static double wall_time() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+// split a state into two halves along its widest coordinate interval.
+// With argalign > 1 (a power of two), the split goes through the last 
+// multiple of argalign before the middle, if the interval contains one. 
+// Starting from the whole image, every interval at least argalign wide 
+// then lies between multiples of argalign, see BoxQualityFunction::set_coarse().
+// returns the split index, or -1 if the state can't be split any further
+static int split_state(const sstate* curstate, sstate* newstate0, sstate* newstate1, 
+                       int argalign=0) {
+    const int splitindex = curstate->maxindex();
+    if (splitindex < 0)
+        return -1;
+
+    const int low = curstate->low[splitindex];
+    const int high = curstate->high[splitindex];
+    *newstate0 = *curstate;
+    *newstate1 = *curstate;
+    const int aligned = ((low+high)>>1) & ~(argalign-1);
+    if ((argalign > 1) && (aligned >= low)) {
+        newstate0->high[splitindex] = aligned;
+        newstate1->low[splitindex] = aligned+1;
+    } else {
+        newstate0->high[splitindex] = (low+high)>>1;
+        newstate1->low[splitindex] = (low+high+1)>>1;
+    }
+    return splitindex;
+}
+
+// Multi-way splitting: split a state into up to ctx->splitways children 
+// at once, by splitting the halves again along their own widest interval, 
+// and so on. Children without any legal box are dropped, converged ones 
+// are kept as they are. A heap pop then makes more progress, and the 
+// bounds of all children are computed together, see bounds_of().
+// argchildren needs room for MAXSPLITWAYS states.
+// returns the number of children, or -1 if the state has converged
+static int split_children(ESSContext* ctx, const sstate* curstate, sstate* argchildren) {
+    if (curstate->maxindex() < 0)
+        return -1;
+
+    int numchildren = 1;
+    argchildren[0] = *curstate;
+    for (int ways=2; ways <= ctx->splitways; ways*=2) {
+        sstate parts[MAXSPLITWAYS];
+        int numparts = 0;
+        for (int i=0; i < numchildren; i++) {
+            sstate part0, part1;
+            const int splitindex = split_state(&argchildren[i], &part0, &part1, ctx->coarse);
+            if (splitindex < 0) {
+                parts[numparts++] = argchildren[i];
+                continue;
+            }
+            ctx->numsplits[splitindex]++;
+            if (part0.islegal())
+                parts[numparts++] = part0;
+            if (part1.islegal())
+                parts[numparts++] = part1;
+        }
+        std::copy(parts, parts+numparts, argchildren);
+        numchildren = numparts;
+    }
+    return numchildren;
+}
+
+
+// Incumbent pruning: while splitting, the search scores the box in the 
+// middle of each state. The best of these scores is a lower bound for the 
+// optimum, so states with a smaller upper bound can't contain the best box
+// and don't need to go into the heap at all. This keeps the heap small. 
+// The state that contains the incumbent box itself is never pruned.
+
+// the box in the middle of a state. If the middle of the left edges lies 
+// right of the middle of the right edges, the edges are moved together,
+// so the box is always legal and part of the state.
+static sstate center_state(const sstate* curstate) {
+    sstate center = *curstate;
+    for (unsigned int i=0; i<4; i++)
+        center.low[i] = (curstate->low[i]+curstate->high[i])>>1;
+    for (unsigned int i=0; i<2; i++) {
+        center.low[i] = std::min(center.low[i], curstate->high[i+2]);
+        center.low[i+2] = std::max(center.low[i+2], center.low[i]);
+    }
+    for (unsigned int i=0; i<4; i++)
+        center.high[i] = center.low[i];
+    return center;
+}
+
+// The search loop is a template over the type of the quality function.
+// For the concrete types, bounds are computed with a qualified call, which
+// isn't virtual, so the compiler can inline it into the loop. Q is 
+// QualityFunction for any other type, and the call stays virtual.
+template<class Q>
+inline double bound_of(const Q* quality, const sstate* state) {
+    return quality->Q::upper_bound(state);
+}
+
+template<>
+inline double bound_of<QualityFunction>(const QualityFunction* quality, const sstate* state) {
+    return quality->upper_bound(state);
+}
+
+// bounds of several states, for the children of one split
+template<class Q>
+inline void bounds_of(const Q* quality, sstate* states, int numstates) {
+    for (int i=0; i < numstates; i++)
+        states[i].upper = bound_of(quality, &states[i]);
+}
+
+// the pyramid computes them cell by cell, so each cell's integral images
+// are read for all states while they are in the cache
+template<>
+inline void bounds_of<PyramidQualityFunction>(const PyramidQualityFunction* quality, 
+                                              sstate* states, int numstates) {
+    quality->upper_bound_batch(states, numstates);
+}
+
+// true score of a box whose bound is argbound. The bound of a single box
+// is its score, unless the bounds are rounded up (precision 32), then the
+// score is summed up from the points. That is only done if the box can 
+// become the incumbent: its score is at most its bound.
+template<class Q>
+static double exact_score(const Q* quality, const sstate* argbox, double argbound, double argincumbent) {
+    if (argbound <= argincumbent)
+        return argbound;
+    return quality->box_score(argbox);
+}
+
+// score the box in the middle of a state. The state stores it as float,
+// the incumbent keeps the double.
+template<class Q>
+static double center_score(ESSContext* ctx, const Q* quality, const sstate* curstate, sstate* argcenter) {
+    *argcenter = center_state(curstate);
+    const double score = exact_score(quality, argcenter, bound_of(quality, argcenter), ctx->incumbent);
+    argcenter->upper = score;
+    ctx->numbounds++;
+    return score;
+}
+
+// map a coordinate on the compressed grid back to pixels
+static int uncompress_coordinate(const std::vector<int> &values, int pos) {
+    if (pos < 0)
+        return values.front();
+    if (pos >= static_cast<int>(values.size()))
+        return values.back();
+    return values[pos];
+}
+
+// Top-k with overlap suppression: instead of removing the points of a 
+// result and searching again, the search just goes on after a result, 
+// and every box that overlaps an earlier result by more than maxoverlap
+// (intersection over union) is rejected. A state is dropped when all of
+// its boxes are rejected. For that, the overlap of its boxes with a result
+// A is bounded from below: every box B of the state contains the smallest
+// box of the state and lies inside the largest, so
+//   |A and B| >= |A and smallest|,  |A or B| <= |A| + |largest| - |A and smallest|.
+// For a single box, this is its exact overlap.
+
+// pixel coordinate of a state coordinate: remove the padding, and map 
+// back from the compressed grid
+static int pixel_coordinate(const ESSContext* ctx, const std::vector<int> &values, int pos) {
+    return ctx->compressed ? uncompress_coordinate(values, pos-1) : pos-1;
+}
+
+// number of pixels of a box given in state coordinates, 0 if it's empty
+static double box_area(const ESSContext* ctx, int left, int top, int right, int bottom) {
+    if ((left > right) || (top > bottom))
+        return 0.;
+    const double width = pixel_coordinate(ctx, ctx->xvalues, right) - pixel_coordinate(ctx, ctx->xvalues, left) + 1;
+    const double height = pixel_coordinate(ctx, ctx->yvalues, bottom) - pixel_coordinate(ctx, ctx->yvalues, top) + 1;
+    return width*height;
+}
+
+// true if every box of the state overlaps one of the accepted results too much
+static bool suppressed(const ESSContext* ctx, const sstate* argstate) {
+    for (unsigned int i=0; i < ctx->accepted.size(); i++) {
+        const sstate &result = ctx->accepted[i];
+        const double intersection = box_area(ctx, std::max(result.low[0], argstate->high[0]),
+                                                  std::max(result.low[1], argstate->high[1]),
+                                                  std::min(result.low[2], argstate->low[2]),
+                                                  std::min(result.low[3], argstate->low[3]));
+        if (intersection <= 0.)
+            continue;
+        const double unionarea = box_area(ctx, result.low[0], result.low[1], result.low[2], result.low[3])
+                                 + box_area(ctx, argstate->low[0], argstate->low[1], 
+                                                 argstate->high[2], argstate->high[3])
+                                 - intersection;
+        if (intersection > ctx->maxoverlap * unionarea)
+            return true;
+    }
+    return false;
+}
+
+// keep a scored box as incumbent if it is better than the current one.
+// A box that can't be a result anymore is no lower bound for the next one.
+static void update_incumbent(ESSContext* ctx, double argscore, const sstate &argbox) {
+    if ((argscore > ctx->incumbent) && (ctx->accepted.empty() || !suppressed(ctx, &argbox))) {
+        ctx->incumbent = argscore;
+        ctx->incumbent_state = argbox;
+    }
+}
+
+// true if the state can't contain a box better than the incumbent.
+// The bound of a state and the score of a box in it are sums of the same
+// weights in a different order, and the bound is stored as float, so the
+// bound of the state that holds the incumbent box can come out a little 
+// lower than its score. Only states clearly below the incumbent are pruned.
+static bool can_prune(const ESSContext* ctx, const sstate &argstate) {
+    return ctx->prune 
+           && (argstate.upper < ctx->incumbent - PRUNEMARGIN*(1.+fabs(ctx->incumbent)));
+}
+
+// The heap can still run empty when everything left is pruned, e.g. by an
+// incumbent from outside the search. The best box is the incumbent then,
+// returned as a converged state with its score as bound.
+static sstate incumbent_result(const ESSContext* ctx) {
+    sstate result = ctx->incumbent_state;
+    result.upper = ctx->incumbent;
+    return result;
+}
+
+// true if a search that started with the incumbent argoutside found no 
+// box better than that: its heap ran empty before it scored one
+static bool found_nothing(const ESSContext* ctx, double argoutside) {
+    return ctx->heap.empty() && !(ctx->incumbent > argoutside);
+}
+
+// the result of a search that found nothing: an empty box, worse than any
+static Box empty_box() {
+    Box box;
+    box.left = box.top = box.right = box.bottom = 0;
+    box.score = -std::numeric_limits<double>::max();
+    box.gap = 0.;
+    return box;
+}
+
+// put a state into the heap, unless the incumbent shows it is useless
+static void push_state(ESSContext* ctx, const sstate &argstate) {
+    if (can_prune(ctx, argstate)) {
+        ctx->numpruned++;
+        if (ctx->keep_pruned)
+            ctx->pruned_states.push_back(argstate);
+        return;
+    }
+    ctx->heap.push(argstate);
+    if (ctx->heap.size() > ctx->peak_heap)
+        ctx->peak_heap = ctx->heap.size();
+}
+
+// states in the heap that were pushed before the incumbent got better
+// can be removed later. Do that whenever the heap has doubled in size.
+static void purge_heap(ESSContext* ctx) {
+    if (!ctx->prune || (ctx->heap.size() < ctx->purge_size))
+        return;
+
+    std::vector<sstate> &entries = ctx->heap.entries();
+    unsigned long numkept = 0;
+    for (unsigned long i=0; i < entries.size(); i++) {
+        if (can_prune(ctx, entries[i])) {
+            ctx->numpruned++;
+            if (ctx->keep_pruned)
+                ctx->pruned_states.push_back(entries[i]);
+        } else {
+            entries[numkept++] = entries[i];
+        }
+    }
+    entries.resize(numkept);
+    ctx->heap.rebuild();
+    ctx->purge_size = 2*ctx->heap.size() + 65536;
+}
 
 
 // central routine during branch-and-bound search:
@@ -63,161 +463,1645 @@ static PyramidQualityFunction quality_bound;
 // 3) calculate upper bounds for the parts
 // 4) re-insert the parts
 
-static int extract_split_and_insert(sstate_heap *pH) {
+template<class Q>
+static int extract_split_and_insert(ESSContext* ctx, const Q* quality) {
+    sstate_heap* pH = &ctx->heap;
+    if (pH->empty())    // e.g. search_tiles() took the last range of tiles
+        return -2;
 
-    // step 1) find the most promising candidate region 
+    // step 1) find the most promising candidate region, drop it if
+    // all its boxes overlap earlier results too much
     const sstate* curstate = pH->top();
+    if (!ctx->accepted.empty() && suppressed(ctx, curstate)) {
+        pH->pop();
+        return pH->empty() ? -2 : 0;    // -2: nothing left at all
+    }
 
-    // step 2a) check if the stop criterion is reached
-    const int splitindex = curstate->maxindex();
-    if (splitindex < 0)
+    // step 2) split, or stop if the state has converged to a single box
+    sstate children[MAXSPLITWAYS];
+    const int numchildren = split_children(ctx, curstate, children);
+    if (numchildren < 0)
         return -1;    // no more splits => convergence
 
-    // step 2b) otherwise, create two new states as copies of the old, except for splitindex
-    pH->pop();
-    sstate* newstate0 = new sstate(*curstate);
-    newstate0->high[splitindex] = (curstate->low[splitindex] + curstate->high[splitindex])>>1;
-
-    sstate* newstate1 = new sstate(*curstate);
-    newstate1->low[splitindex] = (curstate->low[splitindex] + curstate->high[splitindex]+1)>>1;
+    if (ctx->track_incumbent) {
+        sstate center;
+        update_incumbent(ctx, center_score(ctx, quality, curstate, &center), center);
+    }
 
-    // the old state isn't needed anymore
-    delete curstate; curstate=NULL;
+    // the old state isn't needed anymore, and curstate isn't valid after pop()
+    pH->pop();
+    curstate=NULL;
+    ctx->numiterations++;
     
     // step 3&4) calculate upper bounds for the parts and reinject them 
-    if ( newstate0->islegal() ) {
-        newstate0->upper = quality_bound.upper_bound(newstate0);
-        pH->push(newstate0);
-    }
-    if ( newstate1->islegal() ) {
-        newstate1->upper = quality_bound.upper_bound(newstate1);
-        pH->push(newstate1);
-    }
+    bounds_of(quality, children, numchildren);
+    ctx->numbounds += numchildren;
+    for (int i=0; i < numchildren; i++)
+        push_state(ctx, children[i]);
+    purge_heap(ctx);
     
+    // everything left can be pruned with an incumbent from outside
+    if (pH->empty())
+        return -2;
+
     // no error, but also no convergence, yet
     return 0;
 }
 
-extern "C" {
+// print the current search progress
+static void report_progress(long counter, const sstate_heap &H) {
+    const sstate *curmax = H.top();
+    std::cerr << "#counter " << std::setw(8) << counter;
+    std::cerr << " heapsize " << std::setw(8) << H.size();
+    std::cerr << " <" << std::setw(4) << curmax->upper << " > ";
+    std::cerr << curmax->tostring();
+}
 
-// main entry site for efficient subwindow search.
-// performs preprocessing and then branch-and-bound
-// We make it "extern C", so it's easier to call e.g. from Python
+// Anytime search: stop before convergence if the best box seen so far is
+// within a relative gap of the best bound left in the heap, or if the time
+// for this call is up. The clock is only read every 64 iterations.
+static bool stop_early(const ESSContext* ctx, long counter) {
+    if (!ctx->track_incumbent)
+        return false;
+    const double bound = ctx->heap.top()->upper;
+    if ((ctx->maxgap > 0.) && (bound - ctx->incumbent <= ctx->maxgap * fabs(bound)))
+        return true;
+    if ((ctx->deadline > 0.) && ((counter % 64) == 0) && (wall_time() > ctx->deadline))
+        return true;
+    return false;
+}
+
+// single threaded search, returns the best state, see incumbent_result()
+// for a heap that ran empty
+template<class Q>
+static sstate serial_search(ESSContext* ctx, const Q* quality) {
+    long counter=1;
+    while (extract_split_and_insert(ctx, quality) >= 0) {
+        if (counter >= ctx->maxiterations) {
+            ctx->hit_iteration_limit = true;
+            break;
+        }
+        if (stop_early(ctx, counter))
+            break;
+        if (ctx->verbose) {
+            if ((counter % ctx->verbose) == 0)
+                report_progress(counter, ctx->heap);
+        }
+        counter++;
+    }
+    if (ctx->heap.empty())
+        return incumbent_result(ctx);
+    return *ctx->heap.top();
+}
+
+
+// Multithreaded search: all workers share one heap, protected by a mutex.
+// Only the pop and push operations happen under the lock, the splitting 
+// and bound evaluation run in parallel.
 //
-// INPUT: int argnumpoints,     : number of data points
-//        int width, height     : width and height of image
-//        double* argxpos,      : x-coordinate of every point
-//        double* argypos,      : y-coordinate of every point
-//        double* argclst       : cluster ID of each point (starts at 0)
-//        int argnumclusters,   : number of clusterIDs 
-//        int argnumlevels,     : number of levels in the pyramid 
-//        double* weightsdata   : vector of cluster weights
-// OUTPUT: Box outputBox        : box in [left,top,right,bottom,score] format
+// A converged state on top of the heap is only accepted as the result if 
+// no other worker is busy with a state whose bound is higher. Otherwise 
+// the worker waits until the busy ones have reinserted their parts. This 
+// makes the result the same optimum the serial search finds.
 
-Box pyramid_search(int argnumpoints, int argwidth, int argheight, 
-                   double* argxpos, double* argypos, double* argclst,
-                   int argnumclusters, int argnumlevels, double* argweight) {
-    Box outputBox = {-1, -1, -1, -1, -1.};
-    argwidth += 1; // make space for 1 pixel padding
-    argheight += 1;
+typedef struct {
+    ESSContext* ctx;
+    const QualityFunction* quality;  // of the type the worker is instantiated for
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    std::vector<float> busy_upper;   // bound of the state each worker is splitting
+    int numbusy;
+    long counter;
+    bool done;
+    bool found;
+    sstate result;      // a copy, the heap moves its entries around
+} ParallelSearch;
 
-// set up structure for pyramid grid parameters
-// TODO: find a nicer way to handle the variable number of parameters
-    const int numcells = argnumlevels*(argnumlevels+1)*(2*argnumlevels+1)/6;
+typedef struct {
+    ParallelSearch* search;
+    int id;
+} ParallelWorker;
 
-    PyramidParameters paramstruct;
-    paramstruct.numlevels=argnumlevels;
-    paramstruct.weightptr = new double*[numcells];
-    for (unsigned int i=0; i < numcells; i++) {
-        paramstruct.weightptr[i] = &argweight[i*argnumclusters];
+// true if no state that a worker is splitting right now could beat argupper
+static bool beats_busy_states(const ParallelSearch* ps, float argupper) {
+    for (unsigned int i=0; i < ps->busy_upper.size(); i++) {
+        if (ps->busy_upper[i] > argupper)
+            return false;
     }
-    
-// set up everything needed to calculate qualities and bounds
-    quality_bound.setup(argnumpoints, argwidth, argheight, argxpos, argypos, argclst, &paramstruct);
-    delete [] paramstruct.weightptr;
+    return true;
+}
 
-// intialize the search space (start with full image)
-    sstate* fullspace = new sstate(argwidth, argheight);
-    
-// push first box set into priority queue
-    sstate_heap H;
-    H.push(fullspace);
+template<class Q>
+static void* parallel_search_worker(void* argdata) {
+    ParallelWorker* worker = reinterpret_cast<ParallelWorker*>(argdata);
+    ParallelSearch* ps = worker->search;
+    ESSContext* ctx = ps->ctx;
+    const Q* quality = static_cast<const Q*>(ps->quality);
+    sstate_heap* pH = &ctx->heap;
 
-// main loop. Iterate extract/split/evaluate/reinsert until convergence or forced exit
-    long counter=1;
-    while ((extract_split_and_insert(&H) >= 0) && (counter < maxiterations)) {
-        if (verbose) {
-            if ((counter % verbose) == 0) {
-                const sstate *curmax = H.top();
-                std::cerr << "#counter " << std::setw(8) << counter;
-                std::cerr << " heapsize " << std::setw(8) << H.size();
-                std::cerr << " <" << std::setw(4) << curmax->upper << " > ";
-                std::cerr << curmax->tostring();
+    pthread_mutex_lock(&ps->lock);
+    while (!ps->done) {
+        if (pH->empty()) {
+            if (ps->numbusy == 0) {     // nothing left anywhere
+                ps->done = true;
+                break;
             }
+            pthread_cond_wait(&ps->changed, &ps->lock);
+            continue;
         }
-        counter++;
+
+        const sstate* curstate = pH->top();
+        if (!ctx->accepted.empty() && suppressed(ctx, curstate)) {
+            pH->pop();
+            continue;
+        }
+        const bool converged = (curstate->maxindex() < 0);
+        if (converged && beats_busy_states(ps, curstate->upper)) {
+            ps->result = *curstate;
+            ps->found = true;
+            ps->done = true;
+            break;
+        } 
+        if (converged) {  // other workers might still find something better
+            pthread_cond_wait(&ps->changed, &ps->lock);
+            continue;
+        }
+        if ((ps->counter >= ctx->maxiterations) || stop_early(ctx, ps->counter)) {
+            ctx->hit_iteration_limit = (ps->counter >= ctx->maxiterations);
+            ps->result = *curstate;
+            ps->found = true;
+            ps->done = true;
+            break;
+        }
+        if (ctx->verbose && ((ps->counter % ctx->verbose) == 0))
+            report_progress(ps->counter, *pH);
+        ps->counter++;
+
+        sstate children[MAXSPLITWAYS];
+        const int numchildren = split_children(ctx, curstate, children);
+        const sstate parent = *curstate;
+        pH->pop();
+        curstate=NULL;
+        ps->busy_upper[worker->id] = parent.upper;
+        ps->numbusy++;
+        const double incumbent = ctx->incumbent;
+
+        // evaluate the bounds without holding the lock
+        pthread_mutex_unlock(&ps->lock);
+        bounds_of(quality, children, numchildren);
+        // not center_score(), the counters may only be changed under the lock
+        sstate center = center_state(&parent);
+        double score = -std::numeric_limits<double>::max();
+        if (ctx->track_incumbent) {
+            score = exact_score(quality, &center, bound_of(quality, &center), incumbent);
+            center.upper = score;
+        }
+        pthread_mutex_lock(&ps->lock);
+
+        ctx->numiterations++;
+        ctx->numbounds += numchildren + ctx->track_incumbent;
+        update_incumbent(ctx, score, center);
+        for (int i=0; i < numchildren; i++)
+            push_state(ctx, children[i]);
+        purge_heap(ctx);
+        ps->busy_upper[worker->id] = -std::numeric_limits<float>::max();
+        ps->numbusy--;
+        pthread_cond_broadcast(&ps->changed);
+    }
+    pthread_cond_broadcast(&ps->changed);   // wake up everybody to finish
+    pthread_mutex_unlock(&ps->lock);
+    return NULL;
+}
+
+// multithreaded search with ctx->numthreads workers, returns the best state
+template<class Q>
+static sstate parallel_search(ESSContext* ctx, const Q* quality) {
+    const int argnumthreads = ctx->numthreads;
+
+    ParallelSearch ps;
+    ps.ctx = ctx;
+    ps.quality = quality;
+    pthread_mutex_init(&ps.lock, NULL);
+    pthread_cond_init(&ps.changed, NULL);
+    ps.busy_upper.assign(argnumthreads, -std::numeric_limits<float>::max());
+    ps.numbusy = 0;
+    ps.counter = 1;
+    ps.done = false;
+    ps.found = false;
+
+    std::vector<pthread_t> threads(argnumthreads);
+    std::vector<ParallelWorker> workers(argnumthreads);
+    int numstarted = 0;
+    for (int i=0; i < argnumthreads; i++) {
+        workers[i].search = &ps;
+        workers[i].id = i;
+        if (pthread_create(&threads[i], NULL, parallel_search_worker<Q>, &workers[i]) != 0)
+            break;  // go on with the workers we have
+        numstarted++;
+    }
+    if (numstarted == 0)    // can't start threads at all
+        parallel_search_worker<Q>(&workers[0]);
+
+    for (int i=0; i < numstarted; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_cond_destroy(&ps.changed);
+    pthread_mutex_destroy(&ps.lock);
+
+    if (!ps.found) {    // heap ran empty: pruned or suppressed
+        if (ctx->heap.empty())
+            return incumbent_result(ctx);
+        return *ctx->heap.top();
+    }
+    return ps.result;
+}
+
+
+// serial or parallel search with a quality function of type Q
+template<class Q>
+static sstate run_search_with(ESSContext* ctx, const Q* quality) {
+    if (ctx->numthreads > 1)
+        return parallel_search(ctx, quality);
+    return serial_search(ctx, quality);
+}
+
+// run the branch-and-bound search on the states in ctx->heap 
+// until convergence or forced exit, returns the best state.
+// The quality function is dispatched once here, not for every bound.
+static sstate run_search(ESSContext* ctx) {
+    const double starttime = wall_time();
+    sstate curstate;
+    if (ctx->quality_bound == &ctx->pyramid_quality)
+        curstate = run_search_with(ctx, &ctx->pyramid_quality);
+    else if (ctx->quality_bound == &ctx->interleaved_quality)
+        curstate = run_search_with(ctx, &ctx->interleaved_quality);
+    else if (ctx->quality_bound == &ctx->kernel_quality)
+        curstate = run_search_with(ctx, &ctx->kernel_quality);
+    else
+        curstate = run_search_with<QualityFunction>(ctx, ctx->quality_bound);
+    ctx->search_time += wall_time()-starttime;
+    return curstate;
+}
+
+// Coordinate compression: the score of a box only depends on the points
+// inside, so shrinking a box to the tightest box around its points doesn't
+// change the score. Box edges only need to lie on coordinates of points, and 
+// for sparse images the search can run on the grid of distinct coordinates
+// instead of on all pixels. This needs less memory and fewer iterations.
+// It is only exact for a single level: pyramid cells depend on the size 
+// of a box in pixels, so pyramids always search all pixels. The same holds
+// for the overlap of boxes, so top-k with maxoverlap doesn't compress either.
+//
+// values gets the sorted distinct pixel coordinates, compressed the index 
+// of each point's coordinate in values. If a coordinate below argsize has 
+// no points, the first such one is kept as well, so boxes without points
+// (score 0) can still be found.
+static void compress_coordinates(int argnumpoints, const double* argpos, int argsize,
+                                 std::vector<int> &values, std::vector<double> &compressed) {
+    values.resize(argnumpoints);
+    for (int k=0; k<argnumpoints; k++)
+        values[k] = static_cast<int>(argpos[k]);
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+    int empty = 0;
+    while ((empty < static_cast<int>(values.size())) && (values[empty] == empty))
+        empty++;
+    if (empty < argsize)
+        values.insert(values.begin()+empty, empty);
+
+    compressed.resize(argnumpoints);
+    for (int k=0; k<argnumpoints; k++) {
+        const int pos = static_cast<int>(argpos[k]);
+        compressed[k] = std::lower_bound(values.begin(), values.end(), pos) - values.begin();
     }
-// at convergence or error, return result or best guess
-    const sstate* curstate = H.top();
+    return;
+}
+
+// the same for coordinates below argsize, without sorting. index is 
+// scratch space with one entry per pixel.
+static void compress_small_coordinates(int argnumpoints, const double* argpos, int argsize,
+                                       std::vector<int> &values, std::vector<double> &compressed,
+                                       std::vector<int> &index) {
+    index.assign(argsize, 0);
+    for (int k=0; k<argnumpoints; k++)
+        index[static_cast<int>(argpos[k])] = 1;
+    values.clear();
+    for (int pos=0; pos<argsize; pos++) {
+        if (index[pos]) {
+            index[pos] = values.size();
+            values.push_back(pos);
+        }
+    }
+
+    compressed.resize(argnumpoints);
+    for (int k=0; k<argnumpoints; k++)
+        compressed[k] = index[static_cast<int>(argpos[k])];
+    return;
+}
+
+// convert a state into a box, the one in the middle if it's not converged
+static Box state_to_box(const ESSContext* ctx, const sstate* curstate) {
+    Box outputBox;
     outputBox.left   = ((curstate->low[0]+curstate->high[0])>>1) -1;  // remove padding
     outputBox.top    = ((curstate->low[1]+curstate->high[1])>>1) -1;
     outputBox.right  = ((curstate->low[2]+curstate->high[2])>>1) -1;
     outputBox.bottom = ((curstate->low[3]+curstate->high[3])>>1) -1;
     outputBox.score  = curstate->upper;
 
-// Free memory of the states that are still in the queue
-        while (!H.empty()) {
-        delete H.top();
-            H.pop();
+    if (ctx->compressed) {
+        outputBox.left   = uncompress_coordinate(ctx->xvalues, outputBox.left);
+        outputBox.top    = uncompress_coordinate(ctx->yvalues, outputBox.top);
+        outputBox.right  = uncompress_coordinate(ctx->xvalues, outputBox.right);
+        outputBox.bottom = uncompress_coordinate(ctx->yvalues, outputBox.bottom);
+    }
+    outputBox.gap = 0.;
+    return outputBox;
+}
+
+// the result of a search that ended with curstate on top of the heap.
+// If the search converged, this is curstate itself, with its exact 
+// score. If it stopped early, it's the best box scored so far, with its 
+// true score instead of a bound, and gap is how much better the best 
+// box left in the heap could be. argbest gets the box as a single box state.
+static Box search_result(ESSContext* ctx, const sstate* curstate, sstate* argbest) {
+    if (curstate->maxindex() < 0) {
+        *argbest = *curstate;
+        argbest->upper = ctx->quality_bound->box_score(curstate);
+        return state_to_box(ctx, argbest);
+    }
+
+    ctx->stopped_early = true;
+    sstate center;
+    const double score = center_score(ctx, ctx->quality_bound, curstate, &center);
+    update_incumbent(ctx, score, center);
+    *argbest = ctx->incumbent_state;
+
+    Box outputBox = state_to_box(ctx, argbest);
+    outputBox.score = ctx->incumbent;
+    // parallel workers have put back their states, so the top of the heap 
+    // is the highest bound left
+    const double bound = std::max(ctx->heap.top()->upper, curstate->upper);
+    outputBox.gap = std::max(0., bound - ctx->incumbent);
+    return outputBox;
+}
+
+// start over with all boxes of the image in the heap. The state is bounded,
+// it can be a single box already, e.g. on a compressed grid of one point.
+static void restart_heap(ESSContext* ctx) {
+    sstate all(ctx->gridwidth, ctx->gridheight);
+    all.upper = ctx->quality_bound->upper_bound(&all);
+    ctx->numbounds++;
+    ctx->heap.clear();
+    ctx->heap.push(all);
+    ctx->incumbent = -std::numeric_limits<double>::max();
+    ctx->incumbent_state = center_state(&all);
+    ctx->pruned_states.clear();
+    ctx->accepted.clear();
+    ctx->purge_size = 65536;
+}
+
+static void start_counters(ESSContext* ctx, double argstarttime);
+
+// take the points of a new image: compress the coordinates if that's 
+// possible for models of up to argnumlevels levels, add the padding, 
+// and reset the counters
+static void start_points(ESSContext* ctx, int argnumpoints, int argwidth, int argheight, 
+                         double* argxpos, double* argypos, double* argclst, int argnumlevels) {
+    const double starttime = wall_time();
+    ctx->compressed = ctx->compress && (argnumlevels == 1) && (argnumpoints > 0)
+                      && (ctx->maxoverlap == 0.);
+    if (ctx->compressed) {
+        compress_coordinates(argnumpoints, argxpos, argwidth, ctx->xvalues, ctx->xcompressed);
+        compress_coordinates(argnumpoints, argypos, argheight, ctx->yvalues, ctx->ycompressed);
+        argwidth = ctx->xvalues.size();
+        argheight = ctx->yvalues.size();
+        argxpos = &ctx->xcompressed[0];
+        argypos = &ctx->ycompressed[0];
+    }
+
+    ctx->numpoints = argnumpoints;
+    ctx->gridwidth = argwidth + 1;     // make space for 1 pixel padding
+    ctx->gridheight = argheight + 1;
+    ctx->xpos = argxpos;
+    ctx->ypos = argypos;
+    ctx->clst = argclst;
+
+    start_counters(ctx, starttime);
+}
+
+// reset time and counters for a call that started at argstarttime
+static void start_counters(ESSContext* ctx, double argstarttime) {
+    ctx->setup_time = wall_time()-argstarttime;
+    ctx->search_time = 0.;
+    ctx->deadline = (ctx->timelimit > 0.) ? argstarttime + ctx->timelimit : 0.;
+    ctx->track_incumbent = ctx->prune || (ctx->maxgap > 0.) || (ctx->timelimit > 0.);
+
+    ctx->numpruned = 0;
+    ctx->peak_heap = 1;
+    ctx->heap.reset_growths();
+    ctx->numiterations = 0;
+    ctx->numbounds = 0;
+    std::fill(ctx->numsplits, ctx->numsplits+4, 0);
+    ctx->final_heap = 0;
+    ctx->hit_iteration_limit = false;
+    ctx->stopped_early = false;
+}
+
+// pyramid levels a model needs for start_points(). A kernel model scores 
+// the points of a box as a whole, like a single level.
+static int model_levels(const ESSModel* argmodel) {
+    return argmodel->kernel.kernel ? 1 : argmodel->pyramid.numlevels;
+}
+
+// set up everything needed to calculate qualities and bounds with a model 
+// on the points of start_points(), and put all boxes into the heap
+static void start_model(ESSContext* ctx, const ESSModel* argmodel) {
+    const double starttime = wall_time();
+    if (argmodel->kernel.kernel) {
+        ctx->quality_bound = &ctx->kernel_quality;
+        ctx->quality_bound->setup(ctx->numpoints, ctx->gridwidth, ctx->gridheight, 
+                                  ctx->xpos, ctx->ypos, ctx->clst, 
+                                  const_cast<KernelModel*>(&argmodel->kernel));
+    } else {
+        ctx->quality_bound = ctx->pyramid_bound;
+        ctx->quality_bound->setup(ctx->numpoints, ctx->gridwidth, ctx->gridheight, 
+                                  ctx->xpos, ctx->ypos, ctx->clst, 
+                                  const_cast<PyramidModel*>(&argmodel->pyramid));
     }
+    ctx->setup_time += wall_time()-starttime;
+    restart_heap(ctx);
+}
+
+// set up quality function and heap for a search on a new image
+static void start_search(ESSContext* ctx, int argnumpoints, int argwidth, int argheight, 
+                         double* argxpos, double* argypos, double* argclst,
+                         const ESSModel* argmodel) {
+    start_points(ctx, argnumpoints, argwidth, argheight, argxpos, argypos, argclst, 
+                 model_levels(argmodel));
+    start_model(ctx, argmodel);
+}
+
+// free everything that was only needed for the current image
+static void finish_search(ESSContext* ctx) {
+    if (ctx->verbose) {
+        std::cerr << "#heap " << ctx->heap.memory_usage() << " bytes";
+        std::cerr << " (" << sizeof(sstate) << " per state)" << std::endl;
+        std::cerr << "#integral images " << ctx->quality_bound->memory_usage() << " bytes" << std::endl;
+        std::cerr << "#iterations " << ctx->numiterations;
+        std::cerr << " bound evaluations " << ctx->numbounds;
+        std::cerr << " splits " << ctx->numsplits[0] << " " << ctx->numsplits[1];
+        std::cerr << " " << ctx->numsplits[2] << " " << ctx->numsplits[3] << std::endl;
+        std::cerr << "#peak heap size " << ctx->peak_heap;
+        std::cerr << " heap growths " << ctx->heap.growths();
+        std::cerr << " pruned states " << ctx->numpruned << std::endl;
+        std::cerr << "#setup time " << ctx->setup_time << " s";
+        std::cerr << " search time " << ctx->search_time << " s" << std::endl;
+    }
+
+    ctx->final_heap = ctx->heap.size();
+
+// The states are stored by value, so there is nothing to free one by one.
+// The heap keeps its memory for the next call.
+    ctx->heap.clear();
+    ctx->pruned_states.clear();
+    ctx->accepted.clear();
 
 // generic function to free any internal resource 
-    quality_bound.cleanup();
+    ctx->quality_bound->cleanup();
+}
+
+// Pruned states were only useless compared to the old incumbent. When it
+// can't be a result anymore, they have to go back into the search.
+// Call ctx->heap.rebuild() afterwards.
+static void restore_pruned(ESSContext* ctx) {
+    ctx->heap.append(ctx->pruned_states);
+    ctx->pruned_states.clear();
+    ctx->incumbent = -std::numeric_limits<double>::max();
+}
+
+// After the data inside a box was removed, the states left in the heap 
+// (and the pruned ones) still cover all remaining candidate boxes, so the search can go on 
+// from there. Only states whose largest box overlaps the removed box 
+// need a new bound, all others contain no removed data at all.
+static void refresh_bounds(ESSContext* ctx, const sstate &removed) {
+    std::vector<sstate> &entries = ctx->heap.entries();
+    restore_pruned(ctx);
+
+    for (unsigned long i=0; i < entries.size(); i++) {
+        sstate* curstate = &entries[i];
+        if ((curstate->low[0] > removed.high[2]) || (curstate->high[2] < removed.low[0]) 
+            || (curstate->low[1] > removed.high[3]) || (curstate->high[3] < removed.low[1]))
+            continue;
+        curstate->upper = ctx->quality_bound->upper_bound(curstate);
+        ctx->numbounds++;
+    }
+    ctx->heap.rebuild();
+}
+
+// search with a compiled model.
+// This is the part of ess_search() that has to be done for every image.
+static Box search_with_model(ESSContext* ctx, int argnumpoints, int argwidth, int argheight, 
+                             double* argxpos, double* argypos, double* argclst,
+                             const ESSModel* argmodel) {
+    start_search(ctx, argnumpoints, argwidth, argheight, argxpos, argypos, argclst, argmodel);
+
+// main loop. Iterate extract/split/evaluate/reinsert until convergence or forced exit
+    const sstate curstate = run_search(ctx);
+
+// at convergence or forced exit, return result or best box so far
+    sstate beststate;
+    const Box outputBox = search_result(ctx, &curstate, &beststate);
 
+    finish_search(ctx);
     return outputBox;
 }
 
+// search for the argmaxresults best boxes that don't share any points,
+// or, with maxoverlap set, that don't overlap each other too much.
+// see ess_search_topk()
+static int search_topk(ESSContext* ctx, int argnumpoints, int argwidth, int argheight,
+                       double* argxpos, double* argypos, double* argclst,
+                       const ESSModel* argmodel, int argmaxresults, Box* argresults) {
+    start_search(ctx, argnumpoints, argwidth, argheight, argxpos, argypos, argclst, argmodel);
+    ctx->keep_pruned = (argmaxresults > 1);
+
+    int numresults = 0;
+    while (numresults < argmaxresults) {
+        const sstate curstate = run_search(ctx);
+        if (found_nothing(ctx, -std::numeric_limits<double>::max()))   // all boxes left overlap the results
+            break;
+        sstate beststate;
+        argresults[numresults++] = search_result(ctx, &curstate, &beststate);
+        if (numresults == argmaxresults)
+            break;
+
+        // the same search goes on, its next converged state that isn't 
+        // suppressed is the next result. After an early stop, there is 
+        // no next result to continue towards.
+        if (ctx->maxoverlap > 0.) {
+            if (curstate.maxindex() >= 0)
+                break;
+            ctx->accepted.push_back(beststate);
+            restore_pruned(ctx);
+            ctx->heap.rebuild();
+            continue;
+        }
+
+        // the result is a single box: low and high coincide
+        if (!ctx->quality_bound->remove_box(beststate.low[0], beststate.low[1], 
+                                           beststate.low[2], beststate.low[3]))
+            break;
+        refresh_bounds(ctx, beststate);
+    }
+
+    finish_search(ctx);
+    ctx->keep_pruned = false;
+    return numresults;
 }
 
-#ifdef __MAIN__
+// Multi-class search: the same points with one model per class. The 
+// points are taken (and compressed) once, and each class is set up right
+// before its search, so its integral images are still in the cache. 
+// Building all of them in one pass over the points was measured to be 
+// slower: the writes for a point then go to many large matrices at once.
+//
+// With argbestonly, only the best (class, box) pair is wanted. The best 
+// score so far is then the incumbent for the next class, and all states 
+// below it are pruned, so a class that can't win is given up as soon as 
+// its bounds show it. Its heap then runs empty.
+//
+// argresults gets the best box of every class, or with argbestonly only
+// the best one, and empty_box() where there is none. returns the class 
+// with the best box
+static int search_multiclass(ESSContext* ctx, int argnumpoints, int argwidth, int argheight,
+                             double* argxpos, double* argypos, double* argclst,
+                             int argnummodels, ESSModel** argmodels, 
+                             bool argbestonly, Box* argresults) {
+    int maxlevels = 0;
+    for (int m=0; m < argnummodels; m++)
+        maxlevels = std::max(maxlevels, model_levels(argmodels[m]));
+    start_points(ctx, argnumpoints, argwidth, argheight, argxpos, argypos, argclst, maxlevels);
 
-static void usage(char *progname) {
-    std::cerr << "usage: " << progname << " width height weight-file data-file\n";
-    exit(1);
+    const bool prune = ctx->prune;
+    if (argbestonly) {
+        ctx->prune = true;
+        ctx->track_incumbent = true;
+    }
+
+    int bestclass = -1;
+    double bestscore = -std::numeric_limits<double>::max();
+    for (int m=0; m < (argbestonly ? 1 : argnummodels); m++)
+        argresults[m] = empty_box();
+    for (int m=0; m < argnummodels; m++) {
+        start_model(ctx, argmodels[m]);
+        if (argbestonly)
+            ctx->incumbent = bestscore;
+        const double outside = ctx->incumbent;
+        const sstate curstate = run_search(ctx);
+        if (found_nothing(ctx, outside))    // no box of this class beats bestscore
+            continue;
+        sstate beststate;
+        const Box box = search_result(ctx, &curstate, &beststate);
+        if (!argbestonly)
+            argresults[m] = box;
+        if ((bestclass < 0) || (box.score > bestscore)) {
+            bestclass = m;
+            bestscore = box.score;
+            if (argbestonly)
+                argresults[0] = box;
+        }
+    }
+
+    finish_search(ctx);
+    ctx->prune = prune;
+    return bestclass;
 }
 
-// helper routine to read ASCII data files 
-// INPUT: filename: name of input file
-// INPUT/OUTPUT: data: collection of vectors to be filled
-static int readdata_NxM(const char* filename, std::vector< std::vector<double> > &data) {
+// Temporal warm start for video: the best box moves little from one 
+// frame to the next, and so do the states a search has to split. A 
+// search that converged leaves a partition of all boxes in the heap and 
+// among the pruned states, fine around the best box and coarse far away 
+// from it. The next frame starts with the same partition, bounded on the 
+// new points, instead of with the full image, so the splits that lead 
+// there are skipped. Every box is in one of the states, so the result 
+// is the same as for a cold search. The best box of the previous frame, 
+// scored on the new one, is the first incumbent.
+//
+// The partition only grows if it's passed on as it is. So what's kept 
+// for the next frame is only as fine as the current frame needed: the 
+// states this search created, everything of the previous partition that 
+// it didn't touch is merged back into the states it was split from.
 
-    const unsigned int numcolumns=data.size();
+// order of states by their coordinates, for sorting and lookup
+static bool coordinates_less(const sstate &a, const sstate &b) {
+    for (int i=0; i < 4; i++) {
+        if (a.low[i] != b.low[i])
+            return a.low[i] < b.low[i];
+        if (a.high[i] != b.high[i])
+            return a.high[i] < b.high[i];
+    }
+    return false;
+}
 
-// start with empty vectors
-    for (unsigned int i=0;i<numcolumns;i++) {
-        data[i].clear();
+// true if all boxes of argstate are in argouter
+static bool contains(const sstate &argouter, const sstate &argstate) {
+    for (int i=0; i < 4; i++) {
+        if ((argstate.low[i] < argouter.low[i]) || (argstate.high[i] > argouter.high[i]))
+            return false;
     }
+    return true;
+}
 
-    std::ifstream infile(filename);
-    if (!infile)
-        return -1;
+// split argstate the way the search does, until every state in 
+// [argfirst, arglast) is one of the parts, and append the parts to argout.
+// The states in the range must come from splits of argstate.
+static void split_like(const sstate &argstate, sstate* argfirst, sstate* arglast, 
+                       int argalign, std::vector<sstate> &argout) {
+    if ((argfirst == arglast) || (argstate.maxindex() < 0)
+        || ((arglast-argfirst == 1) && !coordinates_less(argstate, *argfirst) 
+                                    && !coordinates_less(*argfirst, argstate))) {
+        argout.push_back(argstate);
+        return;
+    }
+    sstate part0, part1;
+    split_state(&argstate, &part0, &part1, argalign);
+    sstate* middle = argfirst;
+    for (sstate* cur=argfirst; cur != arglast; cur++) {
+        if (contains(part0, *cur))
+            std::swap(*cur, *middle++);
+    }
+    if (part0.islegal())
+        split_like(part0, argfirst, middle, argalign, argout);
+    if (part1.islegal())
+        split_like(part1, middle, arglast, argalign, argout);
+}
+
+// replace ctx->warmstates by the partition to start the next frame with
+static void keep_partition(ESSContext* ctx, bool argwarm) {
+    std::vector<sstate> &previous = ctx->warmstates;
+    std::vector<sstate> &fresh = ctx->freshstates;
+    if (!argwarm)
+        previous.clear();
+    std::sort(previous.begin(), previous.end(), coordinates_less);
+
+    fresh.clear();
+    const std::vector<sstate> &entries = ctx->heap.entries();
+    for (unsigned long i=0; i < entries.size(); i++) {
+        if (!std::binary_search(previous.begin(), previous.end(), entries[i], coordinates_less))
+            fresh.push_back(entries[i]);
+    }
+    for (unsigned long i=0; i < ctx->pruned_states.size(); i++) {
+        if (!std::binary_search(previous.begin(), previous.end(), ctx->pruned_states[i], coordinates_less))
+            fresh.push_back(ctx->pruned_states[i]);
+    }
+
+    previous.clear();
+    if (!fresh.empty())
+        split_like(sstate(ctx->gridwidth, ctx->gridheight), &fresh[0], &fresh[0]+fresh.size(), 
+                   ctx->coarse, previous);
+    else
+        previous.push_back(sstate(ctx->gridwidth, ctx->gridheight));
+}
+
+// bound all states with a quality function of type Q, in batches
+template<class Q>
+static void bound_all(const Q* quality, std::vector<sstate> &states) {
+    for (unsigned long i=0; i < states.size(); i += MAXSPLITWAYS)
+        bounds_of(quality, &states[i], std::min<int>(MAXSPLITWAYS, states.size()-i));
+}
+
+// put the partition of the previous frame into the heap, bounded on the
+// points of this one
+static void warm_start(ESSContext* ctx) {
+    std::vector<sstate> &entries = ctx->heap.entries();
+    entries = ctx->warmstates;
+    if (ctx->quality_bound == &ctx->pyramid_quality)
+        bound_all(&ctx->pyramid_quality, entries);
+    else if (ctx->quality_bound == &ctx->interleaved_quality)
+        bound_all(&ctx->interleaved_quality, entries);
+    else if (ctx->quality_bound == &ctx->kernel_quality)
+        bound_all(&ctx->kernel_quality, entries);
+    else
+        bound_all<QualityFunction>(ctx->quality_bound, entries);
+    ctx->numbounds += entries.size();
+
+    sstate previous = ctx->previous;
+    const double score = ctx->quality_bound->box_score(&previous);
+    previous.upper = score;
+    ctx->numbounds++;
+    update_incumbent(ctx, score, previous);
+
+    ctx->peak_heap = std::max(ctx->peak_heap, ctx->heap.size());
+    ctx->purge_size = 0;
+    purge_heap(ctx);    // drops what the incumbent prunes, and restores the heap order
+}
+
+// search the next frame of a video, see ess_search_sequence(). The search
+// is warm started from the previous frame if it had the same size.
+static Box search_sequence(ESSContext* ctx, int argnumpoints, int argwidth, int argheight,
+                           double* argxpos, double* argypos, double* argclst,
+                           const ESSModel* argmodel) {
+    // the partition is on the pixel grid, compression would change it.
+    // Pruned states are part of it, so they are kept.
+    const bool compress = ctx->compress;
+    const bool prune = ctx->prune;
+    ctx->compress = false;
+    ctx->prune = true;
+    ctx->keep_pruned = true;
+    start_search(ctx, argnumpoints, argwidth, argheight, argxpos, argypos, argclst, argmodel);
+
+    const bool warm = ctx->has_previous && (ctx->previous_width == argwidth) 
+                      && (ctx->previous_height == argheight) && !ctx->warmstates.empty();
+    if (warm)
+        warm_start(ctx);
+    sstate curstate = run_search(ctx);
+    // the warm start's incumbent can prune everything, the previous box 
+    // scored on this frame is the best one then. Only a single box may 
+    // become ctx->previous.
+    if (ctx->heap.empty())
+        curstate = incumbent_result(ctx);
+    sstate beststate;
+    const Box outputBox = search_result(ctx, &curstate, &beststate);
+
+    keep_partition(ctx, warm);
+    ctx->has_previous = true;
+    ctx->previous = beststate;
+    ctx->previous_width = argwidth;
+    ctx->previous_height = argheight;
+
+    finish_search(ctx);
+    ctx->compress = compress;
+    ctx->prune = prune;
+    ctx->keep_pruned = false;
+    return outputBox;
+}
+
+// Spatio-temporal subvolumes: the best box together with the best range
+// of frames first..last of a short window. The state only has room for 
+// the 4 box coordinates, so the frame range is the outer level of the 
+// search: every range is searched like a class in search_multiclass() 
+// with argbestonly, with the best score so far as incumbent, so ranges 
+// that can't win stop after a few iterations. The frames are stored one 
+// after the other, so the points of a range are a contiguous part of the 
+// window, whose integral images are set up from that part alone. The 
+// longest ranges come first, an object that stays in view gives a high 
+// incumbent early.
+static Box search_subvolume(ESSContext* ctx, int argnumframes, int* argnumpoints, 
+                            int argwidth, int argheight, 
+                            double** argxpos, double** argypos, double** argclst,
+                            const ESSModel* argmodel, int* argfirstframe, int* arglastframe) {
+    ctx->framestart.resize(argnumframes+1);
+    ctx->framestart[0] = 0;
+    for (int f=0; f < argnumframes; f++)
+        ctx->framestart[f+1] = ctx->framestart[f] + argnumpoints[f];
+    const int numpoints = ctx->framestart[argnumframes];
+    ctx->windowx.resize(numpoints+1);       // +1: never empty, &v[0] is valid
+    ctx->windowy.resize(numpoints+1);
+    ctx->windowclst.resize(numpoints+1);
+    for (int f=0; f < argnumframes; f++) {
+        std::copy(argxpos[f], argxpos[f]+argnumpoints[f], &ctx->windowx[ctx->framestart[f]]);
+        std::copy(argypos[f], argypos[f]+argnumpoints[f], &ctx->windowy[ctx->framestart[f]]);
+        std::copy(argclst[f], argclst[f]+argnumpoints[f], &ctx->windowclst[ctx->framestart[f]]);
+    }
+    start_points(ctx, numpoints, argwidth, argheight, &ctx->windowx[0], &ctx->windowy[0], 
+                 &ctx->windowclst[0], model_levels(argmodel));
+    double* xpos = ctx->xpos;
+    double* ypos = ctx->ypos;
+    double* clst = ctx->clst;
+
+    const bool prune = ctx->prune;
+    ctx->prune = true;
+    ctx->track_incumbent = true;
+
+    Box bestbox = empty_box();
+    double bestscore = -std::numeric_limits<double>::max();
+    *argfirstframe = -1;
+    *arglastframe = -1;
+    for (int length=argnumframes; length > 0; length--) {
+        for (int first=0; first+length <= argnumframes; first++) {
+            const int begin = ctx->framestart[first];
+            ctx->numpoints = ctx->framestart[first+length] - begin;
+            ctx->xpos = xpos + begin;
+            ctx->ypos = ypos + begin;
+            ctx->clst = clst + begin;
+            start_model(ctx, argmodel);
+            ctx->incumbent = bestscore;
+            const sstate curstate = run_search(ctx);
+            if (found_nothing(ctx, bestscore))  // no box in these frames beats bestscore
+                continue;
+            sstate beststate;
+            const Box box = search_result(ctx, &curstate, &beststate);
+            if ((*argfirstframe < 0) || (box.score > bestscore)) {
+                bestbox = box;
+                bestscore = box.score;
+                *argfirstframe = first;
+                *arglastframe = first+length-1;
+            }
+        }
+    }
 
-    while (! infile.eof() ) {
-        for (unsigned int i=0;i<numcolumns;i++) {
-            double tmpval;
-            infile >> tmpval;
-            data[i].push_back(tmpval);
+    finish_search(ctx);
+    ctx->prune = prune;
+    return bestbox;
+}
+
+// Large images: a state holds its coordinates as short, so the pixels of
+// images wider or higher than 32k can't be searched directly, and the 
+// integral images of a gigapixel image wouldn't fit into memory anyway.
+// Instead, the image is cut into tiles, on a few levels that are 
+// TILEFACTOR times finer each:
+// - on a level of tiles, a state holds all boxes whose edges lie in 
+//   ranges of tiles, see TileQualityFunction. This only needs integral 
+//   images with one entry per tile.
+// - when a single range of tiles (one tile for each edge) is on top of 
+//   the heap, its boxes are searched on the next finer level, with each
+//   edge in one of the tiles its tile is cut into.
+// - on the finest level, the pixels of the edges of a range are searched 
+//   on their own. Only the points of the tiles on the border of the range
+//   are set up for that: the tiles inside are in every box, they only add
+//   their sum.
+// The bound of a range of tiles is loose by the positive weights of its
+// edge tiles, so the finer levels keep most ranges from ever reaching
+// the pixels. The best box so far is the incumbent on all levels, and the
+// search ends when no range of tiles is left that could beat it. The 
+// score of a box has to be the sum of its points for this, so only 
+// 1-level models are supported, the pyramid cells depend on the size of 
+// the box.
+
+// the image of search_large() and the best box found so far
+typedef struct {
+    int width, height;
+    double* xpos;
+    double* ypos;
+    double* clst;
+    const ESSModel* model;
+    QualityFunction* quality;   // for the pixels
+    double bestscore;
+    Box* best;
+} LargeImage;
+
+// The coordinates of the pixels searched for a range of tiles along one 
+// axis: the pixels of the first tile, one for all tiles in between, and 
+// the pixels of the last tile. Positions are unpadded.
+class TileAxis {
+  private:
+    int tilesize;
+    int first, last;            // tiles
+    int firstsize;              // pixels of the first tile, less if it is the last of the image
+    int lastoffset;             // position of the first pixel of the last tile
+    int lastsize;               // pixels of the last tile
+
+  public:
+    TileAxis(int argtilesize, int argfirst, int arglast, int argimagesize) 
+        : tilesize(argtilesize), first(argfirst), last(arglast) {
+        firstsize = std::min(tilesize, argimagesize - first*tilesize);
+        lastoffset = (last > first+1) ? firstsize+1 : firstsize;
+        if (last == first)
+            lastoffset = 0;
+        lastsize = std::min(tilesize, argimagesize - last*tilesize);
+    }
+
+    // number of local positions
+    int size() const { return lastoffset + lastsize; }
+
+    int to_local(int pos) const {
+        const int tile = pos / tilesize;
+        if (tile == first)
+            return pos - first*tilesize;
+        if (tile == last)
+            return lastoffset + pos - last*tilesize;
+        return firstsize;       // the tiles in between
+    }
+
+    int to_pixel(int local) const {
+        if (local < firstsize)
+            return first*tilesize + local;
+        return last*tilesize + local - lastoffset;
+    }
+
+    // padded ranges of the low and high edge of a box on the grid of the
+    // sorted distinct positions argvalues of the points, false if an 
+    // edge tile has no points. Boxes with an edge elsewhere in the tile 
+    // have the same score as a box with the edge on a point, and if that
+    // point is in another tile, the box belongs to another range of tiles.
+    bool edge_ranges(const std::vector<int> &argvalues, short* arglow, short* arghigh) const {
+        const int firstend = std::lower_bound(argvalues.begin(), argvalues.end(), firstsize) 
+                             - argvalues.begin();
+        const int laststart = std::lower_bound(argvalues.begin(), argvalues.end(), lastoffset) 
+                              - argvalues.begin();
+        if ((firstend == 0) || (laststart == static_cast<int>(argvalues.size())))
+            return false;
+        arglow[0] = 1;
+        arghigh[0] = firstend;
+        arglow[2] = laststart+1;
+        arghigh[2] = argvalues.size();
+        return true;
+    }
+};
+
+// search the pixels of a range of tiles of the finest level (argtiles, 
+// a single box in padded tile coordinates) for a box better than the best
+static void search_tile_range(ESSContext* ctx, const sstate &argtiles, LargeImage &argimage) {
+    const TileLevel &level = ctx->tilelevels.back();
+    const int left = argtiles.low[0]-1;
+    const int top = argtiles.low[1]-1;
+    const int right = argtiles.low[2]-1;
+    const int bottom = argtiles.low[3]-1;
+    const TileAxis xaxis(level.tilesize, left, right, argimage.width);
+    const TileAxis yaxis(level.tilesize, top, bottom, argimage.height);
+
+    // the points of the tiles on the border, the others are in every box
+    const double starttime = wall_time();
+    ctx->finex.clear();
+    ctx->finey.clear();
+    ctx->fineclst.clear();
+    for (int ty=top; ty <= bottom; ty++) {
+        for (int tx=left; tx <= right; tx++) {
+            if ((ty > top) && (ty < bottom) && (tx > left) && (tx < right))
+                tx = right;
+            const int tile = ty*level.numtilesx + tx;
+            for (int i=ctx->tilestart[tile]; i < ctx->tilestart[tile+1]; i++) {
+                const int k = ctx->tilepoints[i];
+                ctx->finex.push_back(xaxis.to_local(static_cast<int>(argimage.xpos[k])));
+                ctx->finey.push_back(yaxis.to_local(static_cast<int>(argimage.ypos[k])));
+                ctx->fineclst.push_back(argimage.clst[k]);
+            }
+        }
+    }
+    const double inside = level.quality.sum(argtiles.low[0]+1, argtiles.low[1]+1, 
+                                            argtiles.low[2]-1, argtiles.low[3]-1);
+
+    // with one level, only the points matter, so the pixels are compressed
+    const int numpoints = ctx->finex.size();
+    compress_small_coordinates(numpoints, ctx->finex.empty() ? NULL : &ctx->finex[0], xaxis.size(),
+                               ctx->xvalues, ctx->xcompressed, ctx->fineindex);
+    compress_small_coordinates(numpoints, ctx->finey.empty() ? NULL : &ctx->finey[0], yaxis.size(),
+                               ctx->yvalues, ctx->ycompressed, ctx->fineindex);
+    sstate boxes;
+    const bool searchable = xaxis.edge_ranges(ctx->xvalues, &boxes.low[0], &boxes.high[0])
+                            && yaxis.edge_ranges(ctx->yvalues, &boxes.low[1], &boxes.high[1]);
+    if (searchable) {
+        argimage.quality->setup(numpoints, ctx->xvalues.size()+1, ctx->yvalues.size()+1,
+                                &ctx->xcompressed[0], &ctx->ycompressed[0], &ctx->fineclst[0], 
+                                const_cast<PyramidModel*>(&argimage.model->pyramid));
+        // with a single coordinate per edge, this is a converged box already
+        boxes.upper = argimage.quality->upper_bound(&boxes);
+        ctx->numbounds++;
+    }
+    ctx->setup_time += wall_time()-starttime;
+    if (!searchable)
+        return;
+
+    // the search on tiles waits in the meantime
+    std::vector<sstate> tileheap;
+    tileheap.swap(ctx->heap.entries());
+    ctx->quality_bound = argimage.quality;
+
+    ctx->heap.push(boxes);
+    ctx->incumbent = argimage.bestscore - inside;
+    const sstate curstate = run_search(ctx);
+    const bool converged = !ctx->heap.empty() && (curstate.maxindex() < 0);
+    const double score = converged ? argimage.quality->box_score(&curstate) : 0.;
+    if (converged && (score + inside > argimage.bestscore)) {
+        Box* best = argimage.best;
+        argimage.bestscore = score + inside;
+        best->left = xaxis.to_pixel(ctx->xvalues[curstate.low[0]-1]);
+        best->top = yaxis.to_pixel(ctx->yvalues[curstate.low[1]-1]);
+        best->right = xaxis.to_pixel(ctx->xvalues[curstate.low[2]-1]);
+        best->bottom = yaxis.to_pixel(ctx->yvalues[curstate.low[3]-1]);
+        best->score = argimage.bestscore;
+        best->gap = 0.;
+    }
+
+    ctx->heap.clear();
+    ctx->heap.entries().swap(tileheap);
+}
+
+// the boxes of a range of tiles (a single box in padded tile coordinates)
+// as a state on the next finer level argfiner
+static sstate finer_tiles(const sstate &argtiles, const TileLevel &argcoarse, 
+                          const TileLevel &argfiner) {
+    const int factor = argcoarse.tilesize / argfiner.tilesize;
+    sstate finer;
+    finer.upper = std::numeric_limits<float>::max();
+    for (int i=0; i < 4; i++) {
+        const int numtiles = (i % 2 == 0) ? argfiner.numtilesx : argfiner.numtilesy;
+        finer.low[i] = (argtiles.low[i]-1)*factor + 1;
+        finer.high[i] = std::min(argtiles.low[i]*factor, numtiles);
+    }
+    return finer;
+}
+
+// search the boxes of argstart on tile level arglevel for a box better 
+// than the best, on the finer levels for every range of tiles that could
+// hold one
+static void search_tiles(ESSContext* ctx, unsigned int arglevel, const sstate &argstart, 
+                         LargeImage &argimage) {
+    TileLevel &level = ctx->tilelevels[arglevel];
+
+    // the coarser level waits in the meantime
+    std::vector<sstate> coarseheap;
+    coarseheap.swap(ctx->heap.entries());
+    ctx->heap.push(argstart);
+    while (!ctx->stopped_early) {
+        ctx->quality_bound = &level.quality;
+        ctx->incumbent = argimage.bestscore;
+        const sstate tiles = run_search(ctx);
+        if (ctx->heap.empty() || (tiles.upper <= static_cast<float>(argimage.bestscore)))
+            break;
+        if (tiles.maxindex() < 0) {
+            ctx->heap.pop();
+            if (arglevel+1 < ctx->tilelevels.size())
+                search_tiles(ctx, arglevel+1, finer_tiles(tiles, level, ctx->tilelevels[arglevel+1]), 
+                             argimage);
+            else
+                search_tile_range(ctx, tiles, argimage);
+        } else
+            ctx->stopped_early = true;      // iteration limit
+
+        // everything left is in a state that is at most as good as this one,
+        // the coarsest level sets the final gap
+        if (ctx->stopped_early)
+            argimage.best->gap = std::max(0., tiles.upper - argimage.bestscore);
+    }
+    ctx->heap.clear();
+    ctx->heap.entries().swap(coarseheap);
+}
+
+// The best box made of whole tiles of the finest level. For these, the 
+// points of a tile can be summed up, so it's a plain search on the grid of
+// tiles, and the box is a good incumbent to start the search on tiles with.
+static void search_whole_tiles(ESSContext* ctx, int argnumpoints, LargeImage &argimage) {
+    const TileLevel &finest = ctx->tilelevels.back();
+    const double starttime = wall_time();
+    argimage.quality->setup(argnumpoints, finest.numtilesx+1, finest.numtilesy+1, 
+                            &ctx->tilex[0], &ctx->tiley[0], argimage.clst, 
+                            const_cast<PyramidModel*>(&argimage.model->pyramid));
+    ctx->setup_time += wall_time()-starttime;
+
+    ctx->quality_bound = argimage.quality;
+    ctx->gridwidth = finest.numtilesx+1;
+    ctx->gridheight = finest.numtilesy+1;
+    restart_heap(ctx);
+    const sstate tiles = run_search(ctx);
+    const double score = finest.quality.sum(tiles.low[0], tiles.low[1], tiles.low[2], tiles.low[3]);
+    if (!found_nothing(ctx, -std::numeric_limits<double>::max()) && (tiles.maxindex() < 0)
+        && (score > argimage.bestscore)) {
+        Box* best = argimage.best;
+        argimage.bestscore = score;
+        best->left = (tiles.low[0]-1)*finest.tilesize;
+        best->top = (tiles.low[1]-1)*finest.tilesize;
+        best->right = std::min(tiles.low[2]*finest.tilesize, argimage.width)-1;
+        best->bottom = std::min(tiles.low[3]*finest.tilesize, argimage.height)-1;
+        best->score = argimage.bestscore;
+    }
+    ctx->heap.clear();
+}
+
+// A box without points scores 0, which beats every box when all weights 
+// are negative. The tiles only have boxes that end at points, so a pixel 
+// without points is the first incumbent, if there is one. Every tile 
+// searched before the one that has it is full, so marking their pixels 
+// costs at most one entry per point.
+static void search_empty_box(ESSContext* ctx, LargeImage &argimage) {
+    const TileLevel &finest = ctx->tilelevels.back();
+    for (int ty=0; ty < finest.numtilesy; ty++) {
+        for (int tx=0; tx < finest.numtilesx; tx++) {
+            const int tile = ty*finest.numtilesx + tx;
+            const int left = tx*finest.tilesize;
+            const int top = ty*finest.tilesize;
+            const int width = std::min(finest.tilesize, argimage.width-left);
+            const int height = std::min(finest.tilesize, argimage.height-top);
+            std::vector<bool> used(width*height, false);
+            for (int i=ctx->tilestart[tile]; i < ctx->tilestart[tile+1]; i++) {
+                const int k = ctx->tilepoints[i];
+                used[(static_cast<int>(argimage.ypos[k])-top)*width 
+                     + static_cast<int>(argimage.xpos[k])-left] = true;
+            }
+            const int pixel = std::find(used.begin(), used.end(), false) - used.begin();
+            if (pixel == width*height)
+                continue;
+            Box* best = argimage.best;
+            best->left = best->right = left + pixel % width;
+            best->top = best->bottom = top + pixel / width;
+            best->score = argimage.bestscore = 0.;
+            return;
+        }
+    }
+}
+
+// search an image of any size with a 1-level model, see ess_search_large()
+// returns false if the model has more levels or is a kernel model
+static bool search_large(ESSContext* ctx, int argnumpoints, int argwidth, int argheight,
+                         double* argxpos, double* argypos, double* argclst,
+                         const ESSModel* argmodel, Box* argresult) {
+    if (argmodel->kernel.kernel || (argmodel->pyramid.numlevels != 1))
+        return false;
+    const double starttime = wall_time();
+
+    // the finest tiles are at least "tilesize" pixels, coarser ones are 
+    // added until the coarsest level has at most TOPTILES per side
+    const int imagesize = std::max(argwidth, argheight);
+    std::vector<int> tilesizes(1, std::max(ctx->tilesize, (imagesize + MAXTILES-1)/MAXTILES));
+    while ((imagesize + tilesizes.back()-1)/tilesizes.back() > TOPTILES)
+        tilesizes.push_back(tilesizes.back()*TILEFACTOR);
+    ctx->tilelevels.resize(tilesizes.size());
+    ctx->tilex.resize(argnumpoints+1);     // +1: never empty, &v[0] is valid
+    ctx->tiley.resize(argnumpoints+1);
+    for (unsigned int l=0; l < tilesizes.size(); l++) {
+        TileLevel &level = ctx->tilelevels[l];
+        level.tilesize = tilesizes[tilesizes.size()-1-l];
+        level.numtilesx = (argwidth + level.tilesize-1)/level.tilesize;
+        level.numtilesy = (argheight + level.tilesize-1)/level.tilesize;
+        for (int k=0; k < argnumpoints; k++) {
+            ctx->tilex[k] = static_cast<int>(argxpos[k]) / level.tilesize;
+            ctx->tiley[k] = static_cast<int>(argypos[k]) / level.tilesize;
         }
+        level.quality.setup(argnumpoints, level.numtilesx+1, level.numtilesy+1, 
+                            &ctx->tilex[0], &ctx->tiley[0], argclst, 
+                            const_cast<PyramidModel*>(&argmodel->pyramid));
+    }
+
+    // sort the points by tile of the finest level, tilex and tiley are still 
+    // those of that level
+    const TileLevel &finest = ctx->tilelevels.back();
+    ctx->tilestart.assign(finest.numtilesx*finest.numtilesy+1, 0);
+    ctx->tilepoints.resize(argnumpoints);
+    for (int k=0; k < argnumpoints; k++)
+        ctx->tilestart[static_cast<int>(ctx->tiley[k])*finest.numtilesx + static_cast<int>(ctx->tilex[k]) + 1]++;
+    for (int t=0; t < finest.numtilesx*finest.numtilesy; t++)
+        ctx->tilestart[t+1] += ctx->tilestart[t];
+    std::vector<int> fill(ctx->tilestart.begin(), ctx->tilestart.end()-1);
+    for (int k=0; k < argnumpoints; k++)
+        ctx->tilepoints[fill[static_cast<int>(ctx->tiley[k])*finest.numtilesx + static_cast<int>(ctx->tilex[k])]++] = k;
+    start_counters(ctx, starttime);
+
+    // a state of a level of tiles has no single box to score, so the 
+    // incumbent only comes from whole tiles and from the ranges of tiles 
+    // searched in pixels
+    LargeImage image = { argwidth, argheight, argxpos, argypos, argclst, argmodel, 
+                         ctx->pyramid_bound, -std::numeric_limits<double>::max(), argresult };
+    const bool prune = ctx->prune;
+    ctx->prune = true;
+    ctx->compressed = false;
+
+    argresult->left = argresult->top = argresult->right = argresult->bottom = 0;
+    argresult->score = image.bestscore;
+    argresult->gap = 0.;
+    search_empty_box(ctx, image);
+    search_whole_tiles(ctx, argnumpoints, image);
+    ctx->track_incumbent = false;
+    search_tiles(ctx, 0, sstate(ctx->tilelevels[0].numtilesx+1, ctx->tilelevels[0].numtilesy+1), 
+                 image);
+
+    ctx->quality_bound = image.quality;
+    finish_search(ctx);
+    ctx->prune = prune;
+    return true;
+}
+
+// Batch search: a pool of workers, each with its own search context, 
+// takes the next unprocessed image until all are done.
+
+typedef struct {
+    pthread_mutex_t lock;
+    int nextimage;
+    int numimages;
+    int* numpoints;
+    int* width;
+    int* height;
+    double** xpos;
+    double** ypos;
+    double** clst;
+    const ESSModel* model;      // shared by all images
+    Box* results;
+} BatchSearch;
+
+static void* batch_search_worker(void* argdata) {
+    BatchSearch* batch = reinterpret_cast<BatchSearch*>(argdata);
+    ESSContext* ctx = new ESSContext();
+    while (true) {
+        pthread_mutex_lock(&batch->lock);
+        const int i = batch->nextimage++;
+        pthread_mutex_unlock(&batch->lock);
+        if (i >= batch->numimages)
+            break;
+        batch->results[i] = search_with_model(ctx, batch->numpoints[i], 
+                                              batch->width[i], batch->height[i],
+                                              batch->xpos[i], batch->ypos[i], batch->clst[i],
+                                              batch->model);
+    }
+    delete ctx;
+    return NULL;
+}
+
+// The old interface works on one shared context, so unlike ess_search() 
+// it must not be called from several threads at the same time.
+static ESSContext* default_context() {
+    static ESSContext ctx;
+    return &ctx;
+}
+
+extern "C" {
+
+// create a search context with default settings
+ESSContext* ess_create() {
+    return new ESSContext();
+}
+
+// free a search context and all buffers it holds
+void ess_destroy(ESSContext* ctx) {
+    delete ctx;
+}
+
+// change a setting of the context. Known names are 
+//   "iterations" : maximal number of iterations before the search stops
+//   "verbose"    : print progress every 'verbose' iterations (0 = never)
+//   "numthreads" : number of worker threads for search and setup (1 = serial)
+//   "split"      : 2, 4, 8 or 16 = split every state taken from the heap
+//                  into that many parts at once, 2 = binary splits (default)
+//   "interleaved": 1 = use InterleavedPyramidQualityFunction, 
+//                  0 = PyramidQualityFunction (default)
+//   "compress"   : 1 = search only the coordinates of points instead of 
+//                  all pixels. Only used for 1-level pyramids, 0 = off (default)
+//   "prune"      : 1 = don't keep states that can't beat the best box seen 
+//                  so far (needs one more evaluation per iteration, but 
+//                  keeps the heap small), 0 = off (default)
+//   "gap"        : stop as soon as the best box found is within this relative 
+//                  distance of the best bound left, in millionths 
+//                  (e.g. 10000 = 1%), 0 = search until convergence (default)
+//   "overlap"    : 1..99 = top-k results may overlap each other by up to
+//                  this many percent (intersection over union), 0 = results
+//                  share no points, those of a result are removed (default)
+//   "timelimit"  : stop after this many milliseconds (including setup), 
+//                  0 = no limit (default)
+//   "tilesize"   : tiles of ess_search_large() are at least this many 
+//                  pixels wide and high, default 64
+//   "precision"  : 64 = store integral images as double (default),
+//                  32 = as float, with the bound raised by the worst case
+//                  rounding error. Only for PyramidQualityFunction.
+//   "coarse"     : 2, 4, ..., 64 = split states on a grid of that many pixels
+//                  while their intervals are wider, and bound them from
+//                  integral images with one entry per grid cell, 0 = off 
+//                  (default). Only for PyramidQualityFunction.
+// returns 0 on success, -1 for an unknown name or invalid value
+int ess_set_option(ESSContext* ctx, const char* name, int value) {
+    const std::string option(name);
+    if (option == "iterations" && value > 0)
+        ctx->maxiterations = value;
+    else if (option == "verbose" && value >= 0)
+        ctx->verbose = value;
+    else if (option == "split" && (value == 2 || value == 4 || value == 8 || value == 16))
+        ctx->splitways = value;
+    else if (option == "numthreads" && value > 0) {
+        ctx->numthreads = value;
+        ctx->pyramid_quality.set_numthreads(value);
+    }
+    else if (option == "prune" && (value == 0 || value == 1))
+        ctx->prune = value;
+    else if (option == "gap" && value >= 0)
+        ctx->maxgap = 1e-6*value;
+    else if (option == "overlap" && value >= 0 && value < 100)
+        ctx->maxoverlap = 0.01*value;
+    else if (option == "timelimit" && value >= 0)
+        ctx->timelimit = 1e-3*value;
+    else if (option == "tilesize" && value >= 2 && value <= 16000)
+        ctx->tilesize = value;
+    else if (option == "compress" && (value == 0 || value == 1))
+        ctx->compress = value;
+    else if (option == "precision" && (value == 32 || value == 64))
+        ctx->pyramid_quality.set_precision(value);
+    else if (option == "coarse" && (value == 0 || (value >= 2 && value <= 64 && (value & (value-1)) == 0)))
+    {
+        ctx->coarse = value;
+        ctx->pyramid_quality.set_coarse(value);
+    }
+    else if (option == "interleaved" && (value == 0 || value == 1)) {
+        ctx->pyramid_bound = value ? static_cast<QualityFunction*>(&ctx->interleaved_quality)
+                                   : static_cast<QualityFunction*>(&ctx->pyramid_quality);
+        ctx->quality_bound = ctx->pyramid_bound;
+    }
+    else
+        return -1;
+    return 0;
+}
+
+// statistics of the last search with this context. With ctx NULL, those 
+// of the last pyramid_search() or pyramid_search_mt() call.
+// For top-k searches, they add up over all boxes of the call.
+void ess_get_stats(ESSContext* ctx, ESSStats* stats) {
+    if (ctx == NULL)
+        ctx = default_context();
+    stats->iterations = ctx->numiterations;
+    stats->bound_evaluations = ctx->numbounds;
+    stats->peak_heap = ctx->peak_heap;
+    stats->final_heap = ctx->final_heap;
+    stats->heap_growths = ctx->heap.growths();
+    stats->pruned_states = ctx->numpruned;
+    for (unsigned int i=0; i<4; i++)
+        stats->splits[i] = ctx->numsplits[i];
+    stats->setup_time = ctx->setup_time;
+    stats->search_time = ctx->search_time;
+    stats->hit_iteration_limit = ctx->hit_iteration_limit;
+    stats->stopped_early = ctx->stopped_early;
+}
+
+// memory in bytes that the context holds for integral images. 
+// After a search, this is the footprint of the model and image size used.
+long ess_memory_usage(ESSContext* ctx) {
+    return ctx->quality_bound->memory_usage();
+}
+
+// main entry site for efficient subwindow search.
+// performs preprocessing and then branch-and-bound
+// We make it "extern C", so it's easier to call e.g. from Python
+//
+// INPUT: ESSContext* ctx,      : search context, see ess_create()
+//        int argnumpoints,     : number of data points
+//        int width, height     : width and height of image
+//        double* argxpos,      : x-coordinate of every point
+//        double* argypos,      : y-coordinate of every point
+//        double* argclst       : cluster ID of each point (starts at 0)
+//        int argnumclusters,   : number of clusterIDs 
+//        int argnumlevels,     : number of levels in the pyramid 
+//        double* weightsdata   : vector of cluster weights
+// OUTPUT: Box outputBox        : box in [left,top,right,bottom,score,gap] format
+//                                gap is 0 unless the search stopped early
+
+Box ess_search(ESSContext* ctx, int argnumpoints, int argwidth, int argheight, 
+               double* argxpos, double* argypos, double* argclst,
+               int argnumclusters, int argnumlevels, double* argweight) {
+    ctx->model.pyramid.use(argnumclusters, argnumlevels, argweight);
+    return search_with_model(ctx, argnumpoints, argwidth, argheight, 
+                             argxpos, argypos, argclst, &ctx->model);
+}
+
+// search for the argmaxresults best boxes that don't share any points:
+// after each box, the points inside are removed and the search goes on.
+// Arguments as for ess_search(), the boxes are stored in argresults. 
+// The integral images are updated in place and the search continues 
+// from the states of the previous one, so this is much cheaper than 
+// calling ess_search() again on the remaining points.
+// returns the number of boxes found
+int ess_search_topk(ESSContext* ctx, int argnumpoints, int argwidth, int argheight,
+                    double* argxpos, double* argypos, double* argclst,
+                    int argnumclusters, int argnumlevels, double* argweight,
+                    int argmaxresults, Box* argresults) {
+    ctx->model.pyramid.use(argnumclusters, argnumlevels, argweight);
+    return search_topk(ctx, argnumpoints, argwidth, argheight, argxpos, argypos, argclst,
+                       &ctx->model, argmaxresults, argresults);
+}
+
+// Compiled models: the pyramid cells and the weights in the layout the 
+// setup reads them, built once for any number of searches. Searches with 
+// a model only do the work that depends on the points. The weights are 
+// copied, so argweight can be freed after ess_model_create().
+// A model is never changed by a search, so it can be used by several 
+// contexts in different threads at the same time.
+ESSModel* ess_model_create(int argnumclusters, int argnumlevels, double* argweight) {
+    if ((argnumclusters < 1) || (argnumlevels < 1))
+        return NULL;
+    ESSModel* model = new ESSModel();
+    model->pyramid.build(argnumclusters, argnumlevels, argweight);
+    return model;
+}
+
+// Compiled SVM with an additive kernel (ESS_KERNEL_INTERSECTION or 
+// ESS_KERNEL_CHI2) on the cluster counts of a box, see KernelModel:
+// score = argbias + sum_i argalpha[i] * k(counts, vector i). argvectors
+// holds argnumclusters counts for each of the argnumvectors support 
+// vectors, vector after vector, argalpha their coefficients (label times
+// dual weight). The counts are those of a box, not normalized. The model
+// works with all searches that take an ESSModel except ess_search_large().
+// returns NULL for an unknown kernel, negative counts, or a count, 
+// coefficient or bias that is NaN or infinite
+ESSModel* ess_kernel_model_create(int argkernel, int argnumclusters, int argnumvectors,
+                                  double* argvectors, double* argalpha, double argbias) {
+    if ((argnumclusters < 1) || (argnumvectors < 0))
+        return NULL;
+    ESSModel* model = new ESSModel();
+    if (!model->kernel.build(argkernel, argnumclusters, argnumvectors, 
+                             argvectors, argalpha, argbias)) {
+        delete model;
+        return NULL;
+    }
+    return model;
+}
+
+void ess_model_destroy(ESSModel* model) {
+    delete model;
+}
+
+// same as ess_search() and ess_search_topk(), with a compiled model
+Box ess_search_model(ESSContext* ctx, const ESSModel* model, int argnumpoints, 
+                     int argwidth, int argheight, 
+                     double* argxpos, double* argypos, double* argclst) {
+    return search_with_model(ctx, argnumpoints, argwidth, argheight, 
+                             argxpos, argypos, argclst, model);
+}
+
+int ess_search_model_topk(ESSContext* ctx, const ESSModel* model, int argnumpoints, 
+                          int argwidth, int argheight, 
+                          double* argxpos, double* argypos, double* argclst,
+                          int argmaxresults, Box* argresults) {
+    return search_topk(ctx, argnumpoints, argwidth, argheight, argxpos, argypos, argclst,
+                       model, argmaxresults, argresults);
+}
+
+// search the same points with argnummodels models, e.g. one per object 
+// class, see search_multiclass(). argresults[i] gets the best box for 
+// model i, or, with argbestonly set, argresults[0] the best box of all.
+// The statistics add up over all models.
+// returns the index of the model with the best box, -1 if there is none
+int ess_search_multiclass(ESSContext* ctx, int argnummodels, ESSModel** argmodels, 
+                          int argnumpoints, int argwidth, int argheight,
+                          double* argxpos, double* argypos, double* argclst, 
+                          int argbestonly, Box* argresults) {
+    if (argnummodels < 1)
+        return -1;
+    return search_multiclass(ctx, argnumpoints, argwidth, argheight, argxpos, argypos, argclst,
+                             argnummodels, argmodels, (argbestonly != 0), argresults);
+}
+
+// search the frames of a video one after the other: each search starts 
+// from the states the frame before ended with, see search_sequence().
+// The result is the same as with ess_search_model(). 
+// ess_sequence_reset() makes the next frame start cold, e.g. at a cut.
+Box ess_search_sequence(ESSContext* ctx, const ESSModel* model, int argnumpoints, 
+                        int argwidth, int argheight, 
+                        double* argxpos, double* argypos, double* argclst) {
+    return search_sequence(ctx, argnumpoints, argwidth, argheight, 
+                           argxpos, argypos, argclst, model);
+}
+
+void ess_sequence_reset(ESSContext* ctx) {
+    ctx->has_previous = false;
+}
+
+// best box and range of frames in a window of argnumframes frames of the 
+// same size, see search_subvolume(). The per-frame arguments have one 
+// entry per frame, the range is returned in argfirstframe and arglastframe.
+// The window is searched for every range, so keep it short.
+// For invalid arguments (no frames, a missing array, a negative number 
+// of points), the result is an empty box with score -DBL_MAX, and the 
+// range is -1..-1.
+Box ess_search_subvolume(ESSContext* ctx, const ESSModel* model, int argnumframes,
+                         int* argnumpoints, int argwidth, int argheight,
+                         double** argxpos, double** argypos, double** argclst,
+                         int* argfirstframe, int* arglastframe) {
+    if (argfirstframe != NULL)
+        *argfirstframe = -1;
+    if (arglastframe != NULL)
+        *arglastframe = -1;
+    bool valid = (model != NULL) && (argnumframes >= 1) && (argnumpoints != NULL)
+                 && (argxpos != NULL) && (argypos != NULL) && (argclst != NULL)
+                 && (argfirstframe != NULL) && (arglastframe != NULL);
+    for (int f=0; valid && (f < argnumframes); f++)
+        valid = (argnumpoints[f] == 0) || ((argnumpoints[f] > 0) && (argxpos[f] != NULL) 
+                                           && (argypos[f] != NULL) && (argclst[f] != NULL));
+    if (!valid)
+        return empty_box();
+    return search_subvolume(ctx, argnumframes, argnumpoints, argwidth, argheight,
+                            argxpos, argypos, argclst, model, argfirstframe, arglastframe);
+}
+
+// search an image of any size with a 1-level model, see search_large().
+// Integral images of pixels are only set up along the edges of ranges of
+// tiles that can still hold the best box. ess_set_option(ctx, "tilesize", 
+// ...) sets the size of the finest tiles, they grow for very large 
+// images. The box is stored in argresult.
+// returns 0, or -1 if the model has more than one level or is a kernel model
+int ess_search_large(ESSContext* ctx, const ESSModel* model, int argnumpoints, 
+                     int argwidth, int argheight, 
+                     double* argxpos, double* argypos, double* argclst, Box* argresult) {
+    if (!search_large(ctx, argnumpoints, argwidth, argheight, argxpos, argypos, argclst, 
+                      model, argresult))
+        return -1;
+    return 0;
+}
+
+// search many images that share the same weights on argnumthreads threads.
+// The arguments are the same as for ess_search(), except that there is one 
+// entry per image in argnumpoints, argwidth, argheight, argxpos, argypos 
+// and argclst. The best box of image i is written to argresults[i].
+// If no thread can be started, the images are searched in the calling thread,
+// fewer than 1 thread count as 1.
+// returns 0, or -1 for a negative number of images or an empty model
+int pyramid_search_batch(int argnumimages, int* argnumpoints, int* argwidth, int* argheight,
+                         double** argxpos, double** argypos, double** argclst,
+                         int argnumclusters, int argnumlevels, double* argweight,
+                         int argnumthreads, Box* argresults) {
+    if ((argnumimages < 0) || (argnumclusters < 1) || (argnumlevels < 1))
+        return -1;
+
+// the model is the same for all images, so build it only once
+    ESSModel model;
+    model.pyramid.build(argnumclusters, argnumlevels, argweight);
+
+    BatchSearch batch;
+    pthread_mutex_init(&batch.lock, NULL);
+    batch.nextimage = 0;
+    batch.numimages = argnumimages;
+    batch.numpoints = argnumpoints;
+    batch.width = argwidth;
+    batch.height = argheight;
+    batch.xpos = argxpos;
+    batch.ypos = argypos;
+    batch.clst = argclst;
+    batch.model = &model;
+    batch.results = argresults;
+
+    if (argnumthreads > argnumimages)
+        argnumthreads = argnumimages;
+    if (argnumthreads < 1)
+        argnumthreads = 1;
+    std::vector<pthread_t> threads(argnumthreads);
+    int numstarted = 0;
+    for (int i=0; i < argnumthreads; i++) {
+        if (pthread_create(&threads[i], NULL, batch_search_worker, &batch) != 0)
+            break;  // go on with the workers we have
+        numstarted++;
     }
-    infile.close();
+    if ((numstarted == 0) && (argnumimages > 0))
+        batch_search_worker(&batch);  // no threads at all: do it ourselves
+
+    for (int i=0; i < numstarted; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&batch.lock);
+    return 0;
+}
+
+// same as pyramid_search, with argnumthreads worker threads
+Box pyramid_search_mt(int argnumpoints, int argwidth, int argheight, 
+                      double* argxpos, double* argypos, double* argclst,
+                      int argnumclusters, int argnumlevels, double* argweight,
+                      int argnumthreads) {
+    ESSContext* ctx = default_context();
+    ctx->numthreads = (argnumthreads > 0) ? argnumthreads : 1;
+    return ess_search(ctx, argnumpoints, argwidth, argheight, argxpos, argypos, argclst, 
+                      argnumclusters, argnumlevels, argweight);
+}
+
+// search with the shared default context, see ess_search()
+Box pyramid_search(int argnumpoints, int argwidth, int argheight, 
+                   double* argxpos, double* argypos, double* argclst,
+                   int argnumclusters, int argnumlevels, double* argweight) {
+    return pyramid_search_mt(argnumpoints, argwidth, argheight, argxpos, argypos, argclst, 
+                             argnumclusters, argnumlevels, argweight, 1);
+}
 
-// usually, eof occurs too late: we have read one extra entry
-    for (unsigned int i=0;i<numcolumns;i++)
-        data[i].pop_back();
+}
+
+#ifdef __MAIN__
 
-// all vector should have same length
-        const int numpts = data[0].size();
-    return numpts;
+static int maxresults = 1;
+static int numlevels = 1;
+static int large = 0;
+
+static void usage(char *progname) {
+    std::cerr << "usage: " << progname << " width height weight-file data-file\n";
+    std::cerr << "       " << progname << " serve weight-file[:numlevels] [weight-file ...]\n";
+    exit(1);
 }
 
 // parse an int value from env variable
@@ -236,27 +2120,63 @@ static int igetenv(const char* name, int defaultvalue, int low, int high) {
 static void set_parameters() {
     maxresults = igetenv("maxresults",1,1,10000);
     numlevels = igetenv("numlevels",1,1,100);
-    maxiterations = igetenv("iterations",1,100000000,100000000);
-    verbose = igetenv("verbose",0,0,100000000);
+    large = igetenv("large",0,0,1);
+    return;
+}
+
+// the same for the options of a search context. The server calls this 
+// from every worker thread, so it only changes the context.
+static void set_options(ESSContext* ctx) {
+    ess_set_option(ctx, "iterations", igetenv("iterations",1,100000000,100000000));
+    ess_set_option(ctx, "verbose", igetenv("verbose",0,0,100000000));
+    ess_set_option(ctx, "numthreads", igetenv("numthreads",1,1,1024));
+    ess_set_option(ctx, "split", igetenv("split",2,2,16));
+    ess_set_option(ctx, "interleaved", igetenv("interleaved",0,0,1));
+    ess_set_option(ctx, "precision", igetenv("precision",64,32,64));
+    ess_set_option(ctx, "compress", igetenv("compress",0,0,1));
+    ess_set_option(ctx, "prune", igetenv("prune",0,0,1));
+    ess_set_option(ctx, "gap", igetenv("gap",0,0,1000000));
+    ess_set_option(ctx, "timelimit", igetenv("timelimit",0,0,100000000));
+    ess_set_option(ctx, "overlap", igetenv("overlap",0,0,99));
+    ess_set_option(ctx, "tilesize", igetenv("tilesize",64,2,16000));
+    ess_set_option(ctx, "coarse", igetenv("coarse",0,0,64));
     return;
 }
 
 int main(int argc, char* argv[]) {
+// server mode: load the models, then answer requests, see ess_server.hh
+    if ((argc >= 3) && (strcmp(argv[1], "serve") == 0)) {
+        set_parameters();
+        return run_server(argc-2, &argv[2], numlevels, maxresults, 
+                          igetenv("numthreads",1,1,1024), getenv("socket"), getenv("datadir"),
+                          set_options);
+    }
+
     if (argc < 5)
         usage(argv[0]);
 
+    ESSContext* ctx = ess_create();
     set_parameters();
-    sstate_heap H;
+    set_options(ctx);
 
-// first two arguments are width and height. 
+// first two arguments are width and height. Larger images are searched
+// in tiles, see ess_search_large()
     const int width = atoi(argv[1]);
     const int height = atoi(argv[2]);
-    if ((width<2) || (width>MAXWIDTH) || (height<2) || (height>MAXHEIGHT))
+    if ((width<2) || (height<2))
        usage(argv[0]);
+    if ((width>MAXWIDTH) || (height>MAXHEIGHT))
+        large = 1;
+    if (large && ((numlevels != 1) || (maxresults != 1))) {
+        std::cerr << "Large images need numlevels=1 and maxresults=1" << std::endl;
+        usage(argv[0]);
+    }
 
 // read weight for clusters (1 column)
-    std::vector< std::vector<double> > weightdata(1);
-    int numweights = readdata_NxM(argv[3], weightdata);
+    ESSDataFile weightfile;
+    std::vector< std::vector<double> > weightdata;
+    std::vector<double*> weightcolumns(1);
+    const long numweights = read_datafile(argv[3], weightfile, weightdata, weightcolumns);
     if (numweights <= 0) {
         std::cerr << "Error reading data from file \n" << argv[3] << std::endl;
         usage(argv[0]);
@@ -271,49 +2191,45 @@ int main(int argc, char* argv[]) {
 
 
 // read 3-column data file in format x,y,clusterID
-    std::vector< std::vector<double> > rawdata(3);
-    int datapts = readdata_NxM(argv[4], rawdata);
+    ESSDataFile datafile;
+    std::vector< std::vector<double> > rawdata;
+    std::vector<double*> datacolumns(3);
+    const long datapts = read_datafile(argv[4], datafile, rawdata, datacolumns);
     if (datapts <= 0) {
         std::cerr << "Error reading data from file \n" << argv[4] << std::endl;
         usage(argv[0]);
     }
 
-// convert from Nx3 matrix to individual vectors. Not very elegant...
-    double* xpos = &rawdata[0][0];
-    double* ypos = &rawdata[1][0];
-    double* clst = &rawdata[2][0];
-    double* weights = &weightdata[0][0];
+    double* xpos = datacolumns[0];
+    double* ypos = datacolumns[1];
+    double* clst = datacolumns[2];
+    double* weights = weightcolumns[0];
 
-// loop over target number of boxes
-    for (int k=maxresults; k>0; --k) {
-        Box bestBox = pyramid_search(datapts, width, height,  xpos, ypos, clst, 
-                                     numclusters, numlevels, weights);
+// search for the target number of boxes. After each box, the points 
+// inside are removed, so the next box is found among the others.
+    std::vector<Box> bestBoxes(maxresults);
+    int numfound = 1;
+    if (large) {
+        ESSModel* model = ess_model_create(numclusters, numlevels, weights);
+        ess_search_large(ctx, model, datapts, width, height, xpos, ypos, clst, &bestBoxes[0]);
+        ess_model_destroy(model);
+    } else
+        numfound = ess_search_topk(ctx, datapts, width, height, xpos, ypos, clst, 
+                                   numclusters, numlevels, weights, 
+                                   maxresults, &bestBoxes[0]);
+    for (int k=0; k < numfound; k++) {
+        const Box &bestBox = bestBoxes[k];
         std::cout << std::setprecision(12) << bestBox.score << " ";
         std::cout << bestBox.left << " ";
         std::cout << bestBox.top << " ";
         std::cout << bestBox.right << " ";
         std::cout << bestBox.bottom << " " ;
-
-// before searching for next boxes, zero out the region of the box found.
-// because removing elements from an array is cumbersome, we create a new one 
-// from only points outside the box
-        if (k>0) {
-            std::vector< std::vector<double> > tmpdata(3);
-            for (int i=0;i<datapts;i++) {
-                if  ((xpos[i]<bestBox.left) || (xpos[i]>bestBox.right)
-                    || (ypos[i]<bestBox.top) || (ypos[i]>bestBox.bottom)) {
-                        tmpdata[0].push_back(xpos[i]);
-                        tmpdata[1].push_back(ypos[i]);
-                        tmpdata[2].push_back(clst[i]);
-                }
-            }
-            datapts = tmpdata[0].size();
-            for (int i=0;i<3;i++) {
-                rawdata[i].resize(datapts);
-                std::copy(tmpdata[i].begin(), tmpdata[i].end(), rawdata[i].begin());
-            }
-        }
     }
     std::cout << std::endl;
+    for (int k=0; k < numfound; k++) {
+        if (bestBoxes[k].gap > 0.)
+            std::cerr << "#box " << k << " stopped early, gap " << bestBoxes[k].gap << std::endl;
+    }
+    ess_destroy(ctx);
 }
 #endif
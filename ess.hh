@@ -35,7 +35,8 @@
 #include <stdio.h>
 #include <limits>
 #include <string>
-#include <queue>
+#include <algorithm>
+#include <vector>
 
 // structure holding a single box
 typedef struct { 
@@ -44,6 +45,7 @@ typedef struct {
         int right;
         int bottom;
         double score;
+        double gap;     // how much better a box could be, if the search stopped early
 } Box;
 
 // structure to hold a set of boxes ( = a state during search)
@@ -94,31 +96,200 @@ class sstate {
         return ((low[0] <= high[2]) && (low[1] <= high[3]));
     }
 
-    // "less" is needed to compare states in stl_priority queue
+    // "less" is needed to compare states in sstate_heap
     bool less(const sstate* other) const {
         return upper < other->upper;
     }
 };
 
 
-// helper routine for comparing elements in priority queue
-class sstate_comparisson {
+// Priority queue of states, the one with the highest bound on top.
+// The states are stored by value in one array, so comparing two of them 
+// doesn't follow pointers to memory somewhere else. It's a 4-ary heap:
+// the children of entry i are 4i+1 ... 4i+4, they share a cache line or 
+// two, and the tree is only half as deep as a binary heap. 
+// top() points into the array, it's only valid until the next change.
+class sstate_heap {
+  private:
+    static const unsigned long arity = 4;
+    std::vector<sstate> c;
+    long numgrowths;        // times the array was reallocated, see growths()
+
+    // move entry i up until its parent has a bound at least as high
+    void sift_up(unsigned long i) {
+        const sstate moving = c[i];
+        while (i > 0) {
+            const unsigned long parent = (i-1)/arity;
+            if (!c[parent].less(&moving))
+                break;
+            c[i] = c[parent];
+            i = parent;
+        }
+        c[i] = moving;
+    }
+
+    // move entry i down until no child has a higher bound
+    void sift_down(unsigned long i) {
+        const unsigned long n = c.size();
+        const sstate moving = c[i];
+        while (true) {
+            const unsigned long first = arity*i+1;
+            if (first >= n)
+                break;
+            const unsigned long last = std::min(first+arity, n);
+            unsigned long best = first;
+            for (unsigned long k=first+1; k < last; k++) {
+                if (c[best].less(&c[k]))
+                    best = k;
+            }
+            if (!moving.less(&c[best]))
+                break;
+            c[i] = c[best];
+            i = best;
+        }
+        c[i] = moving;
+    }
+
   public:
-    bool operator() (const sstate* lhs, const sstate* rhs) const {
-        return lhs->less(rhs);
+    sstate_heap() : numgrowths(0) { }
+
+    bool empty() const { return c.empty(); }
+    unsigned long size() const { return c.size(); }
+    const sstate* top() const { return &c[0]; }
+
+    void push(const sstate &argstate) {
+        if (c.size() == c.capacity())
+            numgrowths++;
+        c.push_back(argstate);
+        sift_up(c.size()-1);
+    }
+
+    // add states at the end without ordering them, call rebuild() afterwards
+    void append(const std::vector<sstate> &argstates) {
+        if (c.size() + argstates.size() > c.capacity())
+            numgrowths++;
+        c.insert(c.end(), argstates.begin(), argstates.end());
+    }
+
+    void pop() {
+        c[0] = c.back();
+        c.pop_back();
+        if (!c.empty())
+            sift_down(0);
     }
+
+    // remove all entries, but keep the memory for the next search
+    void clear() { c.clear(); }
+
+    // direct access to the entries, e.g. to change their bounds.
+    // Call rebuild() afterwards to restore the heap order.
+    std::vector<sstate>& entries() { return c; }
+    void rebuild() {
+        if (c.size() < 2)
+            return;
+        for (unsigned long i=(c.size()-2)/arity+1; i-- > 0; )   // all parents, last first
+            sift_down(i);
+    }
+
+    long memory_usage() const { return c.capacity()*sizeof(sstate); }
+
+    // number of times the array had to grow since reset_growths(). The 
+    // memory is kept between searches, so this is 0 once a context has 
+    // seen a search of the same size.
+    long growths() const { return numgrowths; }
+    void reset_growths() { numgrowths = 0; }
 };
 
-// data structure for priority queue
-typedef std::priority_queue<const sstate*, 
-                            std::vector<const sstate*>, 
-                            sstate_comparisson> sstate_heap;
 
+// statistics of the last search of a context, see ess_get_stats()
+typedef struct {
+        long iterations;            // states split
+        long bound_evaluations;     // upper bounds computed
+        long peak_heap;             // most states in the heap at once
+        long final_heap;            // states left in the heap at the end
+        long heap_growths;          // times the heap had to allocate a larger array
+        long pruned_states;         // states dropped by "prune"
+        long splits[4];             // splits of left, top, right, bottom coordinate
+        double setup_time;          // seconds to build the integral images
+        double search_time;         // seconds of branch-and-bound
+        int hit_iteration_limit;    // 1 if the search stopped at "iterations"
+        int stopped_early;          // 1 if a box is not the optimum (see Box.gap)
+} ESSStats;
+
+// search context: owns quality function, buffers and settings
+typedef struct ESSContext ESSContext;
+
+// compiled model: pyramid cells and weights, shared by many searches
+typedef struct ESSModel ESSModel;
+
+// additive kernels of SVM models, see ess_kernel_model_create()
+enum {
+    ESS_KERNEL_INTERSECTION = 1,    // sum_c min(h_c, x_c)
+    ESS_KERNEL_CHI2         = 2     // sum_c 2 h_c x_c / (h_c + x_c)
+};
 
 extern "C" {
+ESSContext* ess_create();
+void ess_destroy(ESSContext* ctx);
+int ess_set_option(ESSContext* ctx, const char* name, int value);
+long ess_memory_usage(ESSContext* ctx);
+void ess_get_stats(ESSContext* ctx, ESSStats* stats);
+
+Box ess_search(ESSContext* ctx, int argnumpoints, int argwidth, int argheight,
+               double* argxpos, double* argypos, double* argclst,
+               int argnumclusters, int argnumlevels, double* argweight);
+
+int ess_search_topk(ESSContext* ctx, int argnumpoints, int argwidth, int argheight,
+                    double* argxpos, double* argypos, double* argclst,
+                    int argnumclusters, int argnumlevels, double* argweight,
+                    int argmaxresults, Box* argresults);
+
+ESSModel* ess_model_create(int argnumclusters, int argnumlevels, double* argweight);
+ESSModel* ess_kernel_model_create(int argkernel, int argnumclusters, int argnumvectors,
+                                  double* argvectors, double* argalpha, double argbias);
+void ess_model_destroy(ESSModel* model);
+
+Box ess_search_model(ESSContext* ctx, const ESSModel* model, int argnumpoints, 
+                     int argwidth, int argheight, 
+                     double* argxpos, double* argypos, double* argclst);
+
+int ess_search_model_topk(ESSContext* ctx, const ESSModel* model, int argnumpoints, 
+                          int argwidth, int argheight, 
+                          double* argxpos, double* argypos, double* argclst,
+                          int argmaxresults, Box* argresults);
+
+int ess_search_multiclass(ESSContext* ctx, int argnummodels, ESSModel** argmodels, 
+                          int argnumpoints, int argwidth, int argheight,
+                          double* argxpos, double* argypos, double* argclst, 
+                          int argbestonly, Box* argresults);
+
+Box ess_search_sequence(ESSContext* ctx, const ESSModel* model, int argnumpoints, 
+                        int argwidth, int argheight, 
+                        double* argxpos, double* argypos, double* argclst);
+void ess_sequence_reset(ESSContext* ctx);
+
+Box ess_search_subvolume(ESSContext* ctx, const ESSModel* model, int argnumframes,
+                         int* argnumpoints, int argwidth, int argheight,
+                         double** argxpos, double** argypos, double** argclst,
+                         int* argfirstframe, int* arglastframe);
+
+int ess_search_large(ESSContext* ctx, const ESSModel* model, int argnumpoints, 
+                     int argwidth, int argheight, 
+                     double* argxpos, double* argypos, double* argclst, Box* argresult);
+
 Box pyramid_search(int argnumpoints, int argwidth, int argheight,
                    double* argxpos, double* argypos, double* argclst,
                    int argnumclusters, int argnumlevels, double* argweight);
+
+Box pyramid_search_mt(int argnumpoints, int argwidth, int argheight,
+                      double* argxpos, double* argypos, double* argclst,
+                      int argnumclusters, int argnumlevels, double* argweight,
+                      int argnumthreads);
+
+int pyramid_search_batch(int argnumimages, int* argnumpoints, int* argwidth, int* argheight,
+                         double** argxpos, double** argypos, double** argclst,
+                         int argnumclusters, int argnumlevels, double* argweight,
+                         int argnumthreads, Box* argresults);
 }
 
 #endif
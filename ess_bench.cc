@@ -0,0 +1,216 @@
+/********************************************************
+ *                                                      *
+ *  Efficient Subwindow Search (ESS) implemented in C++ *
+ *  benchmark on synthetic feature sets, optionally on  *
+ *  the ESS examples, with tab separated output         *
+ *                                                      *
+ *   Copyright 2006-2008 Christoph Lampert              *
+ *   Contact: <mail@christoph-lampert.org>              *
+ *                                                      *
+ *  Licensed under the Apache License, Version 2.0 (the *
+ *  "License"); you may not use this file except in     *
+ *  compliance with the License. You may obtain a copy  *
+ *  of the License at                                   *
+ *                                                      *
+ *     http://www.apache.org/licenses/LICENSE-2.0       *
+ *                                                      *
+ *  Unless required by applicable law or agreed to in   *
+ *  writing, software distributed under the License is  *
+ *  distributed on an "AS IS" BASIS, WITHOUT WARRANTIES *
+ *  OR CONDITIONS OF ANY KIND, either express or        *
+ *  implied. See the License for the specific language  *
+ *  governing permissions and limitations under the     *
+ *  License.                                            *
+ *                                                      *
+ ********************************************************/
+
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "ess.hh"
+#include "ess_data.hh"
+#include "ess_random.hh"
+
+// one benchmark case: points of an image and the weights to search with
+typedef struct {
+    std::string name;
+    int width, height;
+    int numclusters, numlevels;
+    std::vector<double> xpos, ypos, clst;
+    std::vector<double> weights;
+} BenchCase;
+
+// Features are spread over the whole image, with more of them inside an
+// object region in the left half. Inside the region, most features come
+// from the first third of the clusters, and those have positive weights,
+// so there is a clear best box, as with a trained detector.
+static void make_synthetic(BenchCase &bench, int argwidth, int argheight, double argdensity,
+                           int argnumclusters, int argnumlevels, unsigned long long seed) {
+    ESSRandom rng(seed);
+    const int numpoints = static_cast<int>(argdensity*argwidth*argheight);
+    const int numcells = argnumlevels*(argnumlevels+1)*(2*argnumlevels+1)/6;
+    const int numgood = std::max(1, argnumclusters/3);
+
+    std::ostringstream name;
+    name << "synthetic-" << argwidth << "x" << argheight << "-d" << argdensity
+         << "-k" << argnumclusters << "-l" << argnumlevels;
+    bench.name = name.str();
+    bench.width = argwidth;
+    bench.height = argheight;
+    bench.numclusters = argnumclusters;
+    bench.numlevels = argnumlevels;
+
+    bench.xpos.resize(numpoints);
+    bench.ypos.resize(numpoints);
+    bench.clst.resize(numpoints);
+    for (int k=0; k < numpoints; k++) {
+        int x, y;
+        if (rng.uniform01() < 0.3) {
+            x = argwidth/4 + rng.uniform(argwidth/4);
+            y = argheight/3 + rng.uniform(argheight/3);
+        } else {
+            x = rng.uniform(argwidth);
+            y = rng.uniform(argheight);
+        }
+        const bool inside = (x >= argwidth/4) && (x < argwidth/2)
+                            && (y >= argheight/3) && (y < 2*argheight/3);
+        bench.xpos[k] = x;
+        bench.ypos[k] = y;
+        bench.clst[k] = (inside && (rng.uniform01() < 0.7)) ? rng.uniform(numgood)
+                                                             : rng.uniform(argnumclusters);
+    }
+
+    bench.weights.resize(numcells*argnumclusters);
+    for (int i=0; i < numcells*argnumclusters; i++) {
+        const double noise = rng.uniform01() + rng.uniform01() - 1.;
+        bench.weights[i] = noise - 0.5 + (((i % argnumclusters) < numgood) ? 1.2 : 0.);
+    }
+    return;
+}
+
+// load one of the examples that come with ESS, returns false if it's missing
+static bool load_example(BenchCase &bench, const char* argname, int argwidth, int argheight,
+                         int argnumlevels, const char* argweightfile, const char* argdatafile) {
+    ESSDataFile weightfile, datafile;
+    std::vector< std::vector<double> > weightbuffers, databuffers;
+    std::vector<double*> weightcolumns(1), datacolumns(3);
+    const long numweights = read_datafile(argweightfile, weightfile, weightbuffers, weightcolumns);
+    const long numpoints = read_datafile(argdatafile, datafile, databuffers, datacolumns);
+    const int numcells = argnumlevels*(argnumlevels+1)*(2*argnumlevels+1)/6;
+    if ((numweights <= 0) || (numpoints <= 0))
+        return false;
+
+    bench.name = argname;
+    bench.width = argwidth;
+    bench.height = argheight;
+    bench.numlevels = argnumlevels;
+    bench.numclusters = numweights/numcells;
+    bench.weights.assign(weightcolumns[0], weightcolumns[0]+numweights);
+    bench.xpos.assign(datacolumns[0], datacolumns[0]+numpoints);
+    bench.ypos.assign(datacolumns[1], datacolumns[1]+numpoints);
+    bench.clst.assign(datacolumns[2], datacolumns[2]+numpoints);
+    return true;
+}
+
+// parse an int value from env variable
+static int igetenv(const char* name, int defaultvalue) {
+    if (getenv(name))
+        return atoi(getenv(name));
+    return defaultvalue;
+}
+
+// run a case 'repeat' times and print one line with the fastest run.
+// With arglegacy, the weights are passed to ess_search() every time 
+// instead of compiled into a model once.
+static void run_case(ESSContext* ctx, BenchCase &bench, int repeat, bool arglegacy) {
+    ESSModel* model = ess_model_create(bench.numclusters, bench.numlevels, &bench.weights[0]);
+    ESSStats best = ESSStats();
+    Box box;
+    for (int r=0; r < repeat; r++) {
+        ESSStats stats;
+        if (arglegacy)
+            box = ess_search(ctx, bench.xpos.size(), bench.width, bench.height,
+                             &bench.xpos[0], &bench.ypos[0], &bench.clst[0],
+                             bench.numclusters, bench.numlevels, &bench.weights[0]);
+        else
+            box = ess_search_model(ctx, model, bench.xpos.size(), bench.width, bench.height,
+                                   &bench.xpos[0], &bench.ypos[0], &bench.clst[0]);
+        ess_get_stats(ctx, &stats);
+        if ((r == 0) || (stats.setup_time+stats.search_time < best.setup_time+best.search_time))
+            best = stats;
+    }
+    ess_model_destroy(model);
+
+    const double boundrate = (best.search_time > 0.) ? best.bound_evaluations/best.search_time : 0.;
+    std::cout << bench.name << "\t" << bench.width << "\t" << bench.height << "\t"
+              << bench.xpos.size() << "\t" << bench.numclusters << "\t" << bench.numlevels << "\t"
+              << std::fixed << std::setprecision(6) << best.setup_time << "\t" << best.search_time << "\t"
+              << best.iterations << "\t" << std::setprecision(0) << boundrate << "\t"
+              << best.peak_heap << "\t" << best.heap_growths << "\t" << std::setprecision(6) 
+              << box.score << std::endl;
+    std::cout.unsetf(std::ios::fixed);
+}
+
+int main(int argc, char* argv[]) {
+    ESSContext* ctx = ess_create();
+    const char* options[] = { "numthreads", "split", "interleaved", "precision", "compress", "prune",
+                              "iterations", "coarse", NULL };
+    for (int i=0; options[i]; i++) {
+        if (getenv(options[i]) && (ess_set_option(ctx, options[i], igetenv(options[i], 0)) != 0)) {
+            std::cerr << "invalid value for " << options[i] << std::endl;
+            return 1;
+        }
+    }
+    const int repeat = std::max(1, igetenv("repeat", 1));
+    const bool quick = (igetenv("quick", 0) != 0);
+    const bool legacy = (igetenv("legacy", 0) != 0);
+
+    std::cout << "#case\twidth\theight\tpoints\tclusters\tlevels\tsetup_s\tsearch_s"
+              << "\titerations\tbounds_per_s\tpeak_heap\theap_growths\tscore" << std::endl;
+
+    // the examples of the ESS distribution, if a directory with them is given
+    const char* examplepath = (argc > 1) ? argv[1] : NULL;
+    const struct { const char* name; int width, height, numlevels; const char* weight; const char* data; }
+        examples[] = { { "cow",    368, 272, 1, "cow.weight",    "cow.clst" },
+                       { "car-l1", 151, 101, 1, "car-l1.weight", "car.clst" },
+                       { "car-l2", 151, 101, 2, "car-l2.weight", "car.clst" } };
+    for (unsigned int i=0; examplepath && (i < sizeof(examples)/sizeof(examples[0])); i++) {
+        BenchCase bench;
+        const std::string weightfile = std::string(examplepath) + "/" + examples[i].weight;
+        const std::string datafile = std::string(examplepath) + "/" + examples[i].data;
+        if (load_example(bench, examples[i].name, examples[i].width, examples[i].height,
+                         examples[i].numlevels, weightfile.c_str(), datafile.c_str()))
+            run_case(ctx, bench, repeat, legacy);
+        else
+            std::cerr << "#skipping " << examples[i].name << ", can't read " << datafile << std::endl;
+    }
+
+    // synthetic cases: image size x point density x clusters x pyramid levels
+    const int sizes[][2] = { {160, 120}, {320, 240}, {640, 480} };
+    const double densities[] = { 0.01, 0.05 };
+    const int clusters[] = { 100, 1000 };
+    const int numsizes = quick ? 1 : 3;
+    const int maxlevels = quick ? 2 : 3;
+    for (int s=0; s < numsizes; s++) {
+        for (int d=0; d < 2; d++) {
+            for (int k=0; k < 2; k++) {
+                for (int l=1; l <= maxlevels; l++) {
+                    // the data of a case doesn't depend on which other cases run
+                    const unsigned long long seed = ((s*2 + d)*2 + k)*4 + l;
+                    BenchCase bench;
+                    make_synthetic(bench, sizes[s][0], sizes[s][1], densities[d],
+                                   clusters[k], l, seed);
+                    run_case(ctx, bench, repeat, legacy);
+                }
+            }
+        }
+    }
+    ess_destroy(ctx);
+    return 0;
+}
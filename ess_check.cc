@@ -0,0 +1,844 @@
+/********************************************************
+ *                                                      *
+ *  Efficient Subwindow Search (ESS) implemented in C++ *
+ *  regression checks: searches on small random images *
+ *  against the best box found by brute force          *
+ *                                                      *
+ *   Copyright 2006-2008 Christoph Lampert              *
+ *   Contact: <mail@christoph-lampert.org>              *
+ *                                                      *
+ *  Licensed under the Apache License, Version 2.0 (the *
+ *  "License"); you may not use this file except in     *
+ *  compliance with the License. You may obtain a copy  *
+ *  of the License at                                   *
+ *                                                      *
+ *     http://www.apache.org/licenses/LICENSE-2.0       *
+ *                                                      *
+ *  Unless required by applicable law or agreed to in   *
+ *  writing, software distributed under the License is  *
+ *  distributed on an "AS IS" BASIS, WITHOUT WARRANTIES *
+ *  OR CONDITIONS OF ANY KIND, either express or        *
+ *  implied. See the License for the specific language  *
+ *  governing permissions and limitations under the     *
+ *  License.                                            *
+ *                                                      *
+ ********************************************************/
+
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "ess.hh"
+#include "quality_pyramid.hh"
+#include "quality_pyramid_simd.hh"
+#include "ess_random.hh"
+
+#define TOLERANCE 1e-4      // scores are reported as float
+
+// a small image with a 1-level model. The weights are multiples of 0.1,
+// whose sums in different orders differ by rounding noise, and sometimes
+// all negative, so the best box can be an empty one with score 0.
+typedef struct {
+    int width, height, numclusters;
+    std::vector<double> xpos, ypos, clst;
+    std::vector<double> weights;
+} CheckCase;
+
+static void make_case(CheckCase &argcase, ESSRandom &rng, int argmaxsize, int argmaxpoints) {
+    static const double values[] = { 0.1, 0.2, 0.3, 0.7, -0.1, -0.2, -0.3, -0.6 };
+    argcase.width = 1 + rng.uniform(argmaxsize);
+    argcase.height = 1 + rng.uniform(argmaxsize);
+    argcase.numclusters = 1 + rng.uniform(6);
+    const int numpoints = rng.uniform(argmaxpoints+1);
+    argcase.xpos.resize(numpoints);
+    argcase.ypos.resize(numpoints);
+    argcase.clst.resize(numpoints);
+    for (int k=0; k < numpoints; k++) {
+        argcase.xpos[k] = rng.uniform(argcase.width);
+        argcase.ypos[k] = rng.uniform(argcase.height);
+        argcase.clst[k] = rng.uniform(argcase.numclusters);
+    }
+    const bool negative = (rng.uniform(4) == 0);
+    argcase.weights.resize(argcase.numclusters);
+    for (int c=0; c < argcase.numclusters; c++)
+        argcase.weights[c] = values[rng.uniform(4) + (negative ? 4 : rng.uniform(2)*4)];
+}
+
+// another random image of the same size as argfirst, with the same model
+static void make_frame(CheckCase &argframe, const CheckCase &argfirst, ESSRandom &rng) {
+    make_case(argframe, rng, 12, 30);
+    argframe.width = argfirst.width;
+    argframe.height = argfirst.height;
+    argframe.numclusters = argfirst.numclusters;
+    argframe.weights = argfirst.weights;
+    for (unsigned int k=0; k < argframe.xpos.size(); k++) {
+        argframe.xpos[k] = std::min<double>(argframe.xpos[k], argframe.width-1);
+        argframe.ypos[k] = std::min<double>(argframe.ypos[k], argframe.height-1);
+        argframe.clst[k] = std::min<double>(argframe.clst[k], argframe.numclusters-1);
+    }
+}
+
+// the entries of a vector for the C interface, NULL if there are none:
+// &v[0] of an empty vector is undefined
+static double* data_of(std::vector<double> &v) {
+    return v.empty() ? NULL : &v[0];
+}
+
+// ess_search_model() on an image with its own 1-level model
+static Box search_case(ESSContext* ctx, CheckCase &argcase) {
+    ESSModel* model = ess_model_create(argcase.numclusters, 1, &argcase.weights[0]);
+    const Box box = ess_search_model(ctx, model, argcase.xpos.size(), argcase.width, argcase.height,
+                                     data_of(argcase.xpos), data_of(argcase.ypos), data_of(argcase.clst));
+    ess_model_destroy(model);
+    return box;
+}
+
+// exact score of a box, 0 for boxes outside the image
+static double box_score(const CheckCase &argcase, const Box &box) {
+    double score = 0.;
+    for (unsigned int k=0; k < argcase.xpos.size(); k++) {
+        if ((argcase.xpos[k] >= box.left) && (argcase.xpos[k] <= box.right)
+            && (argcase.ypos[k] >= box.top) && (argcase.ypos[k] <= box.bottom))
+            score += argcase.weights[static_cast<int>(argcase.clst[k])];
+    }
+    return score;
+}
+
+// the best score of all boxes, from an integral image
+static double brute_force(const CheckCase &argcase) {
+    const int w = argcase.width+1;
+    const int h = argcase.height+1;
+    std::vector<double> integral(w*h, 0.);
+    for (unsigned int k=0; k < argcase.xpos.size(); k++)
+        integral[(static_cast<int>(argcase.ypos[k])+1)*w + static_cast<int>(argcase.xpos[k])+1]
+            += argcase.weights[static_cast<int>(argcase.clst[k])];
+    for (int y=1; y < h; y++)
+        for (int x=1; x < w; x++)
+            integral[y*w+x] += integral[(y-1)*w+x] + integral[y*w+x-1] - integral[(y-1)*w+x-1];
+    double best = -1e300;
+    for (int left=1; left < w; left++)
+        for (int right=left; right < w; right++)
+            for (int top=1; top < h; top++)
+                for (int bottom=top; bottom < h; bottom++)
+                    best = std::max(best, integral[bottom*w+right] - integral[(top-1)*w+right]
+                                          - integral[bottom*w+left-1] + integral[(top-1)*w+left-1]);
+    return best;
+}
+
+// true if the box lies inside the image
+static bool box_inside(const CheckCase &argcase, const Box &box) {
+    return (box.left >= 0) && (box.left <= box.right) && (box.right < argcase.width)
+           && (box.top >= 0) && (box.top <= box.bottom) && (box.bottom < argcase.height);
+}
+
+// true if box is a box of the image with the best score, and it is reported
+static bool check_box(const char* argname, int argnumber, const CheckCase &argcase,
+                      const Box &box, double argbest) {
+    const bool inside = box_inside(argcase, box);
+    const double score = inside ? box_score(argcase, box) : 0.;
+    if (inside && (fabs(score - argbest) <= TOLERANCE) && (fabs(box.score - argbest) <= TOLERANCE))
+        return true;
+    std::cerr << argname << " case " << argnumber << " (" << argcase.width << "x" << argcase.height
+              << ", " << argcase.xpos.size() << " points): box " << box.left << " " << box.top
+              << " " << box.right << " " << box.bottom << " reported " << box.score
+              << ", its score " << score << ", best " << argbest << std::endl;
+    return false;
+}
+
+// the check of one random image, see run_cases(). Anything else random
+// comes from rng, argdata holds the parameters of the check.
+// returns the number of failures, after printing them
+typedef int (*CaseCheck)(const char* argname, int argnumber, ESSContext* ctx, 
+                         CheckCase &argcase, ESSRandom &rng, void* argdata);
+
+// runs argcheck on argnumcases random images of up to argmaxsize pixels
+// per side and argmaxpoints points, all with one context that has the 
+// options argoptions ("name", "value" pairs, NULL terminated).
+// returns the number of failures
+static int run_cases(const char* argname, const char** argoptions, int argnumcases,
+                     int argmaxsize, int argmaxpoints, CaseCheck argcheck, void* argdata) {
+    ESSContext* ctx = ess_create();
+    for (int i=0; argoptions[i]; i += 2)
+        ess_set_option(ctx, argoptions[i], atoi(argoptions[i+1]));
+    ESSRandom rng(argnumcases);
+    int numfailed = 0;
+    for (int n=0; n < argnumcases; n++) {
+        CheckCase testcase;
+        make_case(testcase, rng, argmaxsize, argmaxpoints);
+        numfailed += argcheck(argname, n, ctx, testcase, rng, argdata);
+    }
+    ess_destroy(ctx);
+    return numfailed;
+}
+
+static int search_check(const char* argname, int argnumber, ESSContext* ctx, 
+                        CheckCase &argcase, ESSRandom& /*rng*/, void* /*argdata*/) {
+    return check_box(argname, argnumber, argcase, search_case(ctx, argcase), brute_force(argcase)) ? 0 : 1;
+}
+
+// searches with the options argoptions on argnumcases random images
+static int check_search(const char* argname, const char** argoptions, int argnumcases) {
+    return run_cases(argname, argoptions, argnumcases, 12, 30, search_check, NULL);
+}
+
+static int multiclass_check(const char* argname, int argnumber, ESSContext* ctx, 
+                            CheckCase &argcase, ESSRandom &rng, void* argdata) {
+    const int nummodels = reinterpret_cast<int*>(argdata)[0];
+    const bool bestonly = reinterpret_cast<int*>(argdata)[1];
+    std::vector<CheckCase> testcases(nummodels, argcase);
+    std::vector<ESSModel*> models(nummodels);
+    std::vector<double> best(nummodels);
+    for (int m=0; m < nummodels; m++) {
+        if (m > 0) {    // the same points, the weights of another random case
+            CheckCase other;
+            make_case(other, rng, 12, 0);
+            for (int c=0; c < testcases[m].numclusters; c++)
+                testcases[m].weights[c] = other.weights[c % other.numclusters];
+        }
+        models[m] = ess_model_create(testcases[m].numclusters, 1, &testcases[m].weights[0]);
+        best[m] = brute_force(testcases[m]);
+    }
+    std::vector<Box> results(nummodels);
+    const int bestclass = ess_search_multiclass(ctx, nummodels, &models[0], argcase.xpos.size(),
+                                                argcase.width, argcase.height, data_of(argcase.xpos),
+                                                data_of(argcase.ypos), data_of(argcase.clst), 
+                                                bestonly, &results[0]);
+    const double bestscore = *std::max_element(best.begin(), best.end());
+    int numfailed = 0;
+    if ((bestclass < 0) || (bestclass >= nummodels) || (fabs(best[bestclass] - bestscore) > TOLERANCE)) {
+        std::cerr << argname << " case " << argnumber << ": class " << bestclass 
+                  << " reported, best score " << bestscore << std::endl;
+        numfailed++;
+    }
+    else if (bestonly) {
+        if (!check_box(argname, argnumber, testcases[bestclass], results[0], bestscore))
+            numfailed++;
+    }
+    else {
+        for (int m=0; m < nummodels; m++) {
+            const Box single = search_case(ctx, testcases[m]);
+            if (!check_box(argname, argnumber*nummodels+m, testcases[m], results[m], best[m])
+                || !check_box(argname, argnumber*nummodels+m, testcases[m], single, results[m].score)) {
+                numfailed++;
+                break;
+            }
+        }
+    }
+    for (int m=0; m < nummodels; m++)
+        ess_model_destroy(models[m]);
+    return numfailed;
+}
+
+// ess_search_multiclass() with argnummodels models on the same points,
+// per model and with argbestonly: every box against the brute force one 
+// of its model and the score of ess_search_model() with that model alone
+static int check_multiclass(const char* argname, const char** argoptions, int argnumcases, 
+                            int argnummodels, bool argbestonly) {
+    int parameters[] = { argnummodels, argbestonly };
+    return run_cases(argname, argoptions, argnumcases, 12, 30, multiclass_check, parameters);
+}
+
+// see check_anytime()
+typedef struct {
+    int numstopped;
+} AnytimeCheck;
+
+static int anytime_check(const char* argname, int argnumber, ESSContext* ctx, 
+                         CheckCase &argcase, ESSRandom& /*rng*/, void* argdata) {
+    const Box box = search_case(ctx, argcase);
+    ESSStats stats;
+    ess_get_stats(ctx, &stats);
+    reinterpret_cast<AnytimeCheck*>(argdata)->numstopped += stats.stopped_early;
+
+    const double best = brute_force(argcase);
+    if (!stats.stopped_early)
+        return (check_box(argname, argnumber, argcase, box, best) && (box.gap == 0.)) ? 0 : 1;
+    const bool inside = box_inside(argcase, box);
+    const double score = inside ? box_score(argcase, box) : 0.;
+    if (inside && (fabs(score - box.score) <= 1e-9) && (box.gap >= 0.) 
+        && (best - box.score <= box.gap + TOLERANCE))
+        return 0;
+    std::cerr << argname << " case " << argnumber << " (" << argcase.width << "x" << argcase.height
+              << ", " << argcase.xpos.size() << " points): stopped early with box " 
+              << box.left << " " << box.top << " " << box.right << " " << box.bottom 
+              << " reported " << box.score << ", its score " << score << ", gap " << box.gap 
+              << ", best " << best << std::endl;
+    return 1;
+}
+
+// searches that can stop early (gap, timelimit, iterations): the box has
+// its true score, summed up in double, not a bound (with precision 32, 
+// the bound includes the rounding error of the float images), and the 
+// gap bounds how far that is from the best one.
+// A search that didn't stop early must have found the best box, gap 0.
+// With argmuststop, at least one search has to stop early: the options 
+// don't depend on the clock.
+static int check_anytime(const char* argname, const char** argoptions, int argnumcases, 
+                         bool argmuststop) {
+    AnytimeCheck anytime = { 0 };
+    int numfailed = run_cases(argname, argoptions, argnumcases, 40, 300, anytime_check, &anytime);
+    if (argmuststop && (anytime.numstopped == 0)) {
+        std::cerr << argname << ": no search stopped early" << std::endl;
+        numfailed++;
+    }
+    return numfailed;
+}
+
+static int heap_check(const char* argname, int argnumber, ESSContext* /*ctx*/, 
+                      CheckCase &argcase, ESSRandom& /*rng*/, void* /*argdata*/) {
+    ESSContext* fresh = ess_create();
+    ESSStats stats[2];
+    for (int r=0; r < 2; r++) {
+        search_case(fresh, argcase);
+        ess_get_stats(fresh, &stats[r]);
+    }
+    ess_destroy(fresh);
+    if ((stats[0].heap_growths >= 1) && (stats[1].heap_growths == 0))
+        return 0;
+    std::cerr << argname << " case " << argnumber << ": heap grew " << stats[0].heap_growths
+              << " times, then " << stats[1].heap_growths << " times" << std::endl;
+    return 1;
+}
+
+// the heap keeps its memory: a fresh context has to grow it, the same 
+// search again must not
+static int check_heap_growths(const char* argname, int argnumcases) {
+    const char* plain[] = { NULL };
+    return run_cases(argname, plain, argnumcases, 40, 300, heap_check, NULL);
+}
+
+static int sequence_check(const char* argname, int argnumber, ESSContext* ctx, 
+                          CheckCase &argcase, ESSRandom &rng, void* argdata) {
+    const int numframes = *reinterpret_cast<int*>(argdata);
+    ESSModel* model = ess_model_create(argcase.numclusters, 1, &argcase.weights[0]);
+    ess_sequence_reset(ctx);
+    int numfailed = 0;
+    for (int f=0; f < numframes; f++) {
+        CheckCase frame;
+        make_frame(frame, argcase, rng);
+        const Box box = ess_search_sequence(ctx, model, frame.xpos.size(), frame.width, frame.height,
+                                            data_of(frame.xpos), data_of(frame.ypos), data_of(frame.clst));
+        if (!check_box(argname, argnumber*numframes+f, frame, box, brute_force(frame)))
+            numfailed++;
+    }
+    ess_model_destroy(model);
+    return numfailed;
+}
+
+// every frame of a sequence against the brute force result of that frame.
+// Frames are random images of the same size with the same model.
+static int check_sequence(const char* argname, int argnumsequences, int argnumframes) {
+    const char* plain[] = { NULL };
+    return run_cases(argname, plain, argnumsequences, 12, 30, sequence_check, &argnumframes);
+}
+
+static int topk_check(const char* argname, int argnumber, ESSContext* ctx, 
+                      CheckCase &argcase, ESSRandom& /*rng*/, void* argdata) {
+    const int maxresults = *reinterpret_cast<int*>(argdata);
+    std::vector<Box> boxes(maxresults);
+    const int numfound = ess_search_topk(ctx, argcase.xpos.size(), argcase.width, argcase.height,
+                                         data_of(argcase.xpos), data_of(argcase.ypos), data_of(argcase.clst),
+                                         argcase.numclusters, 1, &argcase.weights[0],
+                                         maxresults, &boxes[0]);
+    for (int r=0; r < numfound; r++) {
+        if (!check_box(argname, argnumber*maxresults+r, argcase, boxes[r], brute_force(argcase)))
+            return 1;
+        unsigned int numkept = 0;
+        for (unsigned int k=0; k < argcase.xpos.size(); k++) {
+            if ((argcase.xpos[k] >= boxes[r].left) && (argcase.xpos[k] <= boxes[r].right)
+                && (argcase.ypos[k] >= boxes[r].top) && (argcase.ypos[k] <= boxes[r].bottom))
+                continue;
+            argcase.xpos[numkept] = argcase.xpos[k];
+            argcase.ypos[numkept] = argcase.ypos[k];
+            argcase.clst[numkept] = argcase.clst[k];
+            numkept++;
+        }
+        argcase.xpos.resize(numkept);
+        argcase.ypos.resize(numkept);
+        argcase.clst.resize(numkept);
+    }
+    return 0;
+}
+
+// ess_search_topk(): each result is the best box of the points that the
+// results before it have left, and empty boxes score 0. The points of
+// each result are removed from the case for the next one.
+static int check_topk(const char* argname, const char** argoptions, int argnumcases, int argmaxresults) {
+    return run_cases(argname, argoptions, argnumcases, 12, 60, topk_check, &argmaxresults);
+}
+
+// intersection over union of two boxes, in pixels
+static double box_overlap(const Box &a, const Box &b) {
+    const double areaa = (a.right-a.left+1.)*(a.bottom-a.top+1.);
+    const double areab = (b.right-b.left+1.)*(b.bottom-b.top+1.);
+    const double width = std::min(a.right, b.right) - std::max(a.left, b.left) + 1.;
+    const double height = std::min(a.bottom, b.bottom) - std::max(a.top, b.top) + 1.;
+    if ((width <= 0.) || (height <= 0.))
+        return 0.;
+    return width*height/(areaa + areab - width*height);
+}
+
+static int subvolume_check(const char* argname, int argnumber, ESSContext* ctx, 
+                           CheckCase &argcase, ESSRandom &rng, void* argdata) {
+    const int numframes = 1 + rng.uniform(*reinterpret_cast<int*>(argdata));
+    std::vector<CheckCase> frames(numframes, argcase);
+    for (int f=1; f < numframes; f++)
+        make_frame(frames[f], frames[0], rng);
+    std::vector<int> numpoints(numframes);
+    std::vector<double*> xpos(numframes), ypos(numframes), clst(numframes);
+    for (int f=0; f < numframes; f++) {
+        numpoints[f] = frames[f].xpos.size();
+        xpos[f] = data_of(frames[f].xpos);
+        ypos[f] = data_of(frames[f].ypos);
+        clst[f] = data_of(frames[f].clst);
+    }
+
+    // the points of frames first..last as one image
+    std::vector<CheckCase> ranges(numframes*numframes);
+    double best = -1e300;
+    for (int first=0; first < numframes; first++) {
+        for (int last=first; last < numframes; last++) {
+            CheckCase &range = ranges[first*numframes+last];
+            range = frames[first];
+            for (int f=first+1; f <= last; f++) {
+                range.xpos.insert(range.xpos.end(), frames[f].xpos.begin(), frames[f].xpos.end());
+                range.ypos.insert(range.ypos.end(), frames[f].ypos.begin(), frames[f].ypos.end());
+                range.clst.insert(range.clst.end(), frames[f].clst.begin(), frames[f].clst.end());
+            }
+            best = std::max(best, brute_force(range));
+        }
+    }
+
+    ESSModel* model = ess_model_create(argcase.numclusters, 1, &argcase.weights[0]);
+    int first = -1, last = -1;
+    const Box box = ess_search_subvolume(ctx, model, numframes, &numpoints[0], argcase.width,
+                                         argcase.height, &xpos[0], &ypos[0], &clst[0], &first, &last);
+    int numfailed = 0;
+    if ((first < 0) || (first > last) || (last >= numframes)) {
+        std::cerr << argname << " case " << argnumber << ": frames " << first << ".." << last 
+                  << " of " << numframes << std::endl;
+        numfailed++;
+    }
+    else {
+        CheckCase &range = ranges[first*numframes+last];
+        if (!check_box(argname, argnumber, range, box, best) 
+            || !check_box(argname, argnumber, range, search_case(ctx, range), best))
+            numfailed++;
+    }
+
+    // no frames: an empty box, no range
+    const Box none = ess_search_subvolume(ctx, model, 0, &numpoints[0], argcase.width,
+                                          argcase.height, &xpos[0], &ypos[0], &clst[0], &first, &last);
+    if ((first != -1) || (last != -1) || (none.score != -std::numeric_limits<double>::max())) {
+        std::cerr << argname << " case " << argnumber << ": 0 frames give frames " << first << ".." 
+                  << last << ", score " << none.score << std::endl;
+        numfailed++;
+    }
+    ess_model_destroy(model);
+    return numfailed;
+}
+
+// ess_search_subvolume() on windows of up to argmaxframes frames: the 
+// best score of all ranges of frames, brute force on each range, must be
+// that of the box on the range it reports, and ess_search_model() on the
+// points of that range must find the same score
+static int check_subvolume(const char* argname, const char** argoptions, int argnumcases, 
+                           int argmaxframes) {
+    return run_cases(argname, argoptions, argnumcases, 10, 20, subvolume_check, &argmaxframes);
+}
+
+static int overlap_check(const char* argname, int argnumber, ESSContext* ctx, 
+                         CheckCase &argcase, ESSRandom& /*rng*/, void* argdata) {
+    const int maxresults = reinterpret_cast<int*>(argdata)[0];
+    const int overlap = reinterpret_cast<int*>(argdata)[1];
+    const double maxoverlap = 0.01*overlap;
+    ess_set_option(ctx, "overlap", overlap);
+    std::vector<Box> boxes;
+    for (int left=0; left < argcase.width; left++)
+        for (int right=left; right < argcase.width; right++)
+            for (int top=0; top < argcase.height; top++)
+                for (int bottom=top; bottom < argcase.height; bottom++) {
+                    Box box;
+                    box.left = left;
+                    box.top = top;
+                    box.right = right;
+                    box.bottom = bottom;
+                    box.score = box_score(argcase, box);
+                    boxes.push_back(box);
+                }
+    std::vector<Box> results(maxresults);
+    const int numfound = ess_search_topk(ctx, argcase.xpos.size(), argcase.width, argcase.height,
+                                         data_of(argcase.xpos), data_of(argcase.ypos), data_of(argcase.clst),
+                                         argcase.numclusters, 1, &argcase.weights[0],
+                                         maxresults, &results[0]);
+    for (int r=0; r <= std::min(numfound, maxresults-1); r++) {
+        // best box left after the first r results, -1 if none is left
+        int best = -1;
+        for (unsigned int i=0; i < boxes.size(); i++) {
+            bool allowed = true;
+            for (int j=0; (j < r) && allowed; j++)
+                allowed = (box_overlap(boxes[i], results[j]) <= maxoverlap);
+            if (allowed && ((best < 0) || (boxes[i].score > boxes[best].score)))
+                best = i;
+        }
+        if (r == numfound) {
+            if (best < 0)
+                return 0;
+            std::cerr << argname << " case " << argnumber << ": " << numfound << " results, but box "
+                      << boxes[best].left << " " << boxes[best].top << " " << boxes[best].right
+                      << " " << boxes[best].bottom << " with score " << boxes[best].score
+                      << " is left" << std::endl;
+            return 1;
+        }
+        bool allowed = true;
+        for (int j=0; (j < r) && allowed; j++)
+            allowed = (box_overlap(results[r], results[j]) <= maxoverlap);
+        if (!allowed)
+            std::cerr << argname << " case " << argnumber << ": result " << r 
+                      << " overlaps an earlier one" << std::endl;
+        if (!allowed || (best < 0)
+            || !check_box(argname, argnumber*maxresults+r, argcase, results[r], boxes[best].score))
+            return 1;
+    }
+    return 0;
+}
+
+// top-k with overlap suppression of argoverlap percent: result r must be
+// the best of all boxes that overlap none of the results before it by 
+// more than that. Ties may pick any of the best boxes, so the ranking is
+// checked against the results actually returned.
+static int check_overlap(const char* argname, const char** argoptions, int argnumcases, 
+                         int argmaxresults, int argoverlap) {
+    int parameters[] = { argmaxresults, argoverlap };
+    return run_cases(argname, argoptions, argnumcases, 10, 40, overlap_check, parameters);
+}
+
+static int batch_check(const char* argname, int argnumber, ESSContext* /*ctx*/, 
+                       CheckCase &argcase, ESSRandom &rng, void* argdata) {
+    const int numimages = reinterpret_cast<int*>(argdata)[0];
+    const int numthreads = reinterpret_cast<int*>(argdata)[1];
+    std::vector<CheckCase> images(numimages);
+    std::vector<int> numpoints(numimages), width(numimages), height(numimages);
+    std::vector<double*> xpos(numimages), ypos(numimages), clst(numimages);
+    for (int i=0; i < numimages; i++) {
+        CheckCase size = argcase;      // the images have different sizes
+        size.width = 1 + rng.uniform(12);
+        size.height = 1 + rng.uniform(12);
+        make_frame(images[i], size, rng);
+        numpoints[i] = images[i].xpos.size();
+        width[i] = images[i].width;
+        height[i] = images[i].height;
+        xpos[i] = data_of(images[i].xpos);
+        ypos[i] = data_of(images[i].ypos);
+        clst[i] = data_of(images[i].clst);
+    }
+    std::vector<Box> boxes(numimages);
+    pyramid_search_batch(numimages, &numpoints[0], &width[0], &height[0], &xpos[0], &ypos[0], &clst[0], 
+                         argcase.numclusters, 1, &argcase.weights[0], numthreads, &boxes[0]);
+    int numfailed = 0;
+    for (int i=0; i < numimages; i++) {
+        if (!check_box(argname, argnumber*numimages+i, images[i], boxes[i], brute_force(images[i])))
+            numfailed++;
+    }
+
+    // invalid arguments are rejected before anything is searched
+    const int invalid[][3] = { { -1, argcase.numclusters, 1 }, { numimages, 0, 1 }, 
+                               { numimages, argcase.numclusters, 0 } };
+    for (int i=0; i < 3; i++) {
+        if (pyramid_search_batch(invalid[i][0], &numpoints[0], &width[0], &height[0], 
+                                 &xpos[0], &ypos[0], &clst[0], invalid[i][1], invalid[i][2], 
+                                 &argcase.weights[0], numthreads, &boxes[0]) != -1) {
+            std::cerr << argname << " batch " << argnumber << ": invalid arguments " << invalid[i][0] 
+                      << " images, " << invalid[i][1] << " clusters, " << invalid[i][2] 
+                      << " levels accepted" << std::endl;
+            numfailed++;
+        }
+    }
+    return numfailed;
+}
+
+// pyramid_search_batch() on argnumimages images of random sizes that
+// share one model, every result against the brute force one of its image
+static int check_batch(const char* argname, int argnumbatches, int argnumimages, int argnumthreads) {
+    const char* plain[] = { NULL };
+    int parameters[] = { argnumimages, argnumthreads };
+    return run_cases(argname, plain, argnumbatches, 12, 30, batch_check, parameters);
+}
+
+static int legacy_check(const char* argname, int argnumber, ESSContext* ctx, 
+                        CheckCase &argcase, ESSRandom &rng, void* /*argdata*/) {
+    const int numlevels = 1 + rng.uniform(3);
+    const int numcells = numlevels*(numlevels+1)*(2*numlevels+1)/6;
+    std::vector<double> weights(numcells*argcase.numclusters);
+    for (int i=0; i < numcells; i++) {
+        for (int c=0; c < argcase.numclusters; c++)
+            weights[i*argcase.numclusters+c] = (i % 3 == 2) ? weights[c] 
+                                                            : (rng.uniform(2001) - 1000) / 1000.;
+    }
+    ESSModel* model = ess_model_create(argcase.numclusters, numlevels, &weights[0]);
+    const Box expected = ess_search_model(ctx, model, argcase.xpos.size(), argcase.width, argcase.height,
+                                          data_of(argcase.xpos), data_of(argcase.ypos), data_of(argcase.clst));
+    ess_model_destroy(model);
+    const Box box = ess_search(ctx, argcase.xpos.size(), argcase.width, argcase.height,
+                               data_of(argcase.xpos), data_of(argcase.ypos), data_of(argcase.clst),
+                               argcase.numclusters, numlevels, &weights[0]);
+    if (fabs(box.score - expected.score) <= TOLERANCE)
+        return 0;
+    std::cerr << argname << " case " << argnumber << " (" << argcase.width << "x" << argcase.height
+              << ", " << numlevels << " levels): score " << box.score 
+              << ", with a model " << expected.score << std::endl;
+    return 1;
+}
+
+// ess_search() with the weights against ess_search_model() with a 
+// compiled one, on pyramids of 1 to 3 levels. Some cells have the same
+// weights, which a compiled model shares and ess_search() doesn't.
+static int check_legacy(const char* argname, const char** argoptions, int argnumcases) {
+    return run_cases(argname, argoptions, argnumcases, 20, 100, legacy_check, NULL);
+}
+
+static int interleaved_check(const char* argname, int argnumber, ESSContext* /*ctx*/, 
+                             CheckCase &argcase, ESSRandom &rng, void* argdata) {
+    const int numstates = *reinterpret_cast<int*>(argdata);
+    const int numlevels = 1 + rng.uniform(4);
+    std::vector<Cell> cells;
+    make_pyramid_cells(numlevels, cells);
+    std::vector<double> weights(cells.size()*argcase.numclusters);
+    for (unsigned int i=0; i < weights.size(); i++)
+        weights[i] = (rng.uniform(2001) - 1000) / 1000.;
+    PyramidModel model;
+    model.build(argcase.numclusters, numlevels, &weights[0]);
+
+    const int w = argcase.width+1;     // padded, like the search does
+    const int h = argcase.height+1;
+    PyramidQualityFunction reference;
+    InterleavedPyramidQualityFunction interleaved;
+    reference.setup(argcase.xpos.size(), w, h, data_of(argcase.xpos), data_of(argcase.ypos),
+                    data_of(argcase.clst), &model);
+    interleaved.setup(argcase.xpos.size(), w, h, data_of(argcase.xpos), data_of(argcase.ypos),
+                      data_of(argcase.clst), &model);
+    for (int k=0; k < numstates; k++) {
+        sstate state(w, h);     // random intervals below
+        for (int i=0; i < 4; i++) {
+            const int size = (i % 2 == 0) ? w-1 : h-1;
+            const int a = 1 + rng.uniform(size);
+            const int b = 1 + rng.uniform(size);
+            state.low[i] = std::min(a, b);
+            state.high[i] = std::max(a, b);
+        }
+        const double expected = reference.upper_bound(&state);
+        const double bound = interleaved.upper_bound(&state);
+        if (fabs(bound - expected) > TOLERANCE) {
+            std::cerr << argname << " case " << argnumber << " (" << argcase.width << "x" << argcase.height
+                      << ", " << numlevels << " levels): " << state.tostring()
+                      << " bound " << bound << ", reference " << expected << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// bounds of the interleaved pyramid (AVX2 if compiled in) against the 
+// reference PyramidQualityFunction on random states of random images. 
+// Both truncate the same cell corners to pixels, so they must agree.
+static int check_interleaved(const char* argname, int argnumcases, int argnumstates) {
+    const char* plain[] = { NULL };
+    return run_cases(argname, plain, argnumcases, 60, 300, interleaved_check, &argnumstates);
+}
+
+static int large_check(const char* argname, int argnumber, ESSContext* ctx, 
+                       CheckCase &argcase, ESSRandom& /*rng*/, void* /*argdata*/) {
+    static const int tilesizes[] = { 2, 3, 5, 64 };
+    ess_set_option(ctx, "tilesize", tilesizes[argnumber % 4]);
+    ESSModel* model = ess_model_create(argcase.numclusters, 1, &argcase.weights[0]);
+    Box box;
+    ess_search_large(ctx, model, argcase.xpos.size(), argcase.width, argcase.height,
+                     data_of(argcase.xpos), data_of(argcase.ypos), data_of(argcase.clst), &box);
+    ess_model_destroy(model);
+    return check_box(argname, argnumber, argcase, box, brute_force(argcase)) ? 0 : 1;
+}
+
+// ess_search_large() with small tiles, so the images have many of them
+static int check_large(const char* argname, int argnumcases) {
+    const char* plain[] = { NULL };
+    return run_cases(argname, plain, argnumcases, 30, 220, large_check, NULL);
+}
+
+// an SVM with an additive kernel, see check_kernel()
+typedef struct {
+    int kernel;
+    std::vector<double> vectors;    // numclusters counts per support vector
+    std::vector<double> alpha;
+    double bias;
+} KernelCheck;
+
+// score of a box for an SVM with an additive kernel, straight from the
+// definition: bias + sum_i alpha_i sum_c k(h_c, x_ic) on the counts h
+static double kernel_score(const CheckCase &argcase, const KernelCheck &svm, const Box &box) {
+    std::vector<double> counts(argcase.numclusters, 0.);
+    for (unsigned int k=0; k < argcase.xpos.size(); k++) {
+        if ((argcase.xpos[k] >= box.left) && (argcase.xpos[k] <= box.right)
+            && (argcase.ypos[k] >= box.top) && (argcase.ypos[k] <= box.bottom))
+            counts[static_cast<int>(argcase.clst[k])] += 1.;
+    }
+    double score = svm.bias;
+    for (unsigned int i=0; i < svm.alpha.size(); i++) {
+        for (int c=0; c < argcase.numclusters; c++) {
+            const double h = counts[c];
+            const double x = svm.vectors[i*argcase.numclusters+c];
+            if (svm.kernel == ESS_KERNEL_INTERSECTION)
+                score += svm.alpha[i]*std::min(h, x);
+            else if (h+x > 0.)
+                score += svm.alpha[i]*2.*h*x/(h+x);
+        }
+    }
+    return score;
+}
+
+static int kernel_check(const char* argname, int argnumber, ESSContext* ctx, 
+                        CheckCase &argcase, ESSRandom &rng, void* argdata) {
+    static const double alphas[] = { 1., 0.5, 0.25, -0.25, -0.5, -1. };
+    KernelCheck svm;
+    svm.kernel = *reinterpret_cast<int*>(argdata);
+    const int numvectors = 1 + rng.uniform(5);
+    svm.vectors.resize(numvectors*argcase.numclusters);
+    svm.alpha.resize(numvectors);
+    for (unsigned int v=0; v < svm.vectors.size(); v++)
+        svm.vectors[v] = 0.5*rng.uniform(rng.uniform(2) ? 10 : 200);
+    for (int i=0; i < numvectors; i++)
+        svm.alpha[i] = alphas[rng.uniform(6)];
+    svm.bias = alphas[rng.uniform(6)];
+    ESSModel* model = ess_kernel_model_create(svm.kernel, argcase.numclusters, numvectors,
+                                              &svm.vectors[0], &svm.alpha[0], svm.bias);
+    if (model == NULL) {
+        std::cerr << argname << " case " << argnumber << ": model rejected" << std::endl;
+        return 1;
+    }
+    const Box box = ess_search_model(ctx, model, argcase.xpos.size(), argcase.width, argcase.height,
+                                     data_of(argcase.xpos), data_of(argcase.ypos), data_of(argcase.clst));
+    ess_model_destroy(model);
+
+    int numfailed = 0;
+    double best = -1e300;
+    Box other;
+    for (other.left=0; other.left < argcase.width; other.left++)
+        for (other.right=other.left; other.right < argcase.width; other.right++)
+            for (other.top=0; other.top < argcase.height; other.top++)
+                for (other.bottom=other.top; other.bottom < argcase.height; other.bottom++)
+                    best = std::max(best, kernel_score(argcase, svm, other));
+    const bool inside = box_inside(argcase, box);
+    const double score = inside ? kernel_score(argcase, svm, box) : 0.;
+    if (!inside || (fabs(score - best) > TOLERANCE) || (fabs(box.score - best) > TOLERANCE)) {
+        std::cerr << argname << " case " << argnumber << " (" << argcase.width << "x" << argcase.height
+                  << ", " << argcase.xpos.size() << " points): box " << box.left << " " << box.top
+                  << " " << box.right << " " << box.bottom << " reported " << box.score
+                  << ", its score " << score << ", best " << best << std::endl;
+        numfailed++;
+    }
+
+    // one value that is not finite
+    const double bad = (argnumber % 2) ? std::numeric_limits<double>::quiet_NaN()
+                                       : std::numeric_limits<double>::infinity();
+    const int where = rng.uniform(3);
+    KernelCheck badsvm = svm;
+    if (where == 0)
+        badsvm.vectors[rng.uniform(badsvm.vectors.size())] = bad;
+    else if (where == 1)
+        badsvm.alpha[rng.uniform(numvectors)] = bad;
+    else
+        badsvm.bias = bad;
+    model = ess_kernel_model_create(svm.kernel, argcase.numclusters, numvectors,
+                                    &badsvm.vectors[0], &badsvm.alpha[0], badsvm.bias);
+    if (model != NULL) {
+        std::cerr << argname << " case " << argnumber << ": model with " << bad << " accepted" << std::endl;
+        ess_model_destroy(model);
+        numfailed++;
+    }
+    return numfailed;
+}
+
+// ess_search_model() with kernel models against the best of all boxes.
+// Some images have more points per cluster than the tables of the model
+// hold. Models with a value that is NaN or infinite must be rejected.
+static int check_kernel(const char* argname, int argkernel, const char** argoptions, int argnumcases) {
+    return run_cases(argname, argoptions, argnumcases, 10, 150, kernel_check, &argkernel);
+}
+
+int main() {
+    const char* plain[] = { NULL };
+    const char* prune[] = { "prune", "1", NULL };
+    const char* prune_threads[] = { "prune", "1", "numthreads", "3", NULL };
+    const char* compress[] = { "compress", "1", NULL };
+    const char* compress_prune[] = { "compress", "1", "prune", "1", NULL };
+    const char* coarse2[] = { "coarse", "2", NULL };
+    const char* coarse4_prune[] = { "coarse", "4", "prune", "1", NULL };
+    const char* precision32[] = { "precision", "32", NULL };
+    const char* interleaved[] = { "interleaved", "1", NULL };
+    const char* split4[] = { "split", "4", NULL };
+    const char* split8_prune[] = { "split", "8", "prune", "1", NULL };
+    const char* split16_threads[] = { "split", "16", "numthreads", "3", NULL };
+    const char* gap[] = { "gap", "100000", NULL };
+    const char* gap_threads[] = { "gap", "300000", "numthreads", "3", NULL };
+    const char* timelimit[] = { "timelimit", "1", "prune", "1", NULL };
+    const char* iterations[] = { "iterations", "30", NULL };
+    const char* gap_precision32[] = { "gap", "100000", "precision", "32", NULL };
+    const char* iterations_precision32[] = { "iterations", "30", "precision", "32", NULL };
+    const char* prune_precision32[] = { "iterations", "30", "prune", "1", "precision", "32", 
+                                        "numthreads", "3", NULL };
+
+    int numfailed = 0;
+    numfailed += check_search("default", plain, 300);
+    numfailed += check_search("prune", prune, 300);
+    numfailed += check_search("prune+threads", prune_threads, 100);
+    numfailed += check_search("compress", compress, 300);
+    numfailed += check_search("compress+prune", compress_prune, 300);
+    numfailed += check_search("coarse=2", coarse2, 300);
+    numfailed += check_search("coarse=4+prune", coarse4_prune, 300);
+    numfailed += check_search("split=4", split4, 300);
+    numfailed += check_search("split=8+prune", split8_prune, 300);
+    numfailed += check_search("split=16+threads", split16_threads, 100);
+    numfailed += check_legacy("legacy+split=8", split8_prune, 100);
+    numfailed += check_anytime("gap", gap, 200, true);
+    numfailed += check_anytime("gap+threads", gap_threads, 100, true);
+    numfailed += check_anytime("timelimit", timelimit, 100, false);
+    numfailed += check_anytime("iterations", iterations, 200, true);
+    numfailed += check_anytime("gap+precision=32", gap_precision32, 200, true);
+    numfailed += check_anytime("iterations+precision=32", iterations_precision32, 200, true);
+    numfailed += check_anytime("iterations+prune+precision=32+threads", prune_precision32, 100, true);
+    numfailed += check_legacy("legacy", plain, 200);
+    numfailed += check_legacy("legacy+interleaved", interleaved, 100);
+    numfailed += check_legacy("legacy+precision=32", precision32, 100);
+    numfailed += check_topk("topk", plain, 100, 12);
+    numfailed += check_topk("topk+precision=32", precision32, 100, 12);
+    numfailed += check_subvolume("subvolume", plain, 100, 4);
+    numfailed += check_subvolume("subvolume+compress+prune", compress_prune, 50, 3);
+    numfailed += check_multiclass("multiclass", plain, 100, 4, false);
+    numfailed += check_multiclass("multiclass+prune+threads", prune_threads, 50, 3, false);
+    numfailed += check_multiclass("multiclass+bestonly", plain, 200, 4, true);
+    numfailed += check_multiclass("multiclass+bestonly+compress", compress, 100, 5, true);
+    numfailed += check_overlap("topk+overlap=30", plain, 100, 8, 30);
+    numfailed += check_overlap("topk+overlap=50+prune", prune, 100, 8, 50);
+    numfailed += check_overlap("topk+overlap=10+threads", prune_threads, 50, 8, 10);
+    numfailed += check_interleaved("interleaved", 100, 1000);
+    numfailed += check_heap_growths("heap growths", 20);
+    numfailed += check_batch("batch", 20, 16, 4);
+    numfailed += check_batch("batch+threads=-1", 5, 4, -1);
+    numfailed += check_sequence("sequence", 40, 8);
+    numfailed += check_large("large", 400);
+    numfailed += check_kernel("intersection", ESS_KERNEL_INTERSECTION, plain, 200);
+    numfailed += check_kernel("intersection+prune", ESS_KERNEL_INTERSECTION, prune, 100);
+    numfailed += check_kernel("chi2", ESS_KERNEL_CHI2, plain, 200);
+    numfailed += check_kernel("chi2+prune+threads", ESS_KERNEL_CHI2, prune_threads, 100);
+
+    if (numfailed > 0) {
+        std::cerr << numfailed << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "all checks passed" << std::endl;
+    return 0;
+}
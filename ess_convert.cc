@@ -0,0 +1,89 @@
+/********************************************************
+ *                                                      *
+ *  Efficient Subwindow Search (ESS) implemented in C++ *
+ *  converter from ASCII feature and weight files to    *
+ *  the binary format of ess_data.hh                    *
+ *                                                      *
+ *   Copyright 2006-2008 Christoph Lampert              *
+ *   Contact: <mail@christoph-lampert.org>              *
+ *                                                      *
+ *  Licensed under the Apache License, Version 2.0 (the *
+ *  "License"); you may not use this file except in     *
+ *  compliance with the License. You may obtain a copy  *
+ *  of the License at                                   *
+ *                                                      *
+ *     http://www.apache.org/licenses/LICENSE-2.0       *
+ *                                                      *
+ *  Unless required by applicable law or agreed to in   *
+ *  writing, software distributed under the License is  *
+ *  distributed on an "AS IS" BASIS, WITHOUT WARRANTIES *
+ *  OR CONDITIONS OF ANY KIND, either express or        *
+ *  implied. See the License for the specific language  *
+ *  governing permissions and limitations under the     *
+ *  License.                                            *
+ *                                                      *
+ ********************************************************/
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <limits>
+
+#include "ess_data.hh"
+
+static void usage(char *progname) {
+    std::cerr << "usage: " << progname << " points|weights|weights32 ascii-file binary-file\n";
+    std::cerr << "  points    : 3 columns x,y,clusterID (e.g. .clst files)\n";
+    std::cerr << "  weights   : 1 column of weights as double (e.g. .weight files)\n";
+    std::cerr << "  weights32 : 1 column of weights as float\n";
+    exit(1);
+}
+
+// smallest integer type that holds all values of the column exactly,
+// or ESS_FLOAT64 if some value is not an integer
+static unsigned int integer_type(const std::vector<double> &column) {
+    unsigned int type = ESS_INT16;
+    for (unsigned long k=0; k < column.size(); k++) {
+        const double value = column[k];
+        if ((value != static_cast<double>(static_cast<long>(value)))
+            || (value < std::numeric_limits<int>::min()) || (value > std::numeric_limits<int>::max()))
+            return ESS_FLOAT64;
+        if ((value < std::numeric_limits<short>::min()) || (value > std::numeric_limits<short>::max()))
+            type = ESS_INT32;
+    }
+    return type;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 4)
+        usage(argv[0]);
+
+    std::vector< std::vector<double> > columns;
+    std::vector<unsigned int> types;
+    if (strcmp(argv[1], "points") == 0) {
+        columns.resize(3);
+        if (read_ascii_datafile(argv[2], columns) < 0) {
+            std::cerr << "Error reading data from file " << argv[2] << std::endl;
+            return 1;
+        }
+        types.push_back(integer_type(columns[0]));
+        types.push_back(integer_type(columns[1]));
+        types.push_back(integer_type(columns[2]) == ESS_FLOAT64 ? ESS_FLOAT64 : ESS_INT32);
+    } else if ((strcmp(argv[1], "weights") == 0) || (strcmp(argv[1], "weights32") == 0)) {
+        columns.resize(1);
+        if (read_ascii_datafile(argv[2], columns) < 0) {
+            std::cerr << "Error reading data from file " << argv[2] << std::endl;
+            return 1;
+        }
+        types.push_back((strcmp(argv[1], "weights32") == 0) ? ESS_FLOAT32 : ESS_FLOAT64);
+    } else {
+        usage(argv[0]);
+    }
+
+    if (!write_ess_datafile(argv[3], columns, types)) {
+        std::cerr << "Error writing file " << argv[3] << std::endl;
+        return 1;
+    }
+    return 0;
+}
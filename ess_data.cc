@@ -0,0 +1,250 @@
+/********************************************************
+ *                                                      *
+ *  Efficient Subwindow Search (ESS) implemented in C++ *
+ *  binary data files: typed columns behind a small     *
+ *  header, read through mmap without parsing           *
+ *                                                      *
+ *   Copyright 2006-2008 Christoph Lampert              *
+ *   Contact: <mail@christoph-lampert.org>              *
+ *                                                      *
+ *  Licensed under the Apache License, Version 2.0 (the *
+ *  "License"); you may not use this file except in     *
+ *  compliance with the License. You may obtain a copy  *
+ *  of the License at                                   *
+ *                                                      *
+ *     http://www.apache.org/licenses/LICENSE-2.0       *
+ *                                                      *
+ *  Unless required by applicable law or agreed to in   *
+ *  writing, software distributed under the License is  *
+ *  distributed on an "AS IS" BASIS, WITHOUT WARRANTIES *
+ *  OR CONDITIONS OF ANY KIND, either express or        *
+ *  implied. See the License for the specific language  *
+ *  governing permissions and limitations under the     *
+ *  License.                                            *
+ *                                                      *
+ ********************************************************/
+
+#include <cstring>
+#include <fstream>
+#include <vector>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ess_data.hh"
+
+static const char ess_magic[4] = { 'E', 'S', 'S', 'B' };
+static const uint32_t ess_version = 1;
+
+// size of the fixed part of the header
+static const unsigned long ess_header_size = 4 + 3*sizeof(uint32_t) + sizeof(uint64_t);
+
+unsigned int ess_type_size(unsigned int argtype) {
+    switch (argtype) {
+        case ESS_INT16:   return sizeof(int16_t);
+        case ESS_INT32:   return sizeof(int32_t);
+        case ESS_FLOAT32: return sizeof(float);
+        case ESS_FLOAT64: return sizeof(double);
+    }
+    return 0;
+}
+
+// round up to a multiple of 8 bytes, so every column is aligned for doubles
+static unsigned long align8(unsigned long argsize) {
+    return (argsize+7) & ~7UL;
+}
+
+unsigned long ess_data_offset(unsigned int argnumcolumns) {
+    return align8(ess_header_size + argnumcolumns*sizeof(uint32_t));
+}
+
+int read_ascii_datafile(const char* filename, std::vector< std::vector<double> > &data) {
+
+    const unsigned int numcolumns=data.size();
+
+// start with empty vectors
+    for (unsigned int i=0;i<numcolumns;i++) {
+        data[i].clear();
+    }
+
+    std::ifstream infile(filename);
+    if (!infile)
+        return -1;
+
+    while (! infile.eof() ) {
+        for (unsigned int i=0;i<numcolumns;i++) {
+            double tmpval;
+            infile >> tmpval;
+            data[i].push_back(tmpval);
+        }
+    }
+    infile.close();
+
+// usually, eof occurs too late: we have read one extra entry
+    for (unsigned int i=0;i<numcolumns;i++)
+        data[i].pop_back();
+
+// all vector should have same length
+    const int numpts = data[0].size();
+    return numpts;
+}
+
+bool is_ess_datafile(const char* filename) {
+    char magic[4];
+    std::ifstream infile(filename, std::ios::binary);
+    if (!infile.read(magic, 4))
+        return false;
+    return (std::memcmp(magic, ess_magic, 4) == 0);
+}
+
+// convert a column of doubles to the file type and append it to out
+template<typename T>
+static void append_column(const std::vector<double> &column, std::vector<char> &out) {
+    const unsigned long start = out.size();
+    out.resize(start + column.size()*sizeof(T));
+    T* dest = reinterpret_cast<T*>(&out[start]);
+    for (unsigned long k=0; k < column.size(); k++)
+        dest[k] = static_cast<T>(column[k]);
+}
+
+bool write_ess_datafile(const char* filename,
+                        const std::vector< std::vector<double> > &columns,
+                        const std::vector<unsigned int> &types) {
+    const uint32_t numcolumns = columns.size();
+    if ((numcolumns == 0) || (types.size() != numcolumns))
+        return false;
+    const uint64_t numrows = columns[0].size();
+
+    std::vector<char> out(ess_data_offset(numcolumns), 0);
+    std::memcpy(&out[0], ess_magic, 4);
+    std::memcpy(&out[4], &ess_version, sizeof(uint32_t));
+    std::memcpy(&out[8], &numcolumns, sizeof(uint32_t));
+    std::memcpy(&out[16], &numrows, sizeof(uint64_t));
+    for (unsigned int i=0; i < numcolumns; i++) {
+        if ((columns[i].size() != numrows) || (ess_type_size(types[i]) == 0))
+            return false;
+        const uint32_t type = types[i];
+        std::memcpy(&out[ess_header_size + i*sizeof(uint32_t)], &type, sizeof(uint32_t));
+    }
+
+    for (unsigned int i=0; i < numcolumns; i++) {
+        switch (types[i]) {
+            case ESS_INT16:   append_column<int16_t>(columns[i], out); break;
+            case ESS_INT32:   append_column<int32_t>(columns[i], out); break;
+            case ESS_FLOAT32: append_column<float>(columns[i], out); break;
+            case ESS_FLOAT64: append_column<double>(columns[i], out); break;
+        }
+        out.resize(align8(out.size()), 0);
+    }
+
+    std::ofstream outfile(filename, std::ios::binary);
+    if (!outfile)
+        return false;
+    outfile.write(&out[0], out.size());
+    return !outfile.fail();
+}
+
+bool ESSDataFile::open(const char* filename) {
+    close();
+
+    const int fd = ::open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (static_cast<unsigned long>(st.st_size) < ess_header_size)) {
+        ::close(fd);
+        return false;
+    }
+    mapsize = st.st_size;
+    // private and writable: callers get non-const pointers into the mapping,
+    // but nothing is ever written back to the file
+    mapping = mmap(NULL, mapsize, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);    // the mapping stays valid
+    if (mapping == MAP_FAILED) {
+        mapping = 0;
+        return false;
+    }
+
+    const char* data = reinterpret_cast<const char*>(mapping);
+    uint32_t version, numcolumns;
+    uint64_t filerows;
+    std::memcpy(&version, data+4, sizeof(uint32_t));
+    std::memcpy(&numcolumns, data+8, sizeof(uint32_t));
+    std::memcpy(&filerows, data+16, sizeof(uint64_t));
+    if ((std::memcmp(data, ess_magic, 4) != 0) || (version != ess_version)
+        || (ess_data_offset(numcolumns) > mapsize)) {
+        close();
+        return false;
+    }
+
+    // check that every column lies inside the file. numrows comes from
+    // the file, so it is checked before the multiplication can wrap
+    numrows = filerows;
+    unsigned long offset = ess_data_offset(numcolumns);
+    for (unsigned int i=0; i < numcolumns; i++) {
+        uint32_t type;
+        std::memcpy(&type, data + ess_header_size + i*sizeof(uint32_t), sizeof(uint32_t));
+        const unsigned long size = ess_type_size(type);
+        if ((size == 0) || (offset > mapsize) || (filerows > (mapsize - offset) / size)) {
+            close();
+            return false;
+        }
+        const unsigned long colsize = numrows * size;
+        types.push_back(type);
+        offsets.push_back(offset);
+        offset = align8(offset + colsize);
+    }
+    return true;
+}
+
+void ESSDataFile::close() {
+    if (mapping)
+        munmap(mapping, mapsize);
+    mapping = 0;
+    mapsize = 0;
+    numrows = 0;
+    types.clear();
+    offsets.clear();
+}
+
+// convert a column of the file into doubles
+template<typename T>
+static double* convert_column(const void* src, unsigned long numrows, std::vector<double> &buffer) {
+    const T* values = reinterpret_cast<const T*>(src);
+    buffer.resize(numrows);
+    for (unsigned long k=0; k < numrows; k++)
+        buffer[k] = values[k];
+    return buffer.empty() ? NULL : &buffer[0];
+}
+
+double* ESSDataFile::column(unsigned int i, std::vector<double> &buffer) const {
+    char* src = reinterpret_cast<char*>(mapping) + offsets[i];
+    switch (types[i]) {
+        case ESS_INT16:   return convert_column<int16_t>(src, numrows, buffer);
+        case ESS_INT32:   return convert_column<int32_t>(src, numrows, buffer);
+        case ESS_FLOAT32: return convert_column<float>(src, numrows, buffer);
+        case ESS_FLOAT64: return reinterpret_cast<double*>(src);
+    }
+    return NULL;
+}
+
+long read_datafile(const char* filename, ESSDataFile &file,
+                   std::vector< std::vector<double> > &buffers, 
+                   std::vector<double*> &columns) {
+    const unsigned int numcolumns = columns.size();
+    buffers.resize(numcolumns);
+    if (is_ess_datafile(filename)) {
+        if (!file.open(filename) || (file.columns() != numcolumns))
+            return -1;
+        for (unsigned int i=0; i < numcolumns; i++)
+            columns[i] = file.column(i, buffers[i]);
+        return file.rows();
+    }
+
+    const int numrows = read_ascii_datafile(filename, buffers);
+    for (unsigned int i=0; (numrows > 0) && (i < numcolumns); i++)
+        columns[i] = &buffers[i][0];
+    return numrows;
+}
@@ -0,0 +1,108 @@
+/********************************************************
+ *                                                      *
+ *  Efficient Subwindow Search (ESS) implemented in C++ *
+ *  binary data files: typed columns behind a small     *
+ *  header, read through mmap without parsing           *
+ *                                                      *
+ *   Copyright 2006-2008 Christoph Lampert              *
+ *   Contact: <mail@christoph-lampert.org>              *
+ *                                                      *
+ *  Licensed under the Apache License, Version 2.0 (the *
+ *  "License"); you may not use this file except in     *
+ *  compliance with the License. You may obtain a copy  *
+ *  of the License at                                   *
+ *                                                      *
+ *     http://www.apache.org/licenses/LICENSE-2.0       *
+ *                                                      *
+ *  Unless required by applicable law or agreed to in   *
+ *  writing, software distributed under the License is  *
+ *  distributed on an "AS IS" BASIS, WITHOUT WARRANTIES *
+ *  OR CONDITIONS OF ANY KIND, either express or        *
+ *  implied. See the License for the specific language  *
+ *  governing permissions and limitations under the     *
+ *  License.                                            *
+ *                                                      *
+ ********************************************************/
+
+#ifndef _ESS_DATA_H
+#define _ESS_DATA_H
+
+#include <vector>
+
+// File layout, all numbers in native byte order:
+//   char     magic[4]           "ESSB"
+//   uint32   version            1
+//   uint32   numcolumns
+//   uint32   padding            0
+//   uint64   numrows
+//   uint32   type[numcolumns]   one of the ESS_* type codes below
+// followed by the columns one after the other, each starting at a
+// multiple of 8 bytes from the start of the file. A feature file has the
+// columns x, y and cluster id, a weight file a single column of weights.
+enum {
+    ESS_INT16   = 1,
+    ESS_INT32   = 2,
+    ESS_FLOAT32 = 3,
+    ESS_FLOAT64 = 4
+};
+
+// size in bytes of a single entry of the given type, 0 if unknown
+unsigned int ess_type_size(unsigned int argtype);
+
+// offset of the first column: header and type list, padded to 8 bytes
+unsigned long ess_data_offset(unsigned int argnumcolumns);
+
+// read an ASCII file with data.size() columns of numbers into data
+// returns the number of rows, or -1 if the file can't be opened
+int read_ascii_datafile(const char* filename, std::vector< std::vector<double> > &data);
+
+// true if the file starts with the magic of the binary format
+bool is_ess_datafile(const char* filename);
+
+// write columns of doubles in the binary format, converted to the given
+// types. All columns must have the same length. returns false on error
+bool write_ess_datafile(const char* filename,
+                        const std::vector< std::vector<double> > &columns,
+                        const std::vector<unsigned int> &types);
+
+// A binary data file mapped into memory. Columns of doubles are used
+// right from the mapping, all other types are converted once.
+class ESSDataFile {
+  private:
+    void* mapping;
+    unsigned long mapsize;
+    unsigned long numrows;
+    std::vector<unsigned int> types;
+    std::vector<unsigned long> offsets;
+
+    // no copies, the object owns the mapping
+    ESSDataFile(const ESSDataFile&);
+    ESSDataFile& operator=(const ESSDataFile&);
+
+  public:
+    ESSDataFile() : mapping(0), mapsize(0), numrows(0) { }
+    ~ESSDataFile() { close(); }
+
+    // map the file, returns false if it can't be read or isn't valid
+    bool open(const char* filename);
+    void close();
+
+    unsigned long rows() const { return numrows; }
+    unsigned int columns() const { return types.size(); }
+    unsigned int column_type(unsigned int i) const { return types[i]; }
+
+    // pointer to column i as doubles. For ESS_FLOAT64 columns this points
+    // into the mapping, otherwise the column is converted into buffer.
+    // The mapping is private, so writes don't go to the file.
+    double* column(unsigned int i, std::vector<double> &buffer) const;
+};
+
+// read a data file with columns.size() columns, either in the binary 
+// format or as ASCII. Binary double columns point right into the mapped 
+// file, everything else is stored in buffers.
+// returns the number of rows, or -1 on error
+long read_datafile(const char* filename, ESSDataFile &file,
+                   std::vector< std::vector<double> > &buffers, 
+                   std::vector<double*> &columns);
+
+#endif
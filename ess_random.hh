@@ -0,0 +1,50 @@
+/********************************************************
+ *                                                      *
+ *  Efficient Subwindow Search (ESS) implemented in C++ *
+ *  small random generator for synthetic test data      *
+ *                                                      *
+ *   Copyright 2006-2008 Christoph Lampert              *
+ *   Contact: <mail@christoph-lampert.org>              *
+ *                                                      *
+ *  Licensed under the Apache License, Version 2.0 (the *
+ *  "License"); you may not use this file except in     *
+ *  compliance with the License. You may obtain a copy  *
+ *  of the License at                                   *
+ *                                                      *
+ *     http://www.apache.org/licenses/LICENSE-2.0       *
+ *                                                      *
+ *  Unless required by applicable law or agreed to in   *
+ *  writing, software distributed under the License is  *
+ *  distributed on an "AS IS" BASIS, WITHOUT WARRANTIES *
+ *  OR CONDITIONS OF ANY KIND, either express or        *
+ *  implied. See the License for the specific language  *
+ *  governing permissions and limitations under the     *
+ *  License.                                            *
+ *                                                      *
+ ********************************************************/
+
+#ifndef _ESS_RANDOM_H
+#define _ESS_RANDOM_H
+
+// xorshift generator for ess_check and ess_bench: deterministic, so
+// every run sees the same data, on every platform
+class ESSRandom {
+  private:
+    unsigned long long state;
+  public:
+    ESSRandom(unsigned long long seed) : state(seed*2654435761ULL + 88172645463325252ULL) { }
+    unsigned long long next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+    // integer in 0..n-1
+    int uniform(int n) { return static_cast<int>(next() % n); }
+
+    // double in [0,1)
+    double uniform01() { return (next() >> 11) * (1.0/9007199254740992.0); }
+};
+
+#endif
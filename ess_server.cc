@@ -0,0 +1,467 @@
+/********************************************************
+ *                                                      *
+ *  Efficient Subwindow Search (ESS) implemented in C++ *
+ *  server mode: load the models once, then answer a    *
+ *  stream of search requests on worker threads         *
+ *                                                      *
+ *   Copyright 2006-2008 Christoph Lampert              *
+ *   Contact: <mail@christoph-lampert.org>              *
+ *                                                      *
+ *  Licensed under the Apache License, Version 2.0 (the *
+ *  "License"); you may not use this file except in     *
+ *  compliance with the License. You may obtain a copy  *
+ *  of the License at                                   *
+ *                                                      *
+ *     http://www.apache.org/licenses/LICENSE-2.0       *
+ *                                                      *
+ *  Unless required by applicable law or agreed to in   *
+ *  writing, software distributed under the License is  *
+ *  distributed on an "AS IS" BASIS, WITHOUT WARRANTIES *
+ *  OR CONDITIONS OF ANY KIND, either express or        *
+ *  implied. See the License for the specific language  *
+ *  governing permissions and limitations under the     *
+ *  License.                                            *
+ *                                                      *
+ ********************************************************/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <climits>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ess.hh"
+#include "ess_data.hh"
+#include "ess_server.hh"
+
+// the same limit as for the command line: every cell of a model has 
+// integral images of the whole image, and requests are searched untiled
+#define MAXSIDE 8192
+#define MAXPOINTS 10000000     // points of a request sent inline
+#define MAXRESULTS 1000        // boxes of one request
+
+// a weight file, loaded and compiled once for all requests
+typedef struct {
+    ESSModel* model;
+    int numclusters;
+} ServerModel;
+
+// one input stream and the stream its answers go to. It is freed when
+// the input has ended and the last answer is written.
+typedef struct {
+    FILE* in;
+    FILE* out;
+    bool owned;             // close the streams at the end (sockets, not stdio)
+    pthread_mutex_t lock;   // for out and the counters
+    int pending;            // requests read, but not answered yet
+    bool eof;
+} Connection;
+
+// a single search, with its points either read inline or from a data file
+typedef struct {
+    Connection* conn;
+    std::string id;
+    int model;
+    int width, height;
+    int maxresults;
+    ESSDataFile* file;
+    std::vector< std::vector<double> > buffers;
+    std::vector<double*> columns;
+    long numpoints;
+} Request;
+
+typedef struct {
+    std::vector<ServerModel> models;
+    int maxresults;
+    ESSConfigure configure;
+    std::string datadir;    // resolved, with a trailing '/', see data_path()
+    bool anyfile;           // without datadir: clients may read any file
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    std::deque<Request*> queue;
+    unsigned int maxqueue;  // readers wait if this many requests are queued
+    bool closing;           // no more input, workers stop when the queue is empty
+} Server;
+
+typedef struct {
+    Server* server;
+    Connection* conn;
+} ReaderJob;
+
+
+static Connection* new_connection(FILE* in, FILE* out, bool owned) {
+    Connection* conn = new Connection;
+    conn->in = in;
+    conn->out = out;
+    conn->owned = owned;
+    pthread_mutex_init(&conn->lock, NULL);
+    conn->pending = 0;
+    conn->eof = false;
+    return conn;
+}
+
+static void close_connection(Connection* conn) {
+    if (conn->owned) {
+        fclose(conn->in);
+        fclose(conn->out);
+    }
+    pthread_mutex_destroy(&conn->lock);
+    delete conn;
+}
+
+// write an answer line. If done is set, this answers a request that was
+// counted in pending, and the last answer of a finished input closes it.
+static void answer(Connection* conn, const std::string &text, bool done) {
+    pthread_mutex_lock(&conn->lock);
+    fputs(text.c_str(), conn->out);
+    fflush(conn->out);
+    if (done)
+        conn->pending--;
+    const bool finished = conn->eof && (conn->pending == 0);
+    pthread_mutex_unlock(&conn->lock);
+    if (done && finished)
+        close_connection(conn);
+}
+
+static void answer_error(Connection* conn, const std::string &id, const std::string &message) {
+    answer(conn, id + " error " + message + "\n", false);
+}
+
+static void free_models(Server* server) {
+    for (unsigned int m=0; m < server->models.size(); m++)
+        ess_model_destroy(server->models[m].model);
+    server->models.clear();
+}
+
+static bool load_models(Server* server, int argnummodels, char** argmodels, int argnumlevels) {
+    server->models.resize(argnummodels);
+    for (int m=0; m < argnummodels; m++)
+        server->models[m].model = NULL;
+    for (int m=0; m < argnummodels; m++) {
+        ServerModel &model = server->models[m];
+        std::string filename(argmodels[m]);
+        int numlevels = argnumlevels;
+        const std::string::size_type colon = filename.rfind(':');
+        if (colon != std::string::npos) {
+            numlevels = atoi(filename.c_str()+colon+1);
+            filename.erase(colon);
+        }
+
+        // the model keeps its own copy of the weights, the file isn't needed afterwards
+        ESSDataFile file;
+        std::vector< std::vector<double> > buffers;
+        std::vector<double*> columns(1);
+        const long numweights = read_datafile(filename.c_str(), file, buffers, columns);
+        const int numcells = numlevels*(numlevels+1)*(2*numlevels+1)/6;
+        if ((numweights <= 0) || (numlevels < 1) || (numweights % numcells != 0)) {
+            std::cerr << "Error reading model from file " << argmodels[m] << std::endl;
+            return false;
+        }
+        model.numclusters = numweights/numcells;
+        model.model = ess_model_create(model.numclusters, numlevels, columns[0]);
+    }
+    return true;
+}
+
+// the file a request may read for argname, "" if it doesn't exist or 
+// lies outside of the data directory (also through links or "..")
+static std::string data_path(const Server* server, const std::string &argname) {
+    if (server->datadir.empty())
+        return server->anyfile ? argname : "";
+    char resolved[PATH_MAX];
+    if (!realpath((server->datadir + argname).c_str(), resolved))
+        return "";
+    const std::string path(resolved);
+    if (path.compare(0, server->datadir.size(), server->datadir) != 0)
+        return "";
+    return path;
+}
+
+// read the points of a request, returns an error message or "" on success
+static std::string read_points(const Server* server, Request* request,
+                               const std::string &source) {
+    request->columns.resize(3);
+    if (source[0] == '@') {
+        const std::string path = data_path(server, source.substr(1));
+        if (path.empty())
+            return "can't read " + source.substr(1) + " (see datadir)";
+        request->file = new ESSDataFile();
+        request->numpoints = read_datafile(path.c_str(), *request->file,
+                                           request->buffers, request->columns);
+        if (request->numpoints < 0)
+            return "can't read " + source.substr(1);
+    } else {
+        request->numpoints = atol(source.c_str());
+        if ((request->numpoints < 0) || (request->numpoints > MAXPOINTS))
+            return "invalid number of points";
+        request->buffers.assign(3, std::vector<double>(request->numpoints));
+        for (long k=0; k < request->numpoints; k++) {
+            if (fscanf(request->conn->in, "%lf %lf %lf", &request->buffers[0][k],
+                       &request->buffers[1][k], &request->buffers[2][k]) != 3)
+                return "missing points";
+        }
+        for (unsigned int i=0; (request->numpoints > 0) && (i < 3); i++)
+            request->columns[i] = &request->buffers[i][0];
+    }
+
+    // bad input must not crash the server for everybody else. The tests
+    // are negated, so NaN fails them too
+    const ServerModel &model = server->models[request->model];
+    for (long k=0; k < request->numpoints; k++) {
+        const double x = request->columns[0][k];
+        const double y = request->columns[1][k];
+        const double c = request->columns[2][k];
+        if (!((x >= 0) && (x < request->width)) || !((y >= 0) && (y < request->height))
+            || !((c >= 0) && (c < model.numclusters)))
+            return "point outside of image or unknown cluster";
+    }
+    return "";
+}
+
+// skip the inline points of a request that was refused before they were
+// read, so they aren't taken for requests themselves
+static void skip_points(Request* request, const std::string &source) {
+    if (source[0] == '@')
+        return;
+    const long numpoints = std::min<long>(atol(source.c_str()), MAXPOINTS);
+    for (long k=0; k < numpoints; k++) {
+        double x, y, c;
+        if (fscanf(request->conn->in, "%lf %lf %lf", &x, &y, &c) != 3)
+            return;
+    }
+}
+
+// queue a request, waiting while the queue is full
+static void submit(Server* server, Request* request) {
+    pthread_mutex_lock(&request->conn->lock);
+    request->conn->pending++;
+    pthread_mutex_unlock(&request->conn->lock);
+
+    pthread_mutex_lock(&server->lock);
+    while (server->queue.size() >= server->maxqueue)
+        pthread_cond_wait(&server->changed, &server->lock);
+    server->queue.push_back(request);
+    pthread_cond_broadcast(&server->changed);
+    pthread_mutex_unlock(&server->lock);
+}
+
+static void delete_request(Request* request) {
+    delete request->file;
+    delete request;
+}
+
+// parse requests of one connection until its input ends
+static void read_requests(Server* server, Connection* conn) {
+    char line[4096];
+    while (fgets(line, sizeof(line), conn->in)) {
+        std::istringstream header(line);
+        std::string id, source;
+        Request* request = new Request;
+        request->conn = conn;
+        request->file = NULL;
+        request->maxresults = server->maxresults;
+        if (!(header >> id)) {      // empty line
+            delete_request(request);
+            continue;
+        }
+        request->id = id;
+        if (!(header >> request->model >> request->width >> request->height >> source)) {
+            answer_error(conn, id, "expected: id model width height numpoints|@file [maxresults]");
+            delete_request(request);
+            continue;
+        }
+        header >> request->maxresults;
+
+        std::string error;
+        if ((request->model < 0) || (request->model >= static_cast<int>(server->models.size())))
+            error = "unknown model";
+        else if ((request->width < 2) || (request->width > MAXSIDE)
+                 || (request->height < 2) || (request->height > MAXSIDE))
+            error = "invalid image size";
+        else if ((request->maxresults < 1) || (request->maxresults > MAXRESULTS))
+            error = "invalid maxresults";
+        if (error.empty())
+            error = read_points(server, request, source);
+        else
+            skip_points(request, source);
+
+        if (error.empty() && (request->numpoints > 0)) {
+            submit(server, request);
+        } else {
+            answer_error(conn, id, error.empty() ? std::string("no points") : error);
+            delete_request(request);
+        }
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    conn->eof = true;
+    const bool finished = (conn->pending == 0);
+    pthread_mutex_unlock(&conn->lock);
+    if (finished)
+        close_connection(conn);
+}
+
+static void* reader_thread(void* argjob) {
+    ReaderJob* job = reinterpret_cast<ReaderJob*>(argjob);
+    read_requests(job->server, job->conn);
+    delete job;
+    return NULL;
+}
+
+// each worker has its own search context, like the batch search
+static void* server_worker(void* argdata) {
+    Server* server = reinterpret_cast<Server*>(argdata);
+    ESSContext* ctx = ess_create();
+    server->configure(ctx);
+    ess_set_option(ctx, "numthreads", 1);   // the workers are the threads, not numthreads^2
+
+    while (true) {
+        pthread_mutex_lock(&server->lock);
+        while (server->queue.empty() && !server->closing)
+            pthread_cond_wait(&server->changed, &server->lock);
+        if (server->queue.empty()) {
+            pthread_mutex_unlock(&server->lock);
+            break;
+        }
+        Request* request = server->queue.front();
+        server->queue.pop_front();
+        pthread_cond_broadcast(&server->changed);   // room for the readers
+        pthread_mutex_unlock(&server->lock);
+
+        const ServerModel &model = server->models[request->model];
+        std::vector<Box> boxes(request->maxresults);
+        const int numfound = ess_search_model_topk(ctx, model.model, request->numpoints, 
+                                                   request->width, request->height,
+                                                   request->columns[0], request->columns[1], 
+                                                   request->columns[2],
+                                                   request->maxresults, &boxes[0]);
+        std::ostringstream text;
+        text << request->id;
+        for (int k=0; k < numfound; k++) {
+            text << " " << std::setprecision(12) << boxes[k].score;
+            text << " " << boxes[k].left << " " << boxes[k].top;
+            text << " " << boxes[k].right << " " << boxes[k].bottom;
+        }
+        text << "\n";
+
+        Connection* conn = request->conn;
+        delete_request(request);
+        answer(conn, text.str(), true);
+    }
+    ess_destroy(ctx);
+    return NULL;
+}
+
+// accept connections forever, each one gets its own reader thread
+static int serve_socket(Server* server, const char* argsocket) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(argsocket) >= sizeof(address.sun_path)) {
+        std::cerr << "Socket name too long: " << argsocket << std::endl;
+        return 1;
+    }
+    strcpy(address.sun_path, argsocket);
+
+    const int listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(argsocket);
+    if ((listenfd < 0) || (bind(listenfd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0)
+        || (listen(listenfd, 16) != 0)) {
+        std::cerr << "Can't listen on socket " << argsocket << std::endl;
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);   // clients that go away must not kill the server
+
+    while (true) {
+        const int fd = accept(listenfd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        FILE* in = fdopen(fd, "r");
+        FILE* out = fdopen(dup(fd), "w");
+        if (!in || !out) {
+            if (in) fclose(in); else close(fd);
+            if (out) fclose(out);
+            continue;
+        }
+        ReaderJob* job = new ReaderJob;
+        job->server = server;
+        job->conn = new_connection(in, out, true);
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, reader_thread, job) == 0)
+            pthread_detach(thread);
+        else
+            reader_thread(job);     // serve this one connection right here
+    }
+    return 0;
+}
+
+int run_server(int argnummodels, char** argmodels, int argnumlevels, int argmaxresults,
+               int argnumworkers, const char* argsocket, const char* argdatadir,
+               ESSConfigure argconfigure) {
+    Server server;
+    server.maxresults = argmaxresults;
+    server.configure = argconfigure;
+    server.anyfile = (argsocket == NULL);
+    if (argdatadir) {
+        char resolved[PATH_MAX];
+        if (!realpath(argdatadir, resolved)) {
+            std::cerr << "Can't find data directory " << argdatadir << std::endl;
+            return 1;
+        }
+        server.datadir = resolved;
+        if (server.datadir[server.datadir.size()-1] != '/')
+            server.datadir += '/';
+    }
+    if (!load_models(&server, argnummodels, argmodels, argnumlevels)) {
+        free_models(&server);
+        return 1;
+    }
+
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.changed, NULL);
+    server.maxqueue = 4*argnumworkers;
+    server.closing = false;
+
+    std::vector<pthread_t> threads(argnumworkers);
+    int numstarted = 0;
+    for (int i=0; i < argnumworkers; i++) {
+        if (pthread_create(&threads[i], NULL, server_worker, &server) != 0)
+            break;
+        numstarted++;
+    }
+    if (numstarted == 0) {
+        std::cerr << "Can't start worker threads" << std::endl;
+        free_models(&server);
+        return 1;
+    }
+
+    int result = 0;
+    if (argsocket)
+        result = serve_socket(&server, argsocket);
+    else
+        read_requests(&server, new_connection(stdin, stdout, false));
+
+    pthread_mutex_lock(&server.lock);
+    server.closing = true;
+    pthread_cond_broadcast(&server.changed);
+    pthread_mutex_unlock(&server.lock);
+    for (int i=0; i < numstarted; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_cond_destroy(&server.changed);
+    pthread_mutex_destroy(&server.lock);
+    free_models(&server);
+    return result;
+}
@@ -0,0 +1,62 @@
+/********************************************************
+ *                                                      *
+ *  Efficient Subwindow Search (ESS) implemented in C++ *
+ *  server mode: load the models once, then answer a    *
+ *  stream of search requests on worker threads         *
+ *                                                      *
+ *   Copyright 2006-2008 Christoph Lampert              *
+ *   Contact: <mail@christoph-lampert.org>              *
+ *                                                      *
+ *  Licensed under the Apache License, Version 2.0 (the *
+ *  "License"); you may not use this file except in     *
+ *  compliance with the License. You may obtain a copy  *
+ *  of the License at                                   *
+ *                                                      *
+ *     http://www.apache.org/licenses/LICENSE-2.0       *
+ *                                                      *
+ *  Unless required by applicable law or agreed to in   *
+ *  writing, software distributed under the License is  *
+ *  distributed on an "AS IS" BASIS, WITHOUT WARRANTIES *
+ *  OR CONDITIONS OF ANY KIND, either express or        *
+ *  implied. See the License for the specific language  *
+ *  governing permissions and limitations under the     *
+ *  License.                                            *
+ *                                                      *
+ ********************************************************/
+
+#ifndef _ESS_SERVER_H
+#define _ESS_SERVER_H
+
+#include "ess.hh"
+
+// Protocol, one request per line, answers come back in the order the
+// searches finish, so pipelined requests are matched by their id:
+//
+//   request: id model width height numpoints [maxresults]
+//            followed by numpoints lines "x y clusterID"
+//       or : id model width height @datafile [maxresults]
+//            with the points in an ASCII or binary data file, see run_server()
+//   answer : id score left top right bottom [score left top right bottom ...]
+//       or : id error message
+//
+// model is the index of the weight file on the command line, starting at 0.
+
+// applies the settings of the command line to a new search context.
+// It's called by every worker at the same time, so it must only change 
+// the context. The workers search with 1 thread each, whatever it sets.
+typedef void (*ESSConfigure)(ESSContext* ctx);
+
+// Load the weight files argmodels[0..argnummodels-1] (ASCII or binary,
+// "file:numlevels" to give a model its own number of levels), then
+// answer requests from stdin on stdout, or, if argsocket is set, from
+// every connection to the Unix socket of that name. Each of the
+// argnumworkers threads has its own search context.
+// With argdatadir set, the data files of requests are looked up in that
+// directory, and files outside of it are refused. Without it, clients 
+// on stdin can read any file the server can, socket clients none.
+// returns 0 when the input ends, 1 if a model or the socket can't be set up
+int run_server(int argnummodels, char** argmodels, int argnumlevels, int argmaxresults,
+               int argnumworkers, const char* argsocket, const char* argdatadir,
+               ESSConfigure argconfigure);
+
+#endif
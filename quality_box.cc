@@ -24,50 +24,159 @@
  ********************************************************/
 
 #include <vector>
+#include <algorithm>
 
 #include "ess.hh"
 #include "quality_box.hh"
 
-void BoxQualityFunction::create_integral_matrices(const std::vector<double> &raw_matrix) {
-    pos_matrix.clear();
-    pos_matrix.resize( raw_matrix.size() );
-    neg_matrix.clear();
-    neg_matrix.resize( raw_matrix.size() );
-
-    // split the weight matrix into positive and negative entries
-    for (unsigned int i=0; i < raw_matrix.size(); i++) {
-        double val = raw_matrix[i];
-        if (val > 0.)
-            pos_matrix[i] = val;
-        else
-            neg_matrix[i] = val;
+void BoxQualityFunction::create_integral_matrices() {
+    neg_matrix.resize( pos_matrix.size() );
+
+    // row and column 0 are padding, they stay empty
+    for (int i=0; i < width; i++)
+        neg_matrix[off(i,0)] = 0.;
+
+    // split the weight matrix into positive and negative entries and 
+    // calculate both integral images in a single sweep: each entry is 
+    // the one above plus the sum of the row so far. Only the current and 
+    // the previous row are touched, so this stays in the cache.
+    for (int j=1; j < height; j++) {
+        neg_matrix[off(0,j)] = 0.;
+        double pos_sum = 0.;
+        double neg_sum = 0.;
+        for (int i=1; i < width; i++) {
+            const double val = pos_matrix[off(i,j)];
+            if (val > 0.)
+                pos_sum += val;
+            else
+                neg_sum += val;
+            pos_matrix[off(i,j)] = pos_matrix[off(i,j-1)] + pos_sum;
+            neg_matrix[off(i,j)] = neg_matrix[off(i,j-1)] + neg_sum;
+        }
     }
+    return;
+}
+
+// largest relative rounding error when storing a double as float
+static const double float_rounding = 1./(1<<24);
+
+void BoxQualityFunction::create_integral_matrices_float(const std::vector<double> &raw_matrix) {
+    pos_matrix_f.assign( raw_matrix.size(), 0.f );
+    neg_matrix_f.assign( raw_matrix.size(), 0.f );
 
-    // calculate integral image verically
+    // integral of the previous row, kept in double so errors don't add up
+    std::vector<double> pos_row(width, 0.);
+    std::vector<double> neg_row(width, 0.);
     for (int j=1; j < height; j++) {
+        double pos_sum = 0.;
+        double neg_sum = 0.;
         for (int i=1; i < width; i++) {
-            pos_matrix[off(i,j)] += pos_matrix[off(i,j-1)];
-            neg_matrix[off(i,j)] += neg_matrix[off(i,j-1)];
+            const double val = raw_matrix[off(i,j)];
+            if (val > 0.)
+                pos_sum += val;
+            else
+                neg_sum += val;
+            pos_row[i] += pos_sum;
+            neg_row[i] += neg_sum;
+            pos_matrix_f[off(i,j)] = static_cast<float>(pos_row[i]);
+            neg_matrix_f[off(i,j)] = static_cast<float>(neg_row[i]);
         }
     }
-    // calculate integral image horizontally
-    for (int j=1; j<height; j++) {
-        for (int i=1; i<width; i++) {
-            pos_matrix[off(i,j)] += pos_matrix[off(i-1,j)];
-            neg_matrix[off(i,j)] += neg_matrix[off(i-1,j)];
+
+    // the largest entries are in the bottom right corner
+    pos_error = float_rounding * pos_row[width-1];
+    neg_error = -float_rounding * neg_row[width-1];
+    return;
+}
+
+void BoxQualityFunction::set_precision(int bits, std::vector<double>* shared_scratch) {
+    scratch = shared_scratch;
+    if (bits == precision)
+        return;
+    precision = bits;
+
+    // the storage of the other precision isn't needed anymore
+    if (precision == 32) {
+        std::vector<double>().swap(pos_matrix);
+        std::vector<double>().swap(neg_matrix);
+    } else {
+        std::vector<float>().swap(pos_matrix_f);
+        std::vector<float>().swap(neg_matrix_f);
+        std::vector<double>().swap(own_scratch);
+    }
+    return;
+}
+
+void BoxQualityFunction::set_coarse(int factor) {
+    coarse_shift = 0;
+    while ((2 << coarse_shift) <= factor)
+        coarse_shift++;
+    if (coarse_shift == 0) {
+        std::vector<double>().swap(pos_coarse);
+        std::vector<double>().swap(neg_coarse);
+    }
+    return;
+}
+
+template<typename T>
+void BoxQualityFunction::sample_coarse_matrix(const std::vector<T> &matrix, 
+                                              std::vector<double> &coarse_matrix) {
+    // coarse entry (i,j) is entry (i*factor,j*factor), the last row and 
+    // column are the ones of the image, so every box fits into the grid
+    coarse_matrix.resize(coarse_width*coarse_height);
+    for (int j=0; j < coarse_height; j++) {
+        const int y = std::min(j << coarse_shift, height-1);
+        for (int i=0; i < coarse_width; i++) {
+            const int x = std::min(i << coarse_shift, width-1);
+            coarse_matrix[coarse_off(i,j)] = matrix[off(x,y)];
         }
     }
     return;
 }
 
+void BoxQualityFunction::create_coarse_matrices() {
+    if (coarse_shift == 0)
+        return;
+    const int step = (1 << coarse_shift) - 1;
+    coarse_width = ((width-1+step) >> coarse_shift) + 1;
+    coarse_height = ((height-1+step) >> coarse_shift) + 1;
+    if (precision == 32) {
+        sample_coarse_matrix(pos_matrix_f, pos_coarse);
+        sample_coarse_matrix(neg_matrix_f, neg_coarse);
+    } else {
+        sample_coarse_matrix(pos_matrix, pos_coarse);
+        sample_coarse_matrix(neg_matrix, neg_coarse);
+    }
+    return;
+}
+
+double* BoxQualityFunction::prepare_raw_matrix(int argwidth, int argheight) {
+    width = argwidth;
+    height = argheight;
+
+    // The raw weights are collected in pos_matrix, which keeps its
+    // memory from earlier calls, and split up afterwards.
+    // With precision 32, they are collected in the scratch matrix.
+    std::vector<double> &raw_matrix = (precision == 32) 
+                                      ? (scratch ? *scratch : own_scratch) : pos_matrix;
+    raw_matrix.assign(argwidth*argheight, 0.);
+    return &raw_matrix[0];
+}
+
+void BoxQualityFunction::finish_setup() {
+    if (precision == 32)
+        create_integral_matrices_float(scratch ? *scratch : own_scratch);
+    else
+        create_integral_matrices();
+    create_coarse_matrices();
+    return;
+}
+
 void BoxQualityFunction::setup(int argnumpoints, int argwidth, int argheight, 
                                double* argxpos, double* argypos, double* argclst, 
                                void* argdata) {
-    width = argwidth;
-    height = argheight;
-    
-    // transform (x,y,c),weight into integral image representation
-    std::vector<double> raw_matrix(argwidth*argheight);
+    // transform (x,y,c),weight into integral image representation.
+    double* raw_matrix = prepare_raw_matrix(argwidth, argheight);
 
     // for sum-of-scores, the data is a vector of cluster weights
     const double* argweight = reinterpret_cast<double*>(argdata);
@@ -79,7 +188,7 @@ void BoxQualityFunction::setup(int argnumpoints, int argwidth, int argheight,
         const int c = static_cast<int>(argclst[k]);
         raw_matrix[off(x,y)] += argweight[c];
     }
-    create_integral_matrices(raw_matrix);
+    finish_setup();
     return;
 }
 
@@ -87,7 +196,55 @@ void BoxQualityFunction::cleanup() {
     return;
 }
 
-double BoxQualityFunction::upper_bound(const sstate* state) const {
-    return quality_upper_single(state);
+void BoxQualityFunction::remove_box_from_matrix(int left, int top, int right, int bottom,
+                                                std::vector<double> &matrix) {
+    // box_sum(x,y) is the sum over [left,x]x[top,y], read off the integral image
+    const int boxwidth = right-left+1;
+    const int boxheight = bottom-top+1;
+    std::vector<double> box_sum(boxwidth*boxheight);
+    for (int j=0; j < boxheight; j++) {
+        for (int i=0; i < boxwidth; i++) {
+            box_sum[j*boxwidth+i] = rect_val(left, top, left+i, top+j, matrix);
+        }
+    }
+
+    // every entry right/below of (left,top) contains a part of the box: 
+    // the part up to its own coordinates, clipped at the box boundary
+    for (int y=top; y < height; y++) {
+        const int j = (y < bottom ? y : bottom) - top;
+        for (int x=left; x < width; x++) {
+            const int i = (x < right ? x : right) - left;
+            matrix[off(x,y)] -= box_sum[j*boxwidth+i];
+        }
+    }
+    return;
 }
 
+bool BoxQualityFunction::remove_box(int left, int top, int right, int bottom) {
+    // clip to the image, row/column 0 is padding and always empty
+    if (left < 1) left = 1;
+    if (top < 1) top = 1;
+    if (right > width-1) right = width-1;
+    if (bottom > height-1) bottom = height-1;
+    if ((left > right) || (top > bottom))
+        return true;
+
+    // The box sums of float images carry their rounding error into every
+    // changed entry, and it would grow with each box. Without the raw 
+    // weights, the images have to be set up again, see PyramidQualityFunction.
+    if (precision == 32)
+        return false;
+
+    remove_box_from_matrix(left, top, right, bottom, pos_matrix);
+    remove_box_from_matrix(left, top, right, bottom, neg_matrix);
+    create_coarse_matrices();
+    return true;
+}
+
+long BoxQualityFunction::memory_usage() const {
+    long bytes = (pos_matrix.capacity() + neg_matrix.capacity()) * sizeof(double);
+    bytes += (pos_matrix_f.capacity() + neg_matrix_f.capacity()) * sizeof(float);
+    bytes += own_scratch.capacity() * sizeof(double);
+    bytes += (pos_coarse.capacity() + neg_coarse.capacity()) * sizeof(double);
+    return bytes;
+}
@@ -27,6 +27,7 @@
 #define _QUALITY_BOX_H
 
 #include <vector>
+#include <algorithm>
 
 #include "ess.hh"
 #include "quality_function.hh"
@@ -38,24 +39,106 @@ class BoxQualityFunction : public QualityFunction {
         std::vector<double> pos_matrix;
         std::vector<double> neg_matrix;
 
+        // With precision 32, the integral images are stored as float to save
+        // half the memory. Every stored entry is then off by at most 
+        // pos_error/neg_error, and this is added to the bound, so it stays 
+        // a valid upper bound. The raw weights are collected in a scratch 
+        // matrix of doubles, which a pyramid can share between its cells.
+        int precision;
+        std::vector<float> pos_matrix_f;
+        std::vector<float> neg_matrix_f;
+        double pos_error, neg_error;
+        std::vector<double>* scratch;
+        std::vector<double> own_scratch;
+
+        // Coarse copies of the integral images with every 2^coarse_shift'th
+        // entry in both directions, see set_coarse(). They are small enough
+        // to stay in the cache. States whose intervals all start and end on
+        // the coarse grid are bounded from them: the positive part exactly,
+        // the negative part from the smallest box shrunk by one pixel per
+        // side, which only raises the bound.
+        int coarse_shift;               // 0 = no coarse images
+        int coarse_width, coarse_height;
+        std::vector<double> pos_coarse;
+        std::vector<double> neg_coarse;
+
         // convert (x,y) into 1d index
         inline unsigned int off(unsigned int x, unsigned int y) const {
             return y*width+x;
         }
         
         // calculate score of a box from integral image
+        template<typename T>
         double rect_val(unsigned int xl, unsigned int yl, 
                         unsigned int xh, unsigned int yh,
-                        const std::vector<double> &matrix) const {
+                        const std::vector<T> &matrix) const {
             if ( (xl > xh) || (yl > yh)) return 0.;
 
-            const double val = matrix[off(xh,yh)] - matrix[off(xh,yl-1)]
+            const double val = static_cast<double>(matrix[off(xh,yh)]) - matrix[off(xh,yl-1)]
                                - matrix[off(xl-1,yh)] + matrix[off(xl-1,yl-1)];
             return val;
         }
 
+        inline unsigned int coarse_off(unsigned int x, unsigned int y) const {
+            return y*coarse_width+x;
+        }
+
+        // sum of the positive weights in [xl,xh]x[yl,yh], xl-1, yl-1, xh
+        // and yh are on the coarse grid
+        double coarse_outer_val(int xl, int yl, int xh, int yh) const {
+            if ((xl > xh) || (yl > yh)) return 0.;
+            const int step = (1 << coarse_shift) - 1;
+            const unsigned int cl = (xl-1) >> coarse_shift;
+            const unsigned int ct = (yl-1) >> coarse_shift;
+            const unsigned int cr = (xh+step) >> coarse_shift;
+            const unsigned int cb = (yh+step) >> coarse_shift;
+            return pos_coarse[coarse_off(cr,cb)] - pos_coarse[coarse_off(cr,ct)]
+                   - pos_coarse[coarse_off(cl,cb)] + pos_coarse[coarse_off(cl,ct)];
+        }
+
+        // sum of the negative weights in the largest box of the coarse 
+        // grid inside [xl,xh]x[yl,yh]. The last row and column of the 
+        // image are on the grid, even if they aren't multiples.
+        double coarse_inner_val(int xl, int yl, int xh, int yh) const {
+            const int step = (1 << coarse_shift) - 1;
+            const int cl = (xl-1+step) >> coarse_shift;
+            const int ct = (yl-1+step) >> coarse_shift;
+            const int cr = (xh == width-1) ? coarse_width-1 : xh >> coarse_shift;
+            const int cb = (yh == height-1) ? coarse_height-1 : yh >> coarse_shift;
+            if ((cl >= cr) || (ct >= cb)) return 0.;
+            return neg_coarse[coarse_off(cr,cb)] - neg_coarse[coarse_off(cr,ct)]
+                   - neg_coarse[coarse_off(cl,cb)] + neg_coarse[coarse_off(cl,ct)];
+        }
+
+        // true if all intervals of the state start and end on the coarse 
+        // grid, whose last row and column are those of the image
+        bool use_coarse(const sstate* s) const {
+            if (coarse_shift == 0)
+                return false;
+            const int mask = (1 << coarse_shift) - 1;
+            for (int i=0; i<4; i++) {
+                const int last = (i % 2 == 0) ? width-1 : height-1;
+                if (((s->low[i]-1) & mask) || ((s->high[i] & mask) && (s->high[i] != last)))
+                    return false;
+            }
+            return true;
+        }
+
         // calculate upper bound for one set of rectangles
         double quality_upper_single(const sstate* s) const {
+            if (use_coarse(s)) {
+                const double fplus = coarse_outer_val(s->low[0], s->low[1], s->high[2], s->high[3]);
+                const double fminus = coarse_inner_val(s->high[0], s->high[1], s->low[2], s->low[3]);
+                if (precision == 32)
+                    return fplus+fminus + 4.0001*(pos_error+neg_error);
+                return fplus+fminus;
+            }
+            if (precision == 32) {
+                const double fplus = rect_val(s->low[0], s->low[1], s->high[2], s->high[3], pos_matrix_f);
+                const double fminus = rect_val(s->high[0], s->high[1], s->low[2], s->low[3], neg_matrix_f);
+                // each rectangle reads 4 entries, each of them rounded
+                return fplus+fminus + 4.0001*(pos_error+neg_error);
+            }
             const double fplus = rect_val(s->low[0], s->low[1], s->high[2], s->high[3], pos_matrix);
             const double fminus = rect_val(s->high[0], s->high[1], s->low[2], s->low[3], neg_matrix);
             return fplus+fminus;
@@ -63,16 +146,58 @@ class BoxQualityFunction : public QualityFunction {
 
 
         // create separate integral images for positive and negative part
-        // of the original weight matrix
-        void create_integral_matrices(const std::vector<double> &raw_matrix);
+        // of the original weight matrix, which is passed in pos_matrix
+        void create_integral_matrices();
+
+        // same for precision 32: the raw weights are passed in raw_matrix,
+        // the integral images are summed up in double and stored as float
+        void create_integral_matrices_float(const std::vector<double> &raw_matrix);
+
+        // sample the coarse images from the full ones
+        template<typename T>
+        void sample_coarse_matrix(const std::vector<T> &matrix, std::vector<double> &coarse_matrix);
+        void create_coarse_matrices();
+
+        // subtract the part of an integral image that lies inside the box
+        void remove_box_from_matrix(int left, int top, int right, int bottom,
+                                    std::vector<double> &matrix);
 
     public:
+        BoxQualityFunction() : width(0), height(0), precision(64), 
+                               pos_error(0.), neg_error(0.), scratch(NULL),
+                               coarse_shift(0), coarse_width(0), coarse_height(0) { }
+
+        // store the integral images with 64 (double) or 32 (float) bits.
+        // For 32 bits, shared_scratch can point to a buffer for the raw 
+        // weights that is shared with other BoxQualityFunctions.
+        void set_precision(int bits, std::vector<double>* shared_scratch=NULL);
+
+        // also keep integral images with every factor'th entry (a power of 
+        // two, 0 = none) for states on that grid, see split_state() in 
+        // ess.cc. Takes effect at setup().
+        void set_coarse(int factor);
+
         void setup(int argnumpoints, int argwidth, int argheight, 
                    double* argxpos, double* argypos, double* argclst, 
                    void* argdata);
 
+        // setup() in two steps, so several BoxQualityFunctions can be filled 
+        // in one pass over the points: prepare_raw_matrix() returns a zeroed
+        // argwidth*argheight matrix (row by row) to add the point weights to,
+        // finish_setup() turns it into the integral images.
+        double* prepare_raw_matrix(int argwidth, int argheight);
+        void finish_setup();
+
         void cleanup();
 
-        double upper_bound(const sstate* state) const;
+        // defined here, so that a non-virtual call can be inlined, 
+        // e.g. by the cells of PyramidQualityFunction
+        double upper_bound(const sstate* state) const {
+            return quality_upper_single(state);
+        }
+
+        bool remove_box(int left, int top, int right, int bottom);
+
+        long memory_usage() const;
 };
 #endif
@@ -44,6 +44,18 @@ class QualityFunction {
         virtual void cleanup() { return; };
 
         virtual double upper_bound(const sstate* state) const = 0;
+
+        // score of a single box. The bound of a single box is its score,
+        // unless the bounds are rounded up, see PyramidQualityFunction
+        virtual double box_score(const sstate* state) const { return upper_bound(state); };
+
+        // remove all data inside the box [left,right]x[top,bottom] (in padded
+        // coordinates, like the entries of a sstate), as if these points had
+        // never been passed to setup(). Returns false if not supported.
+        virtual bool remove_box(int /*left*/, int /*top*/, int /*right*/, int /*bottom*/) { return false; };
+
+        // number of bytes held for the data passed to setup()
+        virtual long memory_usage() const { return 0; };
 };
 
 #endif
@@ -0,0 +1,280 @@
+/********************************************************
+ *                                                      *
+ *  Efficient Subwindow Search (ESS) implemented in C++ *
+ *  bounds for SVMs with additive nonlinear kernels     *
+ *                                                      *
+ *   Copyright 2006-2008 Christoph Lampert              *
+ *   Contact: <mail@christoph-lampert.org>              *
+ *                                                      *
+ *  Licensed under the Apache License, Version 2.0 (the *
+ *  "License"); you may not use this file except in     *
+ *  compliance with the License. You may obtain a copy  *
+ *  of the License at                                   *
+ *                                                      *
+ *     http://www.apache.org/licenses/LICENSE-2.0       *
+ *                                                      *
+ *  Unless required by applicable law or agreed to in   *
+ *  writing, software distributed under the License is  *
+ *  distributed on an "AS IS" BASIS, WITHOUT WARRANTIES *
+ *  OR CONDITIONS OF ANY KIND, either express or        *
+ *  implied. See the License for the specific language  *
+ *  governing permissions and limitations under the     *
+ *  License.                                            *
+ *                                                      *
+ ********************************************************/
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+#include "ess.hh"
+#include "quality_kernel.hh"
+
+// false for NaN and infinities
+static bool is_finite(double value) {
+    return (value >= -std::numeric_limits<double>::max()) && (value <= std::numeric_limits<double>::max());
+}
+
+bool KernelModel::build(int argkernel, int argnumclusters, int argnumvectors,
+                        const double* argvectors, const double* argalpha, double argbias) {
+    if ((argkernel != ESS_KERNEL_INTERSECTION) && (argkernel != ESS_KERNEL_CHI2))
+        return false;
+    for (long i=0; i < static_cast<long>(argnumvectors)*argnumclusters; i++)
+        if (!(argvectors[i] >= 0.) || !is_finite(argvectors[i]))
+            return false;
+    for (int i=0; i < argnumvectors; i++)
+        if (!is_finite(argalpha[i]))
+            return false;
+    if (!is_finite(argbias))
+        return false;
+
+    kernel = argkernel;
+    numclusters = argnumclusters;
+    bias = argbias;
+
+    // only entries that can change the score: k_c(t,0) = 0 for both kernels
+    first.assign(numclusters+1, 0);
+    values.clear();
+    alpha.clear();
+    std::vector< std::pair<double,double> > entries;
+    for (int c=0; c < numclusters; c++) {
+        entries.clear();
+        for (int i=0; i < argnumvectors; i++) {
+            const double value = argvectors[static_cast<long>(i)*numclusters+c];
+            if ((value > 0.) && (argalpha[i] != 0.))
+                entries.push_back(std::make_pair(value, argalpha[i]));
+        }
+        std::sort(entries.begin(), entries.end());
+        for (unsigned int e=0; e < entries.size(); e++) {
+            values.push_back(entries[e].first);
+            alpha.push_back(entries[e].second);
+        }
+        first[c+1] = values.size();
+    }
+
+    table_of.assign(numclusters, -1);
+    pos_table.clear();
+    neg_table.clear();
+    for (int c=0; c < numclusters; c++) {
+        if (first[c] == first[c+1])
+            continue;
+        table_of[c] = pos_table.size();
+        pos_table.resize(pos_table.size()+KERNELTABLE+1);
+        neg_table.resize(neg_table.size()+KERNELTABLE+1);
+        evaluate(c, 0, KERNELTABLE+1, &pos_table[table_of[c]], &neg_table[table_of[c]]);
+    }
+    return true;
+}
+
+void KernelModel::evaluate(int c, int argfirst, int arglast, double* argpos, double* argneg) const {
+    const int begin = first[c];
+    const int end = first[c+1];
+
+    if (kernel == ESS_KERNEL_INTERSECTION) {
+        // g(t) = sum_{x <= t} alpha*x + t * sum_{x > t} alpha, and the
+        // entries are sorted by x, so one pass over them covers all t
+        double pos_below = 0., neg_below = 0.;
+        double pos_above = 0., neg_above = 0.;
+        for (int i=begin; i < end; i++) {
+            if (alpha[i] > 0.)
+                pos_above += alpha[i];
+            else
+                neg_above -= alpha[i];
+        }
+        int i = begin;
+        for (int t=argfirst; t < arglast; t++) {
+            for (; (i < end) && (values[i] <= t); i++) {
+                if (alpha[i] > 0.) {
+                    pos_below += alpha[i]*values[i];
+                    pos_above -= alpha[i];
+                } else {
+                    neg_below -= alpha[i]*values[i];
+                    neg_above += alpha[i];
+                }
+            }
+            argpos[t-argfirst] = pos_below + t*pos_above;
+            argneg[t-argfirst] = neg_below + t*neg_above;
+        }
+        return;
+    }
+
+    for (int t=argfirst; t < arglast; t++) {
+        double pos = 0., neg = 0.;
+        for (int i=begin; i < end; i++) {
+            const double k = 2.*t*values[i]/(t+values[i]);
+            if (alpha[i] > 0.)
+                pos += alpha[i]*k;
+            else
+                neg -= alpha[i]*k;
+        }
+        argpos[t-argfirst] = pos;
+        argneg[t-argfirst] = neg;
+    }
+    return;
+}
+
+long KernelModel::memory_usage() const {
+    return (first.capacity() + table_of.capacity()) * sizeof(int)
+           + (values.capacity() + alpha.capacity()
+              + pos_table.capacity() + neg_table.capacity()) * sizeof(double);
+}
+
+
+void KernelQualityFunction::setup(int argnumpoints, int argwidth, int argheight,
+                                  double* argxpos, double* argypos, double* argclst,
+                                  void* argdata) {
+    const KernelModel* model = reinterpret_cast<const KernelModel*>(argdata);
+    width = argwidth;
+    height = argheight;
+    bias = model->bias;
+
+    // clusters that occur in the image and in the support vectors get a
+    // local index k, all others add nothing to any box
+    std::vector<int> localindex(model->numclusters, -1);
+    std::vector<int> clusters;
+    std::vector<int> numof;
+    pointx.clear();
+    pointy.clear();
+    pointk.clear();
+    for (int p=0; p < argnumpoints; p++) {
+        const int c = static_cast<int>(argclst[p]);
+        if ((c < 0) || (c >= model->numclusters) || (model->table_of[c] < 0))
+            continue;
+        if (localindex[c] < 0) {
+            localindex[c] = clusters.size();
+            clusters.push_back(c);
+            numof.push_back(0);
+        }
+        numof[localindex[c]]++;
+        pointx.push_back(static_cast<int>(argxpos[p])+1);   // we pad +1
+        pointy.push_back(static_cast<int>(argypos[p])+1);
+        pointk.push_back(localindex[c]);
+    }
+    numpresent = clusters.size();
+
+    // tables up to the number of points of each cluster, the model has
+    // them for small counts
+    tablestart.resize(numpresent+1);
+    tablestart[0] = 0;
+    for (int k=0; k < numpresent; k++)
+        tablestart[k+1] = tablestart[k] + numof[k]+1;
+    pos_table.resize(tablestart[numpresent]);
+    neg_table.resize(tablestart[numpresent]);
+    for (int k=0; k < numpresent; k++) {
+        const int c = clusters[k];
+        const int size = numof[k]+1;
+        const int stored = std::min(size, KERNELTABLE+1);
+        std::copy(&model->pos_table[model->table_of[c]], &model->pos_table[model->table_of[c]]+stored,
+                  &pos_table[tablestart[k]]);
+        std::copy(&model->neg_table[model->table_of[c]], &model->neg_table[model->table_of[c]]+stored,
+                  &neg_table[tablestart[k]]);
+        if (size > stored)
+            model->evaluate(c, stored, size, &pos_table[tablestart[k]+stored],
+                            &neg_table[tablestart[k]+stored]);
+    }
+
+    setup_counts();
+    return;
+}
+
+// integral count images of all clusters from pointx, pointy and pointk.
+// The offsets are long: width times clusters, or the count image of a 
+// cluster with many points, can be larger than an int.
+void KernelQualityFunction::setup_counts() {
+    const long K = numpresent;
+    const int numpoints = pointk.size();
+
+    // mark the coordinates of each cluster, then count them up
+    xindex.assign(width*K, 0);
+    yindex.assign(height*K, 0);
+    for (int p=0; p < numpoints; p++) {
+        xindex[pointx[p]*K + pointk[p]] = 1;
+        yindex[pointy[p]*K + pointk[p]] = 1;
+    }
+    for (long x=1; x < width; x++)
+        for (long k=0; k < K; k++)
+            xindex[x*K+k] += xindex[(x-1)*K+k];
+    for (long y=1; y < height; y++)
+        for (long k=0; k < K; k++)
+            yindex[y*K+k] += yindex[(y-1)*K+k];
+
+    // row and column 0 of each count image stay empty, like the padding
+    countstart.resize(K+1);
+    countwidth.resize(K);
+    countstart[0] = 0;
+    for (long k=0; k < K; k++) {
+        countwidth[k] = xindex[(width-1)*K+k]+1;
+        countstart[k+1] = countstart[k] + static_cast<long>(countwidth[k])*(yindex[(height-1)*K+k]+1);
+    }
+    counts.assign(countstart[K], 0);
+    for (int p=0; p < numpoints; p++) {
+        const int k = pointk[p];
+        counts[countstart[k] + static_cast<long>(yindex[pointy[p]*K+k])*countwidth[k] 
+               + xindex[pointx[p]*K+k]]++;
+    }
+
+    // integral images: each entry is the one above plus the row so far
+    for (long k=0; k < K; k++) {
+        int* matrix = &counts[countstart[k]];
+        const long w = countwidth[k];
+        const long h = (countstart[k+1]-countstart[k])/w;
+        for (long j=1; j < h; j++) {
+            int rowsum = 0;
+            for (long i=1; i < w; i++) {
+                rowsum += matrix[j*w+i];
+                matrix[j*w+i] = matrix[(j-1)*w+i] + rowsum;
+            }
+        }
+    }
+    return;
+}
+
+// The counts only get smaller, so the tables stay valid. The points
+// left are counted again.
+bool KernelQualityFunction::remove_box(int left, int top, int right, int bottom) {
+    unsigned int numkept = 0;
+    for (unsigned int p=0; p < pointk.size(); p++) {
+        if ((pointx[p] >= left) && (pointx[p] <= right) && (pointy[p] >= top) && (pointy[p] <= bottom))
+            continue;
+        pointx[numkept] = pointx[p];
+        pointy[numkept] = pointy[p];
+        pointk[numkept] = pointk[p];
+        numkept++;
+    }
+    if (numkept == pointk.size())
+        return true;
+    pointx.resize(numkept);
+    pointy.resize(numkept);
+    pointk.resize(numkept);
+    setup_counts();
+    return true;
+}
+
+long KernelQualityFunction::memory_usage() const {
+    return (tablestart.capacity() + xindex.capacity() + yindex.capacity()
+            + countwidth.capacity() + counts.capacity()
+            + pointx.capacity() + pointy.capacity() + pointk.capacity()) * sizeof(int)
+           + countstart.capacity() * sizeof(long)
+           + (pos_table.capacity() + neg_table.capacity()) * sizeof(double);
+}
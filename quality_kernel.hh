@@ -0,0 +1,154 @@
+/********************************************************
+ *                                                      *
+ *  Efficient Subwindow Search (ESS) implemented in C++ *
+ *  bounds for SVMs with additive nonlinear kernels     *
+ *                                                      *
+ *   Copyright 2006-2008 Christoph Lampert              *
+ *   Contact: <mail@christoph-lampert.org>              *
+ *                                                      *
+ *  Licensed under the Apache License, Version 2.0 (the *
+ *  "License"); you may not use this file except in     *
+ *  compliance with the License. You may obtain a copy  *
+ *  of the License at                                   *
+ *                                                      *
+ *     http://www.apache.org/licenses/LICENSE-2.0       *
+ *                                                      *
+ *  Unless required by applicable law or agreed to in   *
+ *  writing, software distributed under the License is  *
+ *  distributed on an "AS IS" BASIS, WITHOUT WARRANTIES *
+ *  OR CONDITIONS OF ANY KIND, either express or        *
+ *  implied. See the License for the specific language  *
+ *  governing permissions and limitations under the     *
+ *  License.                                            *
+ *                                                      *
+ ********************************************************/
+
+#ifndef _QUALITY_KERNEL_H
+#define _QUALITY_KERNEL_H
+
+#include <vector>
+
+#include "ess.hh"
+#include "quality_function.hh"
+
+#define KERNELTABLE 64      // counts per cluster whose kernel values a model stores
+
+// An SVM with an additive kernel k(h,x) = sum_c k_c(h_c,x_c) on the
+// cluster counts h of a box (not normalized):
+//
+//   f(h) = bias + sum_i alpha_i k(h, x_i) = bias + sum_c g_c(h_c)
+//   g_c(t) = sum_i alpha_i k_c(t, x_ic)
+//
+// with k_c(t,x) = min(t,x) for ESS_KERNEL_INTERSECTION and 2tx/(t+x) for
+// ESS_KERNEL_CHI2. Both grow with t, so g_c is the difference of the two
+// growing functions g+_c (from the alpha_i > 0) and g-_c (alpha_i < 0).
+// The model keeps them as tables over the count, so nothing of the
+// support vectors is touched during a search.
+class KernelModel {
+  public:
+    int kernel;             // ESS_KERNEL_*, 0 if the model is a pyramid
+    int numclusters;
+    double bias;
+
+    // the support vector entries x_ic > 0 of cluster c are first[c] to
+    // first[c+1]-1 of values and alpha, sorted by value
+    std::vector<int> first;
+    std::vector<double> values;
+    std::vector<double> alpha;
+
+    // g+_c(t) and g-_c(t) for t=0..KERNELTABLE, starting at table_of[c],
+    // which is -1 for clusters without entries
+    std::vector<int> table_of;
+    std::vector<double> pos_table;
+    std::vector<double> neg_table;
+
+    KernelModel() : kernel(0), numclusters(0), bias(0.) { }
+
+    // argvectors holds argnumclusters counts for each support vector,
+    // vector after vector. returns false for an unknown kernel, negative
+    // counts, or a value that is NaN or infinite
+    bool build(int argkernel, int argnumclusters, int argnumvectors,
+               const double* argvectors, const double* argalpha, double argbias);
+
+    // g+_c(t) and g-_c(t) for t=argfirst..arglast-1 into argpos and argneg
+    void evaluate(int c, int argfirst, int arglast, double* argpos, double* argneg) const;
+
+    long memory_usage() const;
+};
+
+// Bounds for a KernelModel. Every box of a state contains at most the
+// points of its largest box and at least those of its smallest one, for
+// every cluster on its own, and since g+_c and g-_c grow,
+//
+//   f <= bias + sum_c g+_c(count in largest box) - g-_c(count in smallest box)
+//
+// which is the exact score for a single box. The counts come from an
+// integral image per cluster. Only clusters that occur in the image are
+// set up, each on the grid of the distinct coordinates of its own
+// points, and a cluster without points in the largest box adds nothing.
+// Setup gets a KernelModel.
+class KernelQualityFunction : public QualityFunction {
+
+    private:
+        int width,height;
+        double bias;
+        int numpresent;                     // clusters with points in the image
+
+        // g+ and g- of cluster k for the counts 0..(its points), starting
+        // at tablestart[k]
+        std::vector<int> tablestart;
+        std::vector<double> pos_table;
+        std::vector<double> neg_table;
+
+        // xindex[x*numpresent+k]: distinct x coordinates of the points of
+        // cluster k up to padded x, the same for y. Integral count image
+        // of cluster k on these coordinates at countstart[k], rows of
+        // countwidth[k] entries
+        std::vector<int> xindex, yindex;
+        std::vector<long> countstart;
+        std::vector<int> countwidth;
+        std::vector<int> counts;
+
+        // the points with their cluster k, in padded coordinates, see remove_box()
+        std::vector<int> pointx, pointy, pointk;
+
+        void setup_counts();
+
+        int count(int k, int xl, int yl, int xh, int yh) const {
+            if ((xl > xh) || (yl > yh)) return 0;
+            const int* matrix = &counts[countstart[k]];
+            const long w = countwidth[k];
+            const int x0 = xindex[(xl-1)*static_cast<long>(numpresent)+k];
+            const int x1 = xindex[xh*static_cast<long>(numpresent)+k];
+            const long y0 = yindex[(yl-1)*static_cast<long>(numpresent)+k];
+            const long y1 = yindex[yh*static_cast<long>(numpresent)+k];
+            return matrix[y1*w+x1] - matrix[y0*w+x1] - matrix[y1*w+x0] + matrix[y0*w+x0];
+        }
+
+    public:
+        KernelQualityFunction() : width(0), height(0), bias(0.), numpresent(0) { }
+
+        void setup(int argnumpoints, int argwidth, int argheight,
+                   double* argxpos, double* argypos, double* argclst,
+                   void* argdata);
+
+        double upper_bound(const sstate* s) const {
+            double bound = bias;
+            for (int k=0; k < numpresent; k++) {
+                const int largest = count(k, s->low[0], s->low[1], s->high[2], s->high[3]);
+                if (largest == 0)
+                    continue;
+                bound += pos_table[tablestart[k]+largest];
+                // g- grows, if it's 0 at largest, it's 0 at smallest too
+                if (neg_table[tablestart[k]+largest] > 0.)
+                    bound -= neg_table[tablestart[k] + count(k, s->high[0], s->high[1], s->low[2], s->low[3])];
+            }
+            return bound;
+        }
+
+        bool remove_box(int left, int top, int right, int bottom);
+
+        long memory_usage() const;
+};
+
+#endif
@@ -26,70 +26,329 @@
  ********************************************************/
 
 #include <vector>
+#include <algorithm>
+#include <pthread.h>
 
 #include "ess.hh"
 #include "quality_pyramid.hh"
 
-sstate PyramidQualityFunction::rel_to_abs_coordinate(const Cell &subcoordinate, 
-                                                     const sstate* fullstate) const {
-    sstate substate;
-    substate.upper = fullstate->upper;
-    substate.low[0] =  static_cast<short>((1-subcoordinate.left)  *fullstate->low[0]  + subcoordinate.left  *fullstate->low[2] );
-    substate.high[0] = static_cast<short>((1-subcoordinate.left)  *fullstate->high[0] + subcoordinate.left  *fullstate->high[2]);
-    substate.low[2] =  static_cast<short>((1-subcoordinate.right) *fullstate->low[0]  + subcoordinate.right *fullstate->low[2] );
-    substate.high[2] = static_cast<short>((1-subcoordinate.right) *fullstate->high[0] + subcoordinate.right *fullstate->high[2]);
-    substate.low[1] =  static_cast<short>((1-subcoordinate.top)   *fullstate->low[1]  + subcoordinate.top   *fullstate->low[3] );
-    substate.high[1] = static_cast<short>((1-subcoordinate.top)   *fullstate->high[1] + subcoordinate.top   *fullstate->high[3]);
-    substate.low[3] =  static_cast<short>((1-subcoordinate.bottom)*fullstate->low[1]  + subcoordinate.bottom*fullstate->low[3] );
-    substate.high[3] = static_cast<short>((1-subcoordinate.bottom)*fullstate->high[1] + subcoordinate.bottom*fullstate->high[3]);
-    return substate;  // by value
+void make_pyramid_cells(int numlevels, std::vector<Cell> &cells) {
+    cells.clear();
+    for (int l=1;l<=numlevels;l++) {
+        for (int i=0;i<l;i++) {
+            for (int j=0;j<l;j++) {
+                Cell cur_cell;
+                cur_cell.left = j/(float)l;
+                cur_cell.top = i/(float)l;
+                cur_cell.right = (j+1)/(float)l;
+                cur_cell.bottom = (i+1)/(float)l;
+                cells.push_back(cur_cell);
+            }
+        }
+    }
+    return;
+}
+
+void PyramidQualityFunction::set_precision(int bits) {
+    precision = bits;
+    return;
+}
+
+void PyramidQualityFunction::set_coarse(int factor) {
+    coarse = factor;
+    return;
+}
+
+void PyramidQualityFunction::set_numthreads(int argnumthreads) {
+    numthreads = (argnumthreads > 0) ? argnumthreads : 1;
+    return;
+}
+
+void PyramidModel::find_shared_cells(const double* argweight) {
+    const unsigned int numcells = cells.size();
+
+    // a checksum of each weight vector, so we only compare the likely candidates
+    std::vector<double> checksum(numcells, 0.);
+    for (unsigned int i=0; i<numcells; i++) {
+        for (int k=0; k < numclusters; k++)
+            checksum[i] += (k+1) * argweight[i*numclusters+k];
+    }
+
+    cell_source.resize(numcells);
+    unique_cells.clear();
+    for (unsigned int i=0; i<numcells; i++) {
+        cell_source[i] = i;
+        const double* weight_i = &argweight[i*numclusters];
+        for (unsigned int j=0; j<i; j++) {
+            if (cell_source[j] != j) 
+                continue;
+            const double* weight_j = &argweight[j*numclusters];
+            if ((checksum[i] == checksum[j]) && std::equal(weight_i, weight_i+numclusters, weight_j)) {
+                cell_source[i] = j;
+                break;
+            }
+        }
+        if (cell_source[i] == i)
+            unique_cells.push_back(i);
+    }
+    return;
+}
+
+void PyramidModel::build(int argnumclusters, int argnumlevels, const double* argweight) {
+    numlevels = argnumlevels;
+    numclusters = argnumclusters;
+    caller_weights = NULL;
+    cell_stride = 1;
+    make_pyramid_cells(numlevels, cells);
+    find_shared_cells(argweight);
+
+    const unsigned int numcells = cells.size();
+    cluster_weights.resize(static_cast<unsigned long>(numclusters)*numcells);
+    for (int k=0; k < numclusters; k++) {
+        for (unsigned int i=0; i < numcells; i++)
+            cluster_weights[k*numcells+i] = argweight[i*numclusters+k];
+    }
+    return;
+}
+
+void PyramidModel::use(int argnumclusters, int argnumlevels, const double* argweight) {
+    if ((argnumlevels != numlevels) || cells.empty())
+        make_pyramid_cells(argnumlevels, cells);
+    numlevels = argnumlevels;
+    numclusters = argnumclusters;
+    caller_weights = argweight;
+    cell_stride = argnumclusters;
+    std::vector<double>().swap(cluster_weights);
+
+    const unsigned int numcells = cells.size();
+    cell_source.resize(numcells);
+    unique_cells.resize(numcells);
+    for (unsigned int i=0; i<numcells; i++)
+        cell_source[i] = unique_cells[i] = i;
+    return;
+}
+
+long PyramidModel::memory_usage() const {
+    return cluster_weights.capacity()*sizeof(double) + cells.capacity()*sizeof(Cell)
+           + (cell_source.capacity()+unique_cells.capacity())*sizeof(unsigned int);
+}
+
+void PyramidQualityFunction::setup_cells(unsigned int first, unsigned int step, 
+                                         int argnumpoints, double* argxpos, double* argypos, double* argclst,
+                                         const PyramidModel* model) {
+    // with float storage, each cell needs the scratch matrix for its raw 
+    // weights, so the cells are set up one after the other
+    if (precision == 32) {
+        for (unsigned int j=first; j < unique_cells.size(); j+=step) {
+            const unsigned int i = unique_cells[j];
+            cell_quality[i].set_precision(32, &scratch[first]);
+            cell_quality[i].set_coarse(coarse);
+            double* raw_matrix = cell_quality[i].prepare_raw_matrix(width, height);
+            for (int k=0; k<argnumpoints; k++) {
+                const int x = static_cast<int>(argxpos[k])+1;
+                const int y = static_cast<int>(argypos[k])+1;
+                const int c = static_cast<int>(argclst[k]);
+                if (!removed.empty() && is_removed(x, y))
+                    continue;
+                raw_matrix[y*width+x] += model->weights_of(c)[i*model->cell_stride];
+            }
+            cell_quality[i].finish_setup();
+        }
+        return;
+    }
+
+    // otherwise, a single pass over the points fills all raw matrices at once
+    std::vector<double*> raw_matrix;
+    std::vector<unsigned long> weight_index;    // of the cell in weights_of()
+    for (unsigned int j=first; j < unique_cells.size(); j+=step) {
+        const unsigned int i = unique_cells[j];
+        cell_quality[i].set_precision(64);
+        cell_quality[i].set_coarse(coarse);
+        raw_matrix.push_back(cell_quality[i].prepare_raw_matrix(width, height));
+        weight_index.push_back(i*model->cell_stride);
+    }
+    const unsigned int numcells = raw_matrix.size();
+
+    // we pad +1 so we can avoid boundary checks later
+    for (int k=0; k<argnumpoints; k++) {
+        const int x = static_cast<int>(argxpos[k])+1;
+        const int y = static_cast<int>(argypos[k])+1;
+        const double* weight = model->weights_of(static_cast<int>(argclst[k]));
+        const unsigned int offset = y*width+x;
+        for (unsigned int j=0; j<numcells; j++)
+            raw_matrix[j][offset] += weight[weight_index[j]];
+    }
+
+    for (unsigned int j=first; j < unique_cells.size(); j+=step)
+        cell_quality[unique_cells[j]].finish_setup();
+    return;
+}
+
+// arguments of one setup thread, see PyramidQualityFunction::setup_cells
+typedef struct {
+    PyramidQualityFunction* quality;
+    unsigned int first;
+    unsigned int step;
+    int numpoints;
+    double* xpos;
+    double* ypos;
+    double* clst;
+    const PyramidModel* model;
+} PyramidSetupJob;
+
+void* PyramidQualityFunction::setup_thread(void* argjob) {
+    PyramidSetupJob* job = reinterpret_cast<PyramidSetupJob*>(argjob);
+    job->quality->setup_cells(job->first, job->step, job->numpoints, 
+                              job->xpos, job->ypos, job->clst, job->model);
+    return NULL;
 }
 
 void PyramidQualityFunction::setup(int argnumpoints, int argwidth, int argheight, 
                                double* argxpos, double* argypos, double* argclst, 
                                void* argdata) {
-    PyramidParameters* data = reinterpret_cast<PyramidParameters*>(argdata);
+    model = reinterpret_cast<const PyramidModel*>(argdata);
                                
     width = argwidth;
     height = argheight;
 
-    cell_coordinates.clear();
-    for (unsigned int l=1;l<=data->numlevels;l++) {
-        for (unsigned int i=0;i<l;i++) {
-            for (unsigned int j=0;j<l;j++) {
-                Cell cur_cell;
-                cur_cell.left = j/(float)l;
-                cur_cell.top = i/(float)l;
-                cur_cell.right = (j+1)/(float)l;
-                cur_cell.bottom = (i+1)/(float)l;
-                cell_coordinates.push_back(cur_cell);
-            }
-        }
-    }
+    numlevels = model->numlevels;
+    cell_coordinates = model->cells;
     unsigned int numcells = cell_coordinates.size();
     cell_weights.resize(numcells);
     for (unsigned int i=0; i<numcells; i++)
         cell_weights[i] = 1.;   // weighting comes later
 
+    // only cells with different weights need their own integral images,
+    // the entries of shared cells are kept empty
+    cell_source = model->cell_source;
+    unique_cells = model->unique_cells;
     cell_quality.resize(numcells);
     for (unsigned int i=0; i<numcells; i++) {
-        double* argweight = data->weightptr[i];
-        cell_quality[i].setup(argnumpoints, argwidth, argheight, argxpos, argypos, argclst, argweight);
+        if (cell_source[i] != i) {
+            BoxQualityFunction empty;
+            std::swap(cell_quality[i], empty);
+        }
+    }
+
+    numpoints = argnumpoints;
+    pointx = argxpos;
+    pointy = argypos;
+    pointc = argclst;
+    removed.clear();
+    setup_all_cells(argnumpoints, argxpos, argypos, argclst);
+    return;
+}
+
+void PyramidQualityFunction::setup_all_cells(int argnumpoints, double* argxpos, double* argypos, 
+                                             double* argclst) {
+    // Each thread takes every numthreads'th cell, and fills all of them in 
+    // one pass over the points. The threads don't share any data.
+    const unsigned int numjobs = std::min<unsigned int>(numthreads, unique_cells.size());
+    if (precision == 32)
+        scratch.resize(numjobs);
+    else
+        scratch.clear();
+
+    std::vector<PyramidSetupJob> jobs(numjobs);
+    for (unsigned int t=0; t<numjobs; t++) {
+        jobs[t].quality = this;
+        jobs[t].first = t;
+        jobs[t].step = numjobs;
+        jobs[t].numpoints = argnumpoints;
+        jobs[t].xpos = argxpos;
+        jobs[t].ypos = argypos;
+        jobs[t].clst = argclst;
+        jobs[t].model = model;
+    }
+    std::vector<pthread_t> threads(numjobs);
+    std::vector<bool> started(numjobs, false);
+    for (unsigned int t=1; t<numjobs; t++)
+        started[t] = (pthread_create(&threads[t], NULL, setup_thread, &jobs[t]) == 0);
+    if (numjobs > 0)
+        setup_thread(&jobs[0]);     // the calling thread does the first share
+    for (unsigned int t=1; t<numjobs; t++) {
+        if (started[t])
+            pthread_join(threads[t], NULL);
+        else
+            setup_thread(&jobs[t]);
     }
 
     return;
 }
 
 void PyramidQualityFunction::cleanup() {
+    numpoints = 0;
+    pointx = pointy = pointc = NULL;
+    removed.clear();
     return;
 }
 
-double PyramidQualityFunction::upper_bound(const sstate* state) const {
+double PyramidQualityFunction::upper_bound_any(const sstate* state) const {
     double quality_bound=0.;
     for (unsigned int i=0; i<cell_quality.size(); i++) {
         sstate substate = rel_to_abs_coordinate(cell_coordinates[i], state);
-        quality_bound += cell_weights[i] * cell_quality[i].upper_bound(&substate);
+        quality_bound += cell_weights[i] * cell_quality[cell_source[i]].BoxQualityFunction::upper_bound(&substate);
     }
     return quality_bound;
 }
 
+double PyramidQualityFunction::box_score(const sstate* state) const {
+    if (precision != 32)
+        return upper_bound(state);
+    double score = 0.;
+    for (unsigned int i=0; i<cell_coordinates.size(); i++) {
+        const sstate cell = rel_to_abs_coordinate(cell_coordinates[i], state);
+        double cell_score = 0.;
+        for (int k=0; k<numpoints; k++) {
+            const int x = static_cast<int>(pointx[k])+1;     // padded, like the state
+            const int y = static_cast<int>(pointy[k])+1;
+            if ((x >= cell.low[0]) && (x <= cell.low[2]) && (y >= cell.low[1]) && (y <= cell.low[3])
+                && (removed.empty() || !is_removed(x, y)))
+                cell_score += model->weights_of(static_cast<int>(pointc[k]))[i*model->cell_stride];
+        }
+        score += cell_weights[i] * cell_score;
+    }
+    return score;
+}
+
+bool PyramidQualityFunction::remove_box(int left, int top, int right, int bottom) {
+    // Updating the float images in place would add the rounding error of
+    // the box sums to the entries, again with every box. Instead, the 
+    // float images are built again from the points outside of all removed
+    // boxes, so the error stays that of a fresh setup.
+    if (precision == 32) {
+        bool inside = false;
+        for (int k=0; (k<numpoints) && !inside; k++) {
+            const int x = static_cast<int>(pointx[k])+1;
+            const int y = static_cast<int>(pointy[k])+1;
+            inside = (x >= left) && (x <= right) && (y >= top) && (y <= bottom) && !is_removed(x, y);
+        }
+        if (!inside)
+            return true;
+        removed.push_back(left);
+        removed.push_back(top);
+        removed.push_back(right);
+        removed.push_back(bottom);
+        setup_all_cells(numpoints, pointx, pointy, pointc);
+        return true;
+    }
+
+    // every cell has its own integral images of the whole image
+    for (unsigned int i=0; i<cell_quality.size(); i++) {
+        if (cell_source[i] != i)
+            continue;
+        if (!cell_quality[i].remove_box(left, top, right, bottom))
+            return false;
+    }
+    return true;
+}
+
+long PyramidQualityFunction::memory_usage() const {
+    long bytes = 0;
+    for (unsigned int t=0; t<scratch.size(); t++)
+        bytes += scratch[t].capacity() * sizeof(double);
+    bytes += removed.capacity() * sizeof(int);
+    for (unsigned int i=0; i<cell_quality.size(); i++)
+        bytes += cell_quality[i].memory_usage();
+    return bytes;
+}
@@ -29,6 +29,7 @@
 #define _QUALITY_PYRAMID_H
 
 #include <vector>
+#include <algorithm>
 
 #include "ess.hh"
 #include "quality_function.hh"
@@ -43,29 +44,229 @@ typedef struct {
 } Cell;
 
 
-typedef struct {
-      int numlevels;
-      double** weightptr;
-} PyramidParameters;
+// fill cells with the relative coordinates of all cells of a pyramid
+// with levels 1x1, 2x2, ... numlevels x numlevels, in the order of the weights
+void make_pyramid_cells(int numlevels, std::vector<Cell> &cells);
+
+// Everything about a pyramid that depends only on the weights, not on the
+// points: cell geometry, which cells share weights, and the weights in the
+// order the setup reads them. It is built once and can be shared by any
+// number of searches, also in different threads.
+class PyramidModel {
+  public:
+    int numlevels;
+    int numclusters;
+    std::vector<Cell> cells;
+
+    // cells with identical weights share their integral images,
+    // cell_source[i] is the cell whose images are used for cell i
+    std::vector<unsigned int> cell_source;
+
+    // cells that need their own integral images
+    std::vector<unsigned int> unique_cells;
+
+    // weights by cluster: all cell weights of a point are next to each other
+    std::vector<double> cluster_weights;
+
+    // the caller's weights, cell after cell, if they are used in place, see use()
+    const double* caller_weights;
+
+    // the weight of cluster c in cell i is weights_of(c)[i*cell_stride]
+    unsigned long cell_stride;
+
+    PyramidModel() : numlevels(0), numclusters(0), caller_weights(NULL), cell_stride(1) { }
+
+    // argweight holds numclusters weights for each cell, cell after cell
+    void build(int argnumclusters, int argnumlevels, const double* argweight);
+
+    // the same without any preparation: argweight is read in place, and
+    // all cells get their own integral images. For a model that is only
+    // used once, e.g. by ess_search(). argweight must stay valid as long
+    // as the model is used.
+    void use(int argnumclusters, int argnumlevels, const double* argweight);
+
+    unsigned int numcells() const { return cells.size(); }
+
+    // the weights of cluster c in all cells, cell_stride apart
+    const double* weights_of(int c) const { 
+        return caller_weights ? &caller_weights[c] : &cluster_weights[c*cells.size()]; 
+    }
+
+    long memory_usage() const;
+
+  private:
+    void find_shared_cells(const double* argweight);
+};
 
 class PyramidQualityFunction : public QualityFunction {
 
     private:
         int width,height;
+        int numlevels;
         std::vector<BoxQualityFunction> cell_quality;
         std::vector<Cell> cell_coordinates;
         std::vector<double> cell_weights;
 
-        sstate rel_to_abs_coordinate(const Cell &subcoordinate, const sstate* state) const;
+        // cells with identical weights share one entry of cell_quality,
+        // cell_source[i] is the one used for cell i, see PyramidModel
+        std::vector<unsigned int> cell_source;
+        std::vector<unsigned int> unique_cells;
+
+        int precision;                   // see BoxQualityFunction::set_precision
+        int coarse;                      // see BoxQualityFunction::set_coarse
+        int numthreads;                  // threads used in setup()
+
+        // raw weights for precision 32, one matrix per setup thread
+        std::vector< std::vector<double> > scratch;
+
+        // for precision 32, the model and the points passed to setup(), 
+        // see box_score() and remove_box(). The points aren't copied, the 
+        // caller's arrays have to stay valid until cleanup(). Instead of 
+        // removing points, the boxes removed so far are kept, as padded
+        // left, top, right, bottom.
+        const PyramidModel* model;
+        int numpoints;
+        double *pointx, *pointy, *pointc;
+        std::vector<int> removed;
+
+        // true if the padded pixel (x,y) lies inside a removed box
+        bool is_removed(int x, int y) const {
+            for (unsigned int i=0; i<removed.size(); i+=4) {
+                if ((x >= removed[i]) && (x <= removed[i+2]) && (y >= removed[i+1]) && (y <= removed[i+3]))
+                    return true;
+            }
+            return false;
+        }
+
+        // set up all unique cells from the points, in numthreads threads
+        void setup_all_cells(int argnumpoints, double* argxpos, double* argypos, double* argclst);
+
+        // set up the unique cells first, first+step, ... 
+        void setup_cells(unsigned int first, unsigned int step, 
+                         int argnumpoints, double* argxpos, double* argypos, double* argclst,
+                         const PyramidModel* model);
+        static void* setup_thread(void* argjob);
+
+        sstate rel_to_abs_coordinate(const Cell &subcoordinate, const sstate* fullstate) const {
+            sstate substate;
+            substate.upper = fullstate->upper;
+            substate.low[0] =  static_cast<short>((1-subcoordinate.left)  *fullstate->low[0]  + subcoordinate.left  *fullstate->low[2] );
+            substate.high[0] = static_cast<short>((1-subcoordinate.left)  *fullstate->high[0] + subcoordinate.left  *fullstate->high[2]);
+            substate.low[2] =  static_cast<short>((1-subcoordinate.right) *fullstate->low[0]  + subcoordinate.right *fullstate->low[2] );
+            substate.high[2] = static_cast<short>((1-subcoordinate.right) *fullstate->high[0] + subcoordinate.right *fullstate->high[2]);
+            substate.low[1] =  static_cast<short>((1-subcoordinate.top)   *fullstate->low[1]  + subcoordinate.top   *fullstate->low[3] );
+            substate.high[1] = static_cast<short>((1-subcoordinate.top)   *fullstate->high[1] + subcoordinate.top   *fullstate->high[3]);
+            substate.low[3] =  static_cast<short>((1-subcoordinate.bottom)*fullstate->low[1]  + subcoordinate.bottom*fullstate->low[3] );
+            substate.high[3] = static_cast<short>((1-subcoordinate.bottom)*fullstate->high[1] + subcoordinate.bottom*fullstate->high[3]);
+            return substate;  // by value
+        }
+
+        // Bound of a pyramid with L levels, L fixed at compile time: the 
+        // loops have constant trip counts and the cell corners are computed
+        // from constants, exactly as in make_pyramid_cells(), so the compiler
+        // can unroll everything and inline the bounds of the cells.
+        template<int L>
+        double upper_bound_levels(const sstate* state) const {
+            double quality_bound=0.;
+            unsigned int i=0;
+            for (int l=1; l<=L; l++) {
+                for (int row=0; row<l; row++) {
+                    for (int col=0; col<l; col++, i++) {
+                        const Cell cell = { col/(float)l, row/(float)l, (col+1)/(float)l, (row+1)/(float)l };
+                        const sstate substate = rel_to_abs_coordinate(cell, state);
+                        quality_bound += cell_weights[i] 
+                                * cell_quality[cell_source[i]].BoxQualityFunction::upper_bound(&substate);
+                    }
+                }
+            }
+            return quality_bound;
+        }
+
+        // the same for up to BATCHSIZE states at once, see upper_bound_batch()
+        enum { BATCHSIZE = 16 };
+        template<int L>
+        void upper_bound_batch_levels(sstate* states, int numstates) const {
+            double quality_bound[BATCHSIZE];
+            for (int k=0; k<numstates; k++)
+                quality_bound[k] = 0.;
+            unsigned int i=0;
+            for (int l=1; l<=L; l++) {
+                for (int row=0; row<l; row++) {
+                    for (int col=0; col<l; col++, i++) {
+                        const Cell cell = { col/(float)l, row/(float)l, (col+1)/(float)l, (row+1)/(float)l };
+                        const BoxQualityFunction &quality = cell_quality[cell_source[i]];
+                        for (int k=0; k<numstates; k++) {
+                            const sstate substate = rel_to_abs_coordinate(cell, &states[k]);
+                            quality_bound[k] += cell_weights[i] * quality.BoxQualityFunction::upper_bound(&substate);
+                        }
+                    }
+                }
+            }
+            for (int k=0; k<numstates; k++)
+                states[k].upper = quality_bound[k];
+        }
+
+        // any number of levels, with the cells of the model
+        double upper_bound_any(const sstate* state) const;
 
     public:
+        PyramidQualityFunction() : width(0), height(0), numlevels(0), precision(64), 
+                                   coarse(0), numthreads(1), model(NULL), numpoints(0),
+                                   pointx(NULL), pointy(NULL), pointc(NULL) { }
+
+        // store the integral images with 64 (double) or 32 (float) bits
+        void set_precision(int bits);
+
+        // coarse integral images for all cells, see BoxQualityFunction::set_coarse
+        void set_coarse(int factor);
+
+        // number of threads that set up the cells in parallel
+        void set_numthreads(int argnumthreads);
+
+        // argdata is the PyramidModel
         void setup(int argnumpoints, int argwidth, int argheight, 
                                 double* argxpos, double* argypos, double* argclst, 
                                 void* argdata);
 
         void cleanup();
 
-        double upper_bound(const sstate* state) const;
+        // specialized for the common pyramids of 1 to 4 levels
+        double upper_bound(const sstate* state) const {
+            switch (numlevels) {
+                case 1: return upper_bound_levels<1>(state);
+                case 2: return upper_bound_levels<2>(state);
+                case 3: return upper_bound_levels<3>(state);
+                case 4: return upper_bound_levels<4>(state);
+                default: return upper_bound_any(state);
+            }
+        }
+
+        // Bounds of numstates states at once, stored in their upper fields,
+        // e.g. for the children of one split. The loop over the cells is the
+        // outer one, so the integral images of a cell are read for all states
+        // while they are in the cache. The sums are the same as upper_bound().
+        void upper_bound_batch(sstate* states, int numstates) const {
+            for (int first=0; first<numstates; first+=BATCHSIZE) {
+                const int num = std::min<int>(numstates-first, BATCHSIZE);
+                switch (numlevels) {
+                    case 1: upper_bound_batch_levels<1>(&states[first], num); break;
+                    case 2: upper_bound_batch_levels<2>(&states[first], num); break;
+                    case 3: upper_bound_batch_levels<3>(&states[first], num); break;
+                    case 4: upper_bound_batch_levels<4>(&states[first], num); break;
+                    default:
+                        for (int k=first; k<first+num; k++)
+                            states[k].upper = upper_bound_any(&states[k]);
+                }
+            }
+        }
+
+        // with precision 32, the bounds include the rounding error of the
+        // float images, so the score is summed up from the points
+        double box_score(const sstate* state) const;
+
+        bool remove_box(int left, int top, int right, int bottom);
+
+        long memory_usage() const;
 };
 
 #endif
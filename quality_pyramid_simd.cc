@@ -0,0 +1,299 @@
+/********************************************************
+ *                                                      *
+ *  Efficient Subwindow Search (ESS) implemented in C++ *
+ *  bound for sum of grid cells, e.g. spatial pyramid   *
+ *  with the integral images of all cells interleaved   *
+ *  per pixel, for vectorized bound evaluation          *
+ *                                                      *
+ *   Copyright 2006-2008 Christoph Lampert              *
+ *   Contact: <mail@christoph-lampert.org>              *
+ *                                                      *
+ *  Licensed under the Apache License, Version 2.0 (the *
+ *  "License"); you may not use this file except in     *
+ *  compliance with the License. You may obtain a copy  *
+ *  of the License at                                   *
+ *                                                      *
+ *     http://www.apache.org/licenses/LICENSE-2.0       *
+ *                                                      *
+ *  Unless required by applicable law or agreed to in   *
+ *  writing, software distributed under the License is  *
+ *  distributed on an "AS IS" BASIS, WITHOUT WARRANTIES *
+ *  OR CONDITIONS OF ANY KIND, either express or        *
+ *  implied. See the License for the specific language  *
+ *  governing permissions and limitations under the     *
+ *  License.                                            *
+ *                                                      *
+ ********************************************************/
+
+#include <vector>
+
+#include "ess.hh"
+#include "quality_pyramid_simd.hh"
+
+#ifdef ESS_HAVE_AVX2
+#include <immintrin.h>
+#ifdef __GNUC__
+#define AVX2_TARGET __attribute__((target("avx2")))
+#else
+#define AVX2_TARGET
+#endif
+#endif
+
+InterleavedPyramidQualityFunction::InterleavedPyramidQualityFunction() 
+    : width(0), height(0), numcells(0), stride(0) {
+#if defined(ESS_HAVE_AVX2) && defined(__GNUC__)
+    __builtin_cpu_init();   // the context can be a static object
+    use_avx2 = __builtin_cpu_supports("avx2");
+#elif defined(ESS_HAVE_AVX2)
+    use_avx2 = true;        // compiled for AVX2 only
+#endif
+}
+
+void InterleavedPyramidQualityFunction::create_integral_matrices() {
+    neg_matrix.assign( pos_matrix.size(), 0. );
+
+    // split the weight matrix into positive and negative entries
+    for (unsigned long i=0; i < pos_matrix.size(); i++) {
+        const double val = pos_matrix[i];
+        if (val <= 0.) {
+            pos_matrix[i] = 0.;
+            neg_matrix[i] = val;
+        }
+    }
+
+    // calculate integral image verically, all cells of a pixel at once
+    for (int j=1; j < height; j++) {
+        for (int i=1; i < width; i++) {
+            double* pos = &pos_matrix[off(i,j)];
+            double* neg = &neg_matrix[off(i,j)];
+            const double* pos_above = &pos_matrix[off(i,j-1)];
+            const double* neg_above = &neg_matrix[off(i,j-1)];
+            for (unsigned int c=0; c < stride; c++) {
+                pos[c] += pos_above[c];
+                neg[c] += neg_above[c];
+            }
+        }
+    }
+    // calculate integral image horizontally
+    for (int j=1; j<height; j++) {
+        for (int i=1; i<width; i++) {
+            double* pos = &pos_matrix[off(i,j)];
+            double* neg = &neg_matrix[off(i,j)];
+            const double* pos_left = &pos_matrix[off(i-1,j)];
+            const double* neg_left = &neg_matrix[off(i-1,j)];
+            for (unsigned int c=0; c < stride; c++) {
+                pos[c] += pos_left[c];
+                neg[c] += neg_left[c];
+            }
+        }
+    }
+    return;
+}
+
+void InterleavedPyramidQualityFunction::setup(int argnumpoints, int argwidth, int argheight,
+                                              double* argxpos, double* argypos, double* argclst,
+                                              void* argdata) {
+    const PyramidModel* model = reinterpret_cast<const PyramidModel*>(argdata);
+
+    width = argwidth;
+    height = argheight;
+
+    const std::vector<Cell> &cells = model->cells;
+    numcells = cells.size();
+    stride = (numcells+3) & ~3u;
+
+    cell_left.assign(stride, 0.f);
+    cell_top.assign(stride, 0.f);
+    cell_right.assign(stride, 0.f);
+    cell_bottom.assign(stride, 0.f);
+    cell_weights.assign(stride, 0.);
+    for (unsigned int c=0; c < numcells; c++) {
+        cell_left[c] = cells[c].left;
+        cell_top[c] = cells[c].top;
+        cell_right[c] = cells[c].right;
+        cell_bottom[c] = cells[c].bottom;
+        cell_weights[c] = 1.;   // weighting comes later
+    }
+
+    // one pass over the points fills the raw weights of all cells,
+    // we pad +1 so we can avoid boundary checks later
+    pos_matrix.assign(static_cast<unsigned long>(argwidth)*argheight*stride, 0.);
+    for (int k=0; k<argnumpoints; k++) {
+        const int x = static_cast<int>(argxpos[k])+1;
+        const int y = static_cast<int>(argypos[k])+1;
+        const double* weight = model->weights_of(static_cast<int>(argclst[k]));
+        double* raw = &pos_matrix[off(x,y)];
+        for (unsigned int c=0; c < numcells; c++)
+            raw[c] += weight[c*model->cell_stride];
+    }
+    create_integral_matrices();
+    return;
+}
+
+void InterleavedPyramidQualityFunction::cleanup() {
+    return;
+}
+
+// reference version, computes the same as PyramidQualityFunction
+double InterleavedPyramidQualityFunction::upper_bound_scalar(const sstate* state) const {
+    double quality_bound=0.;
+    for (unsigned int c=0; c < numcells; c++) {
+        const float l = cell_left[c];
+        const float t = cell_top[c];
+        const float r = cell_right[c];
+        const float b = cell_bottom[c];
+
+        // corners of the cell, see PyramidQualityFunction::rel_to_abs_coordinate
+        const int low0  = static_cast<short>((1-l)*state->low[0]  + l*state->low[2] );
+        const int high0 = static_cast<short>((1-l)*state->high[0] + l*state->high[2]);
+        const int low2  = static_cast<short>((1-r)*state->low[0]  + r*state->low[2] );
+        const int high2 = static_cast<short>((1-r)*state->high[0] + r*state->high[2]);
+        const int low1  = static_cast<short>((1-t)*state->low[1]  + t*state->low[3] );
+        const int high1 = static_cast<short>((1-t)*state->high[1] + t*state->high[3]);
+        const int low3  = static_cast<short>((1-b)*state->low[1]  + b*state->low[3] );
+        const int high3 = static_cast<short>((1-b)*state->high[1] + b*state->high[3]);
+
+        double fplus = 0.;
+        if ((low0 <= high2) && (low1 <= high3)) {
+            fplus = pos_matrix[off(high2,high3)+c] - pos_matrix[off(high2,low1-1)+c]
+                    - pos_matrix[off(low0-1,high3)+c] + pos_matrix[off(low0-1,low1-1)+c];
+        }
+        double fminus = 0.;
+        if ((high0 <= low2) && (high1 <= low3)) {
+            fminus = neg_matrix[off(low2,low3)+c] - neg_matrix[off(low2,high1-1)+c]
+                     - neg_matrix[off(high0-1,low3)+c] + neg_matrix[off(high0-1,high1-1)+c];
+        }
+        quality_bound += cell_weights[c] * (fplus+fminus);
+    }
+    return quality_bound;
+}
+
+#ifdef ESS_HAVE_AVX2
+
+// sum of 4 rectangles, one per lane, from the interleaved integral image.
+// lane holds the cell offsets c..c+3 of the current block of cells.
+AVX2_TARGET
+static inline __m256d rect_val_x4(const double* matrix, __m128i xl, __m128i yl,
+                                  __m128i xh, __m128i yh, __m128i rowwidth,
+                                  __m256i stride, __m256i lane) {
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i xl1 = _mm_sub_epi32(xl, one);
+    const __m128i yl1 = _mm_sub_epi32(yl, one);
+
+    // pixel indices y*width+x fit in 32 bit, the interleaved offsets may not
+    const __m256i p_hh = _mm256_cvtepi32_epi64(_mm_add_epi32(_mm_mullo_epi32(yh, rowwidth), xh));
+    const __m256i p_hl = _mm256_cvtepi32_epi64(_mm_add_epi32(_mm_mullo_epi32(yl1, rowwidth), xh));
+    const __m256i p_lh = _mm256_cvtepi32_epi64(_mm_add_epi32(_mm_mullo_epi32(yh, rowwidth), xl1));
+    const __m256i p_ll = _mm256_cvtepi32_epi64(_mm_add_epi32(_mm_mullo_epi32(yl1, rowwidth), xl1));
+
+    const __m256d v_hh = _mm256_i64gather_pd(matrix, _mm256_add_epi64(_mm256_mul_epu32(p_hh, stride), lane), 8);
+    const __m256d v_hl = _mm256_i64gather_pd(matrix, _mm256_add_epi64(_mm256_mul_epu32(p_hl, stride), lane), 8);
+    const __m256d v_lh = _mm256_i64gather_pd(matrix, _mm256_add_epi64(_mm256_mul_epu32(p_lh, stride), lane), 8);
+    const __m256d v_ll = _mm256_i64gather_pd(matrix, _mm256_add_epi64(_mm256_mul_epu32(p_ll, stride), lane), 8);
+    const __m256d val = _mm256_add_pd(_mm256_sub_pd(_mm256_sub_pd(v_hh, v_hl), v_lh), v_ll);
+
+    // empty rectangles contribute 0
+    const __m128i empty = _mm_or_si128(_mm_cmpgt_epi32(xl, xh), _mm_cmpgt_epi32(yl, yh));
+    return _mm256_andnot_pd(_mm256_castsi256_pd(_mm256_cvtepi32_epi64(empty)), val);
+}
+
+// interpolate between two coordinates of the state and truncate, like
+// PyramidQualityFunction::rel_to_abs_coordinate does for a single cell
+AVX2_TARGET
+static inline __m128i interpolate_x4(__m128 rel, float a, float b) {
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 val = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(one, rel), _mm_set1_ps(a)),
+                                  _mm_mul_ps(rel, _mm_set1_ps(b)));
+    return _mm_cvttps_epi32(val);
+}
+
+// vectorized version, 4 cells at a time
+AVX2_TARGET
+double InterleavedPyramidQualityFunction::upper_bound_avx2(const sstate* state) const {
+    const __m128i rowwidth = _mm_set1_epi32(width);
+    const __m256i vstride = _mm256_set1_epi64x(stride);
+    __m256d quality_bound = _mm256_setzero_pd();
+
+    for (unsigned int c=0; c < stride; c+=4) {
+        const __m128 l = _mm_loadu_ps(&cell_left[c]);
+        const __m128 t = _mm_loadu_ps(&cell_top[c]);
+        const __m128 r = _mm_loadu_ps(&cell_right[c]);
+        const __m128 b = _mm_loadu_ps(&cell_bottom[c]);
+
+        const __m128i low0  = interpolate_x4(l, state->low[0],  state->low[2]);
+        const __m128i high0 = interpolate_x4(l, state->high[0], state->high[2]);
+        const __m128i low2  = interpolate_x4(r, state->low[0],  state->low[2]);
+        const __m128i high2 = interpolate_x4(r, state->high[0], state->high[2]);
+        const __m128i low1  = interpolate_x4(t, state->low[1],  state->low[3]);
+        const __m128i high1 = interpolate_x4(t, state->high[1], state->high[3]);
+        const __m128i low3  = interpolate_x4(b, state->low[1],  state->low[3]);
+        const __m128i high3 = interpolate_x4(b, state->high[1], state->high[3]);
+
+        const __m256i lane = _mm256_setr_epi64x(c, c+1, c+2, c+3);
+        const __m256d fplus = rect_val_x4(&pos_matrix[0], low0, low1, high2, high3,
+                                          rowwidth, vstride, lane);
+        const __m256d fminus = rect_val_x4(&neg_matrix[0], high0, high1, low2, low3,
+                                           rowwidth, vstride, lane);
+        const __m256d weight = _mm256_loadu_pd(&cell_weights[c]);
+        quality_bound = _mm256_add_pd(quality_bound,
+                                      _mm256_mul_pd(weight, _mm256_add_pd(fplus, fminus)));
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, quality_bound);
+    return (lanes[0]+lanes[1]) + (lanes[2]+lanes[3]);
+}
+
+#endif
+
+void InterleavedPyramidQualityFunction::remove_box_from_matrix(int left, int top, int right, int bottom,
+                                                               std::vector<double> &matrix) {
+    // box_sum(x,y) is the sum over [left,x]x[top,y] for every cell,
+    // read off the integral image
+    const int boxwidth = right-left+1;
+    const int boxheight = bottom-top+1;
+    std::vector<double> box_sum(static_cast<unsigned long>(boxwidth)*boxheight*stride);
+    for (int j=0; j < boxheight; j++) {
+        for (int i=0; i < boxwidth; i++) {
+            double* cur = &box_sum[(static_cast<unsigned long>(j)*boxwidth+i)*stride];
+            const double* hh = &matrix[off(left+i,top+j)];
+            const double* hl = &matrix[off(left+i,top-1)];
+            const double* lh = &matrix[off(left-1,top+j)];
+            const double* ll = &matrix[off(left-1,top-1)];
+            for (unsigned int c=0; c < stride; c++)
+                cur[c] = hh[c] - hl[c] - lh[c] + ll[c];
+        }
+    }
+
+    // every entry right/below of (left,top) contains a part of the box:
+    // the part up to its own coordinates, clipped at the box boundary
+    for (int y=top; y < height; y++) {
+        const int j = (y < bottom ? y : bottom) - top;
+        for (int x=left; x < width; x++) {
+            const int i = (x < right ? x : right) - left;
+            double* cur = &matrix[off(x,y)];
+            const double* sub = &box_sum[(static_cast<unsigned long>(j)*boxwidth+i)*stride];
+            for (unsigned int c=0; c < stride; c++)
+                cur[c] -= sub[c];
+        }
+    }
+    return;
+}
+
+bool InterleavedPyramidQualityFunction::remove_box(int left, int top, int right, int bottom) {
+    // clip to the image, row/column 0 is padding and always empty
+    if (left < 1) left = 1;
+    if (top < 1) top = 1;
+    if (right > width-1) right = width-1;
+    if (bottom > height-1) bottom = height-1;
+    if ((left > right) || (top > bottom))
+        return true;
+
+    remove_box_from_matrix(left, top, right, bottom, pos_matrix);
+    remove_box_from_matrix(left, top, right, bottom, neg_matrix);
+    return true;
+}
+
+long InterleavedPyramidQualityFunction::memory_usage() const {
+    return (pos_matrix.capacity() + neg_matrix.capacity()) * sizeof(double);
+}
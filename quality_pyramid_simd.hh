@@ -0,0 +1,111 @@
+/********************************************************
+ *                                                      *
+ *  Efficient Subwindow Search (ESS) implemented in C++ *
+ *  bound for sum of grid cells, e.g. spatial pyramid   *
+ *  with the integral images of all cells interleaved   *
+ *  per pixel, for vectorized bound evaluation          *
+ *                                                      *
+ *   Copyright 2006-2008 Christoph Lampert              *
+ *   Contact: <mail@christoph-lampert.org>              *
+ *                                                      *
+ *  Licensed under the Apache License, Version 2.0 (the *
+ *  "License"); you may not use this file except in     *
+ *  compliance with the License. You may obtain a copy  *
+ *  of the License at                                   *
+ *                                                      *
+ *     http://www.apache.org/licenses/LICENSE-2.0       *
+ *                                                      *
+ *  Unless required by applicable law or agreed to in   *
+ *  writing, software distributed under the License is  *
+ *  distributed on an "AS IS" BASIS, WITHOUT WARRANTIES *
+ *  OR CONDITIONS OF ANY KIND, either express or        *
+ *  implied. See the License for the specific language  *
+ *  governing permissions and limitations under the     *
+ *  License.                                            *
+ *                                                      *
+ ********************************************************/
+
+#ifndef _QUALITY_PYRAMID_SIMD_H
+#define _QUALITY_PYRAMID_SIMD_H
+
+#include <vector>
+
+#include "ess.hh"
+#include "quality_function.hh"
+#include "quality_pyramid.hh"
+
+// Same quality function as PyramidQualityFunction, which stays the
+// reference implementation, but with a different memory layout:
+// instead of one pair of integral images per cell, there is one pair
+// of images that holds the values of all cells next to each other for
+// every pixel. Cells whose corners fall onto the same pixel (e.g. the
+// left border of all cells in the first column of every level) then
+// share cache lines, and the bounds of 4 cells at a time are computed
+// with AVX2 gathers. Without AVX2, a portable loop is used instead.
+
+// With GCC or clang on x86, the AVX2 code is compiled in even without 
+// -mavx2, and used if the CPU has AVX2
+#if defined(__AVX2__) || (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)))
+#define ESS_HAVE_AVX2
+#endif
+
+class InterleavedPyramidQualityFunction : public QualityFunction {
+
+    private:
+        int width,height;
+        unsigned int numcells;
+        unsigned int stride;    // numcells, rounded up to a multiple of 4
+
+        // cell coordinates and weights as separate arrays of length stride,
+        // unused cells at the end have weight 0
+        std::vector<float> cell_left;
+        std::vector<float> cell_top;
+        std::vector<float> cell_right;
+        std::vector<float> cell_bottom;
+        std::vector<double> cell_weights;
+
+        // integral images, entry (x,y) of cell c is at off(x,y)+c
+        std::vector<double> pos_matrix;
+        std::vector<double> neg_matrix;
+
+        inline unsigned long off(unsigned int x, unsigned int y) const {
+            return (static_cast<unsigned long>(y)*width+x)*stride;
+        }
+
+        // create separate integral images for positive and negative part
+        // of the original weight matrix, which is passed in pos_matrix
+        void create_integral_matrices();
+
+        // subtract the part of an integral image that lies inside the box
+        void remove_box_from_matrix(int left, int top, int right, int bottom,
+                                    std::vector<double> &matrix);
+
+        double upper_bound_scalar(const sstate* state) const;
+#ifdef ESS_HAVE_AVX2
+        bool use_avx2;          // the CPU has AVX2
+        double upper_bound_avx2(const sstate* state) const;
+#endif
+
+    public:
+        InterleavedPyramidQualityFunction();
+
+        void setup(int argnumpoints, int argwidth, int argheight,
+                   double* argxpos, double* argypos, double* argclst,
+                   void* argdata);
+
+        void cleanup();
+
+        double upper_bound(const sstate* state) const {
+#ifdef ESS_HAVE_AVX2
+            if (use_avx2)
+                return upper_bound_avx2(state);
+#endif
+            return upper_bound_scalar(state);
+        }
+
+        bool remove_box(int left, int top, int right, int bottom);
+
+        long memory_usage() const;
+};
+
+#endif
@@ -0,0 +1,68 @@
+/********************************************************
+ *                                                      *
+ *  Efficient Subwindow Search (ESS) implemented in C++ *
+ *  bounds for ranges of tiles of a large image         *
+ *                                                      *
+ *   Copyright 2006-2008 Christoph Lampert              *
+ *   Contact: <mail@christoph-lampert.org>              *
+ *                                                      *
+ *  Licensed under the Apache License, Version 2.0 (the *
+ *  "License"); you may not use this file except in     *
+ *  compliance with the License. You may obtain a copy  *
+ *  of the License at                                   *
+ *                                                      *
+ *     http://www.apache.org/licenses/LICENSE-2.0       *
+ *                                                      *
+ *  Unless required by applicable law or agreed to in   *
+ *  writing, software distributed under the License is  *
+ *  distributed on an "AS IS" BASIS, WITHOUT WARRANTIES *
+ *  OR CONDITIONS OF ANY KIND, either express or        *
+ *  implied. See the License for the specific language  *
+ *  governing permissions and limitations under the     *
+ *  License.                                            *
+ *                                                      *
+ ********************************************************/
+
+#include <vector>
+
+#include "ess.hh"
+#include "quality_tile.hh"
+#include "quality_pyramid.hh"
+
+void TileQualityFunction::setup(int argnumpoints, int argwidth, int argheight, 
+                                double* argtilex, double* argtiley, double* argclst, 
+                                void* argdata) {
+    const PyramidModel* model = reinterpret_cast<const PyramidModel*>(argdata);
+    width = argwidth;
+    height = argheight;
+    pos_matrix.assign(width*height, 0.);
+    neg_matrix.assign(width*height, 0.);
+
+    // we pad +1, row and column 0 stay empty
+    for (int k=0; k<argnumpoints; k++) {
+        const int x = static_cast<int>(argtilex[k])+1;
+        const int y = static_cast<int>(argtiley[k])+1;
+        const double weight = model->weights_of(static_cast<int>(argclst[k]))[0];
+        if (weight > 0.)
+            pos_matrix[off(x,y)] += weight;
+        else
+            neg_matrix[off(x,y)] += weight;
+    }
+
+    // integral images: each entry is the one above plus the row so far
+    for (int j=1; j < height; j++) {
+        double pos_sum = 0.;
+        double neg_sum = 0.;
+        for (int i=1; i < width; i++) {
+            pos_sum += pos_matrix[off(i,j)];
+            neg_sum += neg_matrix[off(i,j)];
+            pos_matrix[off(i,j)] = pos_matrix[off(i,j-1)] + pos_sum;
+            neg_matrix[off(i,j)] = neg_matrix[off(i,j-1)] + neg_sum;
+        }
+    }
+    return;
+}
+
+long TileQualityFunction::memory_usage() const {
+    return (pos_matrix.capacity() + neg_matrix.capacity()) * sizeof(double);
+}
@@ -0,0 +1,84 @@
+/********************************************************
+ *                                                      *
+ *  Efficient Subwindow Search (ESS) implemented in C++ *
+ *  bounds for ranges of tiles of a large image         *
+ *                                                      *
+ *   Copyright 2006-2008 Christoph Lampert              *
+ *   Contact: <mail@christoph-lampert.org>              *
+ *                                                      *
+ *  Licensed under the Apache License, Version 2.0 (the *
+ *  "License"); you may not use this file except in     *
+ *  compliance with the License. You may obtain a copy  *
+ *  of the License at                                   *
+ *                                                      *
+ *     http://www.apache.org/licenses/LICENSE-2.0       *
+ *                                                      *
+ *  Unless required by applicable law or agreed to in   *
+ *  writing, software distributed under the License is  *
+ *  distributed on an "AS IS" BASIS, WITHOUT WARRANTIES *
+ *  OR CONDITIONS OF ANY KIND, either express or        *
+ *  implied. See the License for the specific language  *
+ *  governing permissions and limitations under the     *
+ *  License.                                            *
+ *                                                      *
+ ********************************************************/
+
+#ifndef _QUALITY_TILE_H
+#define _QUALITY_TILE_H
+
+#include <vector>
+
+#include "ess.hh"
+#include "quality_function.hh"
+
+// Bounds on a grid of tiles of a large image. The coordinates of a state 
+// are tiles: it holds all boxes in pixels whose edges lie in the given 
+// ranges of tiles. Setup gets the tile of every point and the 
+// PyramidModel of a 1-level pyramid.
+//
+// Every box of a state lies inside the tiles its largest box touches, 
+// which bounds the positive part. But its edges can be anywhere inside 
+// the tiles high[0], high[1], low[2] and low[3], so the only tiles it 
+// surely contains are those strictly inside the smallest box. The 
+// negative part is taken from these. A box can contain only some of the
+// points of a tile, so unlike for pixels, the positive and negative 
+// weights of a tile are summed up separately, point by point.
+class TileQualityFunction : public QualityFunction {
+
+    private:
+        int width,height;
+        std::vector<double> pos_matrix;
+        std::vector<double> neg_matrix;
+
+        inline unsigned int off(unsigned int x, unsigned int y) const {
+            return y*width+x;
+        }
+
+        double rect_val(int xl, int yl, int xh, int yh, const std::vector<double> &matrix) const {
+            if ((xl > xh) || (yl > yh)) return 0.;
+            return matrix[off(xh,yh)] - matrix[off(xh,yl-1)] - matrix[off(xl-1,yh)] + matrix[off(xl-1,yl-1)];
+        }
+
+    public:
+        TileQualityFunction() : width(0), height(0) { }
+
+        void setup(int argnumpoints, int argwidth, int argheight, 
+                   double* argtilex, double* argtiley, double* argclst, 
+                   void* argdata);
+
+        double upper_bound(const sstate* s) const {
+            return rect_val(s->low[0], s->low[1], s->high[2], s->high[3], pos_matrix)
+                   + rect_val(s->high[0]+1, s->high[1]+1, s->low[2]-1, s->low[3]-1, neg_matrix);
+        }
+
+        // sum of the weights in the tiles [left,right]x[top,bottom], 
+        // in padded coordinates
+        double sum(int left, int top, int right, int bottom) const {
+            return rect_val(left, top, right, bottom, pos_matrix) 
+                   + rect_val(left, top, right, bottom, neg_matrix);
+        }
+
+        long memory_usage() const;
+};
+
+#endif